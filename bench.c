@@ -0,0 +1,486 @@
+/*
+  GR4V1TYOS bench - micro and macro benchmarks for the virtual filesystem and app code
+  - Build: gcc -O2 -pthread -o bench bench.c -lm  (kernel.c is compiled in, without its shell main)
+  - Runs in a fresh temporary directory, so the real savdisk.* files are never touched
+  - Generates a synthetic tree (depth, fan-out, files per dir, file size distribution),
+    then times mkdir, write, cat, find_or_create_dir_by_path, resolve_path, the find and grep
+    commands, snapshot/restore, save_filesystem, load_filesystem, app install/run/uninstall,
+    calc -f over a column and over a file of expressions, rm and rmdir
+  - Prints one JSON object per operation on stdout:
+      {"op":"write","count":9360,"total_ms":...,"ops_per_sec":...,"mb_per_sec":...,"p50_us":...,"p99_us":...}
+  - Options: --depth N --fanout N --files N --size BYTES --dist fixed|uniform|exp
+             --iters N --seed N --deferred (batch-mode persistence instead of the journal)
+             --codec none|lz (how save_filesystem stores bodies in the image)
+             --threads N (workers decoding an lz image at load; default one per CPU)
+*/
+
+#define GR4V1TYOS_NO_MAIN
+#include "kernel.c"
+
+#include <math.h>
+
+typedef struct BenchOpts {
+    int depth;
+    int fanout;
+    int files;
+    size_t size;
+    const char* dist;
+    int iters;
+    unsigned seed;
+    int deferred;
+    const char* codec;
+    int threads;
+} BenchOpts;
+
+// latencies of one operation, in microseconds
+typedef struct Samples {
+    double* v;
+    int n, cap;
+    size_t bytes;
+    double total_us;
+} Samples;
+
+FILE* report;
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void sample_add(Samples* s, double us, size_t bytes) {
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap*2 : 1024;
+        s->v = (double*)realloc(s->v, s->cap * sizeof(double));
+    }
+    s->v[s->n++] = us;
+    s->total_us += us;
+    s->bytes += bytes;
+}
+
+int cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(Samples* s, double p) {
+    if (!s->n) return 0;
+    int i = (int)(p * (s->n - 1) + 0.5);
+    return s->v[i];
+}
+
+// prints the summary line for one operation and resets the samples
+void sample_report(const char* op, Samples* s) {
+    qsort(s->v, s->n, sizeof(double), cmp_double);
+    double secs = s->total_us / 1e6;
+    fprintf(report, "{\"op\":\"%s\",\"count\":%d,\"total_ms\":%.3f,\"ops_per_sec\":%.1f", op, s->n,
+            s->total_us / 1e3, secs > 0 ? s->n / secs : 0);
+    if (s->bytes) fprintf(report, ",\"mb_per_sec\":%.2f", secs > 0 ? s->bytes / secs / (1024.0*1024.0) : 0);
+    fprintf(report, ",\"p50_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f}\n",
+            percentile(s, 0.50), percentile(s, 0.99), s->n ? s->v[s->n-1] : 0);
+    fflush(report);
+    free(s->v);
+    memset(s, 0, sizeof(*s));
+}
+
+size_t max_size;
+
+// fixed: every file is 'size' bytes; uniform: 0..2*size; exp: exponential with mean 'size'
+size_t pick_size(BenchOpts* o) {
+    size_t n = o->size;
+    if (strcmp(o->dist, "uniform") == 0) n = o->size ? (size_t)rand() % (2*o->size + 1) : 0;
+    else if (strcmp(o->dist, "exp") == 0) {
+        double u = (rand() + 1.0) / ((double)RAND_MAX + 2.0);
+        n = (size_t)(-log(u) * (double)o->size);
+    }
+    return n < max_size ? n : max_size;
+}
+
+// synthetic tree: every directory down to 'depth' gets 'fanout' subdirectories
+// and 'files' files; dirs[] collects all of them in creation order
+Directory** dirs;
+int ndirs, dirs_cap;
+
+void build_tree(BenchOpts* o, Directory* d, int level, Samples* mk, Samples* wr, char* buf) {
+    if (ndirs == dirs_cap) {
+        dirs_cap = dirs_cap ? dirs_cap*2 : 256;
+        dirs = (Directory**)realloc(dirs, dirs_cap * sizeof(Directory*));
+    }
+    dirs[ndirs++] = d;
+    for (int i=0;i<o->files;i++) {
+        char name[MAX_NAME];
+        snprintf(name, sizeof(name), "file%d.txt", i);
+        size_t len = pick_size(o);
+        Content body = {0};
+        double t = now_us();
+        content_append(&body, buf, len);
+        vfs_write_file(d, name, &body);
+        sample_add(wr, now_us() - t, len);
+    }
+    if (level == o->depth) return;
+    for (int i=0;i<o->fanout;i++) {
+        char name[MAX_NAME];
+        snprintf(name, sizeof(name), "dir%d", i);
+        double t = now_us();
+        Directory* sd = vfs_mkdir(d, name);
+        sample_add(mk, now_us() - t, 0);
+        build_tree(o, sd, level+1, mk, wr, buf);
+    }
+}
+
+// walks dirs[] again after a reload, which replaced every node
+void collect_dirs(Directory* d) {
+    if (ndirs == dirs_cap) {
+        dirs_cap = dirs_cap ? dirs_cap*2 : 256;
+        dirs = (Directory**)realloc(dirs, dirs_cap * sizeof(Directory*));
+    }
+    dirs[ndirs++] = d;
+    for (int i=0;i<d->subdirs.used;i++) {
+        Directory* sd = (Directory*)d->subdirs.slots[i].node;
+        if (sd) collect_dirs(sd);
+    }
+}
+
+// what the cat command does: bodies through the shell output buffer, onto sink
+void bench_cat(const char* op, FILE* sink) {
+    Samples s = {0};
+    shell_out = outbuf_new(fileno(sink));
+    for (int i=0;i<ndirs;i++) {
+        Directory* d = dirs[i];
+        for (int j=0;j<d->files.used;j++) {
+            File* f = (File*)d->files.slots[j].node;
+            if (!f) continue;
+            double t = now_us();
+            File* g = find_file(d, f->name);
+            out_file(g);
+            sample_add(&s, now_us() - t, file_size(g));
+        }
+    }
+    out_flush();
+    free(shell_out);
+    shell_out = NULL;
+    sample_report(op, &s);
+}
+
+void bench_lookup(BenchOpts* o) {
+    Samples s = {0};
+    char path[1024];
+    for (int it=0;it<o->iters;it++) {
+        for (int i=0;i<ndirs;i++) {
+            dir_path(dirs[i], path, sizeof(path));
+            double t = now_us();
+            find_or_create_dir_by_path(path);
+            sample_add(&s, now_us() - t, 0);
+        }
+    }
+    sample_report("find_or_create_dir_by_path", &s);
+}
+
+// absolute file paths resolved the way shell commands do (dentry cache, then the file table)
+void bench_resolve(BenchOpts* o) {
+    Samples s = {0};
+    char path[1024], name[MAX_NAME];
+    for (int it=0;it<o->iters;it++) {
+        for (int i=0;i<ndirs;i++) {
+            Directory* d = dirs[i];
+            for (int j=0;j<d->files.used;j++) {
+                File* f = (File*)d->files.slots[j].node;
+                if (!f) continue;
+                snprintf(path, sizeof(path), "%s%s", d->path, f->name);
+                double t = now_us();
+                Directory* pd = resolve_parent(path, name, sizeof(name));
+                File* g = pd ? find_file(pd, name) : NULL;
+                sample_add(&s, now_us() - t, 0);
+                if (g != f) fprintf(stderr, "bench: %s resolved wrong\n", path);
+            }
+        }
+    }
+    sample_report("resolve_path", &s);
+}
+
+// the shell's find and grep, answered from the name and word indexes (output goes to /dev/null)
+void bench_search(BenchOpts* o) {
+    Samples fs = {0}, gs = {0};
+    char name[MAX_NAME];
+    for (int it=0;it<o->iters;it++) {
+        for (int i=0;i<o->files;i++) {
+            snprintf(name, sizeof(name), "file%d.txt", i);
+            double t = now_us();
+            cmd_find(name);
+            sample_add(&fs, now_us() - t, 0);
+        }
+        for (int i=0;i<o->fanout;i++) {
+            snprintf(name, sizeof(name), "dir%d", i);
+            double t = now_us();
+            cmd_find(name);
+            sample_add(&fs, now_us() - t, 0);
+        }
+        // the synthetic bodies are one long run of letters, so only the shortest files hold a word
+        const char* words[] = { "abc", "abcdefgh", "nosuchword" };
+        for (int i=0;i<3;i++) {
+            double t = now_us();
+            cmd_grep(words[i]);
+            sample_add(&gs, now_us() - t, 0);
+        }
+    }
+    sample_report("find", &fs);
+    sample_report("grep", &gs);
+}
+
+// taking a snapshot, the first write of every file after it (which records
+// the old body), and restoring it (which writes every old body back)
+void bench_snapshot(BenchOpts* o, const char* buf) {
+    Samples sn = {0}, wr = {0}, rs = {0};
+    for (int it=0;it<o->iters;it++) {
+        double t = now_us();
+        Snapshot* s = vfs_snapshot("bench", 0);
+        sample_add(&sn, now_us() - t, 0);
+        for (int i=0;i<ndirs;i++) {
+            Directory* d = dirs[i];
+            for (int j=0;j<d->files.used;j++) {
+                File* f = (File*)d->files.slots[j].node;
+                if (!f) continue;
+                Content body = {0};
+                t = now_us();
+                content_append(&body, buf + it + 1, 64);
+                vfs_write_file(d, f->name, &body);
+                sample_add(&wr, now_us() - t, 64);
+            }
+        }
+        t = now_us();
+        vfs_restore(s);
+        sample_add(&rs, now_us() - t, 0);
+        vfs_unsnapshot(s);
+    }
+    sample_report("snapshot", &sn);
+    sample_report("write_after_snapshot", &wr);
+    sample_report("restore", &rs);
+}
+
+void bench_save_load(BenchOpts* o) {
+    Samples sv = {0}, ld = {0};
+    for (int it=0;it<o->iters;it++) {
+        double t = now_us();
+        save_filesystem();
+        struct stat st;
+        size_t bytes = stat(IMAGE_FILE, &st) == 0 ? (size_t)st.st_size : 0;
+        sample_add(&sv, now_us() - t, bytes);
+
+        journal_close();
+        vfs_release_all();
+        image_unmap();
+        t = now_us();
+        root = create_dir("/", NULL);
+        current_dir = root;
+        load_filesystem();
+        sample_add(&ld, now_us() - t, bytes);
+        if (!journal_deferred) {
+            journal_open();
+            writeback_start();
+        }
+    }
+    sample_report("save_filesystem", &sv);
+    sample_report("load_filesystem", &ld);
+    ndirs = 0;
+    collect_dirs(root);
+}
+
+void bench_apps(BenchOpts* o) {
+    Samples in = {0}, run = {0}, un = {0}, comp = {0}, loop = {0};
+    for (int it=0;it<o->iters*10;it++) {
+        double t = now_us();
+        install_app_command("hello");
+        sample_add(&in, now_us() - t, 0);
+        t = now_us();
+        run_app_command("hello");
+        sample_add(&run, now_us() - t, 0);
+        t = now_us();
+        uninstall_app_command("hello");
+        sample_add(&un, now_us() - t, 0);
+    }
+    sample_report("app_install", &in);
+    sample_report("app_run", &run);
+    sample_report("app_uninstall", &un);
+
+    // a script that does real work: compile (cache miss) once per iteration, then run
+    Directory* appdir = find_or_create_dir_by_path("/apps");
+    for (int it=0;it<o->iters;it++) {
+        Content m = {0};
+        char code[512];
+        snprintf(code, sizeof(code),
+                 "APP_NAME=benchloop\nAPP_DESC=bench\nCODE=\n"
+                 "# variant %d\n"
+                 "mkdir \"/benchout\"\n"
+                 "s = 0\n"
+                 "for i = 1 to 100000\n  s = s + i %% 7\nend\n"
+                 "for i = 1 to 100\n  write \"/benchout/f\" + i, \"value \" + i\nend\n"
+                 "ENDAPP\n", it);
+        content_append_str(&m, code);
+        vfs_write_file(appdir, "benchloop.savapp", &m);
+        double t = now_us();
+        App* a = register_app_from_manifest(appdir, "benchloop.savapp");
+        if (a) app_load(a);
+        sample_add(&comp, now_us() - t, 0);
+        t = now_us();
+        run_app_command("benchloop");
+        sample_add(&loop, now_us() - t, 0);
+        uninstall_app_command("benchloop");
+        vfs_rmdir(root, "benchout");
+    }
+    sample_report("app_compile", &comp);
+    sample_report("app_run_script", &loop);
+}
+
+// calc -f: one compiled expression over a column of numbers (block at a time),
+// and a file of one-line expressions each compiled and run once
+void bench_calc(BenchOpts* o) {
+    Samples col = {0}, lines = {0};
+    Directory* d = find_or_create_dir_by_path("/benchcalc");
+    Content c = {0}, e = {0};
+    char buf[128];
+    int rows = 100000, exprs = 10000;
+    for (int i=0;i<rows;i++) {
+        snprintf(buf, sizeof(buf), "%d.%d\n", rand() % 10000, rand() % 100);
+        content_append_str(&c, buf);
+    }
+    for (int i=0;i<exprs;i++) {
+        snprintf(buf, sizeof(buf), "v%d = (%d + %d) * sqrt(%d) / 7 - %d ^ 2 %% 5\n", i % 16, rand() % 100, i, rand() % 1000, i % 13);
+        content_append_str(&e, buf);
+    }
+    size_t col_bytes = c.size, lines_bytes = e.size;
+    vfs_write_file(d, "col.txt", &c);
+    vfs_write_file(d, "exprs.txt", &e);
+    for (int it=0;it<o->iters;it++) {
+        double t = now_us();
+        cmd_calc("calc -f /benchcalc/col.txt sqrt(x * x + 1) * 0.5 + x / 3 - 2");
+        sample_add(&col, now_us() - t, col_bytes);
+        t = now_us();
+        cmd_calc("calc -f /benchcalc/exprs.txt");
+        sample_add(&lines, now_us() - t, lines_bytes);
+    }
+    out_flush();
+    vfs_rmdir(root, "benchcalc");
+    sample_report("calc_column", &col);
+    sample_report("calc_lines", &lines);
+}
+
+void bench_remove() {
+    Samples rm = {0}, rd = {0};
+    for (int i=0;i<ndirs;i++) {
+        Directory* d = dirs[i];
+        // removing compacts the entry table, so take the names first
+        int n = 0;
+        char (*names)[MAX_NAME] = malloc((d->files.count + 1) * sizeof(*names));
+        for (int j=0;j<d->files.used;j++) {
+            File* f = (File*)d->files.slots[j].node;
+            if (f) snprintf(names[n++], MAX_NAME, "%s", f->name);
+        }
+        for (int j=0;j<n;j++) {
+            double t = now_us();
+            vfs_rm(d, names[j]);
+            sample_add(&rm, now_us() - t, 0);
+        }
+        free(names);
+    }
+    sample_report("rm", &rm);
+    // top-level directories take their (now file-less) subtrees with them
+    while (root->subdirs.count > 0) {
+        Directory* d = NULL;
+        for (int i=0;i<root->subdirs.used && !d;i++) d = (Directory*)root->subdirs.slots[i].node;
+        char name[MAX_NAME];
+        snprintf(name, sizeof(name), "%s", d->name);
+        double t = now_us();
+        vfs_rmdir(root, name);
+        sample_add(&rd, now_us() - t, 0);
+    }
+    sample_report("rmdir", &rd);
+    ndirs = 0;
+}
+
+void bench_usage() {
+    fprintf(stderr, "usage: bench [--depth N] [--fanout N] [--files N] [--size BYTES] [--dist fixed|uniform|exp]\n"
+                    "             [--iters N] [--seed N] [--deferred] [--codec none|lz] [--threads N]\n");
+}
+
+int main(int argc, char** argv) {
+    BenchOpts o = { 3, 8, 16, 1024, "exp", 3, 1, 0, "none", 0 };
+    for (int i=1;i<argc;i++) {
+        const char* a = argv[i];
+        const char* v = (i+1 < argc) ? argv[i+1] : NULL;
+        if (strcmp(a, "--deferred")==0) { o.deferred = 1; continue; }
+        if (!v) { bench_usage(); return 2; }
+        if (strcmp(a, "--depth")==0) o.depth = atoi(v);
+        else if (strcmp(a, "--fanout")==0) o.fanout = atoi(v);
+        else if (strcmp(a, "--files")==0) o.files = atoi(v);
+        else if (strcmp(a, "--size")==0) o.size = (size_t)atoll(v);
+        else if (strcmp(a, "--dist")==0) o.dist = v;
+        else if (strcmp(a, "--iters")==0) o.iters = atoi(v);
+        else if (strcmp(a, "--seed")==0) o.seed = (unsigned)atoi(v);
+        else if (strcmp(a, "--codec")==0 && (strcmp(v, "none")==0 || strcmp(v, "lz")==0)) o.codec = v;
+        else if (strcmp(a, "--threads")==0) o.threads = atoi(v);
+        else { bench_usage(); return 2; }
+        i++;
+    }
+    if (o.iters < 1) o.iters = 1;
+    srand(o.seed);
+
+    // the kernel's own messages go to /dev/null; results keep the real stdout
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!report || !freopen("/dev/null", "w", stdout)) { fprintf(stderr, "bench: cannot redirect stdout\n"); return 1; }
+    char tmpl[] = "/tmp/gr4v1tyos-bench-XXXXXX";
+    if (!mkdtemp(tmpl) || chdir(tmpl) != 0) { fprintf(stderr, "bench: cannot create a work directory\n"); return 1; }
+
+    fprintf(report, "{\"bench\":\"config\",\"depth\":%d,\"fanout\":%d,\"files\":%d,\"size\":%zu,\"dist\":\"%s\",\"iters\":%d,\"seed\":%u,\"deferred\":%d,\"codec\":\"%s\",\"threads\":%d}\n",
+            o.depth, o.fanout, o.files, o.size, o.dist, o.iters, o.seed, o.deferred, o.codec, o.threads);
+
+    root = create_dir("/", NULL);
+    current_dir = root;
+    journal_deferred = batch_mode = o.deferred;
+    image_codec = strcmp(o.codec, "lz")==0 ? IMAGE_CODEC_LZ : IMAGE_CODEC_NONE;
+    worker_threads = o.threads;
+    if (!o.deferred) {
+        journal_open();
+        writeback_start();
+    }
+    init_builtin_apps();
+
+    // one buffer big enough for the largest file the distribution may ask for
+    size_t bufsize = o.size * 16 + 1;
+    char* buf = (char*)malloc(bufsize);
+    for (size_t i=0;i<bufsize;i++) buf[i] = 'a' + (char)(i % 26);
+    max_size = bufsize - 1;
+
+    Samples mk = {0}, wr = {0};
+    double t = now_us();
+    build_tree(&o, root, 0, &mk, &wr, buf);
+    double build_us = now_us() - t;
+    sample_report("mkdir", &mk);
+    sample_report("write", &wr);
+    fprintf(report, "{\"op\":\"build_tree\",\"dirs\":%d,\"total_ms\":%.3f}\n", ndirs, build_us / 1e3);
+
+    FILE* sink = fopen("/dev/null", "w");
+    bench_cat("cat", sink);
+    bench_lookup(&o);
+    bench_resolve(&o);
+    bench_search(&o);
+    bench_snapshot(&o, buf);
+    bench_save_load(&o);
+    bench_cat("cat_mapped", sink);
+    bench_apps(&o);
+    bench_calc(&o);
+    bench_remove();
+    fclose(sink);
+
+    if (disk_dirty) save_filesystem();
+    journal_close();
+    vfs_release_all();
+    image_unmap();
+    free(buf);
+    free(dirs);
+    unlink(IMAGE_FILE);
+    unlink(JOURNAL_FILE);
+    unlink(JOURNAL_OLD_FILE);
+    if (chdir("/") == 0) rmdir(tmpl);
+    fclose(report);
+    return 0;
+}
@@ -1,734 +1,7514 @@
-/*
-  GR4V1TYOS v4.0 - Full Virtual Shell with App Library and App Install
-  - Virtual filesystem in memory, autosaves to savdisk.txt
-  - Built-in apps: calculator, notepad (saves to vfs), numbergame, about
-  - App install/uninstall and installed apps stored in /apps/*.savapp
-  - Commands: help, ls, cd, back, mkdir, rmdir, write, cat, rm, clear, wipe, apps, run, install, uninstall, appinfo, exit
-*/
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <time.h>
-
-#define MAX_NAME 64
-#define MAX_CONTENT 4096
-#define MAX_FILES 256
-#define MAX_DIRS 128
-#define DISK_FILE "savdisk.txt"
-
-typedef struct File {
-    char name[MAX_NAME];
-    char *content; // allocated
-} File;
-
-typedef struct Directory {
-    char name[MAX_NAME];
-    struct Directory* parent;
-    struct Directory* subdirs[MAX_DIRS];
-    File* files[MAX_FILES];
-    int dir_count;
-    int file_count;
-} Directory;
-
-typedef struct App {
-    char name[64];
-    char desc[256];
-    char code[MAX_CONTENT]; // for installed apps, stored text; for builtins, small tag
-    int builtin; // 1 = builtin, 0 = installed
-} App;
-
-// Globals
-Directory* root;
-Directory* current_dir;
-App apps[256];
-int app_count = 0;
-
-// ---------- Utilities ----------
-Directory* create_dir(const char* name, Directory* parent) {
-    Directory* d = (Directory*)malloc(sizeof(Directory));
-    strncpy(d->name, name, MAX_NAME-1);
-    d->name[MAX_NAME-1] = '\0';
-    d->parent = parent;
-    d->dir_count = 0;
-    d->file_count = 0;
-    for (int i=0;i<MAX_DIRS;i++) d->subdirs[i] = NULL;
-    for (int i=0;i<MAX_FILES;i++) d->files[i] = NULL;
-    return d;
-}
-
-File* create_file(const char* name, const char* content) {
-    File* f = (File*)malloc(sizeof(File));
-    strncpy(f->name, name, MAX_NAME-1);
-    f->name[MAX_NAME-1] = '\0';
-    if (content) {
-        f->content = (char*)malloc(strlen(content)+1);
-        strcpy(f->content, content);
-    } else {
-        f->content = (char*)malloc(1);
-        f->content[0] = '\0';
-    }
-    return f;
-}
-
-void free_file(File* f) {
-    if (!f) return;
-    if (f->content) free(f->content);
-    free(f);
-}
-
-void free_dir_recursive(Directory* d) {
-    if (!d) return;
-    for (int i=0;i<d->dir_count;i++) {
-        free_dir_recursive(d->subdirs[i]);
-    }
-    for (int i=0;i<d->file_count;i++) {
-        free_file(d->files[i]);
-    }
-    free(d);
-}
-
-void print_path_recursive(Directory* d) {
-    if (d->parent == NULL) { printf("/"); return; }
-    print_path_recursive(d->parent);
-    printf("%s/", d->name);
-}
-
-// ---------- Virtual disk save/load ----------
-void save_dir_to_file(FILE* f, Directory* dir, const char* path) {
-    char fullpath[1024];
-    for (int i=0;i<dir->dir_count;i++) {
-        snprintf(fullpath, sizeof(fullpath), "%s%s/", path, dir->subdirs[i]->name);
-        fprintf(f, "DIR %s\n", fullpath);
-        save_dir_to_file(f, dir->subdirs[i], fullpath);
-    }
-    for (int i=0;i<dir->file_count;i++) {
-        snprintf(fullpath, sizeof(fullpath), "%s%s", path, dir->files[i]->name);
-        fprintf(f, "FILE %s\n", fullpath);
-        if (dir->files[i]->content && strlen(dir->files[i]->content) > 0) {
-            fprintf(f, "%s", dir->files[i]->content);
-            if (dir->files[i]->content[strlen(dir->files[i]->content)-1] != '\n')
-                fprintf(f, "\n");
-        }
-        fprintf(f, "END\n");
-    }
-}
-
-void save_filesystem() {
-    FILE* f = fopen(DISK_FILE, "w");
-    if (!f) {
-        printf("Error: could not write disk file.\n");
-        return;
-    }
-    save_dir_to_file(f, root, "/");
-    fclose(f);
-}
-
-Directory* find_or_create_dir_by_path(const char* path) {
-    if (!path || path[0] == '\0') return root;
-    if (strcmp(path, "/") == 0) return root;
-    char tmp[1024];
-    strncpy(tmp, path, sizeof(tmp)-1);
-    tmp[sizeof(tmp)-1] = '\0';
-    // remove leading '/'
-    char* p = tmp;
-    if (p[0] == '/') p++;
-    char* token = strtok(p, "/");
-    Directory* cur = root;
-    while (token) {
-        int found = 0;
-        for (int i=0;i<cur->dir_count;i++) {
-            if (strcmp(cur->subdirs[i]->name, token) == 0) {
-                cur = cur->subdirs[i];
-                found = 1;
-                break;
-            }
-        }
-        if (!found) {
-            Directory* nd = create_dir(token, cur);
-            cur->subdirs[cur->dir_count++] = nd;
-            cur = nd;
-        }
-        token = strtok(NULL, "/");
-    }
-    return cur;
-}
-
-void load_filesystem() {
-    FILE* f = fopen(DISK_FILE, "r");
-    if (!f) return; // no disk yet
-    char line[8192];
-    while (fgets(line, sizeof(line), f)) {
-        if (strncmp(line, "DIR ", 4) == 0) {
-            char path[1024];
-            sscanf(line + 4, "%[^\n]", path);
-            find_or_create_dir_by_path(path);
-        } else if (strncmp(line, "FILE ", 5) == 0) {
-            char path[1024];
-            char content[MAX_CONTENT];
-            content[0] = '\0';
-            sscanf(line + 5, "%[^\n]", path);
-            while (fgets(line, sizeof(line), f)) {
-                if (strncmp(line, "END", 3) == 0) break;
-                if (strlen(content) + strlen(line) + 1 < sizeof(content))
-                    strcat(content, line);
-            }
-            // split path into dir + filename
-            char *last = strrchr(path, '/');
-            if (!last) continue;
-            char filename[256];
-            strcpy(filename, last+1);
-            *last = '\0';
-            Directory* dir = find_or_create_dir_by_path((strlen(path)>0) ? path : "/");
-            File* nf = create_file(filename, content);
-            dir->files[dir->file_count++] = nf;
-        }
-    }
-    fclose(f);
-    //printf("Virtual disk loaded.\n");
-}
-
-// ---------- Filesystem commands ----------
-void list_dir() {
-    printf("Directories:\n");
-    for (int i=0;i<current_dir->dir_count;i++) {
-        printf("  [DIR] %s\n", current_dir->subdirs[i]->name);
-    }
-    printf("Files:\n");
-    for (int i=0;i<current_dir->file_count;i++) {
-        printf("  %s\n", current_dir->files[i]->name);
-    }
-}
-
-void cmd_cd(const char* name) {
-    if (strcmp(name, "..") == 0) {
-        if (current_dir->parent) current_dir = current_dir->parent;
-        else printf("Already at root.\n");
-        return;
-    }
-    for (int i=0;i<current_dir->dir_count;i++) {
-        if (strcmp(current_dir->subdirs[i]->name, name) == 0) {
-            current_dir = current_dir->subdirs[i];
-            return;
-        }
-    }
-    printf("Directory not found.\n");
-}
-
-void cmd_back() {
-    if (current_dir->parent) current_dir = current_dir->parent;
-    else printf("Already at root.\n");
-}
-
-void cmd_mkdir(const char* name) {
-    if (current_dir->dir_count >= MAX_DIRS) { printf("Max dirs reached.\n"); return; }
-    Directory* nd = create_dir(name, current_dir);
-    current_dir->subdirs[current_dir->dir_count++] = nd;
-    save_filesystem();
-    printf("Directory '%s' created.\n", name);
-}
-
-void cmd_write(const char* name) {
-    if (current_dir->file_count >= MAX_FILES) { printf("Max files reached here.\n"); return; }
-    printf("Enter file content. Type 'END' on its own line to finish.\n");
-    char buffer[MAX_CONTENT];
-    buffer[0] = '\0';
-    char line[512];
-    // consume newline left by scanf in caller if any
-    int c = getchar();
-    if (c != '\n' && c != EOF) ungetc(c, stdin);
-    while (1) {
-        if (!fgets(line, sizeof(line), stdin)) break;
-        if (strncmp(line, "END\n", 4) == 0 || strncmp(line, "END\r\n", 5) == 0) break;
-        if (strlen(buffer) + strlen(line) + 1 < sizeof(buffer))
-            strcat(buffer, line);
-    }
-    File* nf = create_file(name, buffer);
-    current_dir->files[current_dir->file_count++] = nf;
-    save_filesystem();
-    printf("File '%s' created.\n", name);
-}
-
-void cmd_cat(const char* name) {
-    for (int i=0;i<current_dir->file_count;i++) {
-        if (strcmp(current_dir->files[i]->name, name) == 0) {
-            printf("---- %s ----\n", name);
-            if (current_dir->files[i]->content && strlen(current_dir->files[i]->content)>0)
-                printf("%s", current_dir->files[i]->content);
-            else
-                printf("(empty)\n");
-            printf("---- end ----\n");
-            return;
-        }
-    }
-    printf("File not found.\n");
-}
-
-void cmd_rm(const char* name) {
-    for (int i=0;i<current_dir->file_count;i++) {
-        if (strcmp(current_dir->files[i]->name, name) == 0) {
-            free_file(current_dir->files[i]);
-            for (int j=i;j<current_dir->file_count-1;j++) current_dir->files[j]=current_dir->files[j+1];
-            current_dir->file_count--;
-            save_filesystem();
-            printf("File '%s' deleted.\n", name);
-            return;
-        }
-    }
-    printf("File not found.\n");
-}
-
-void delete_dir_node(Directory* node) {
-    // recursively free children, but do NOT free 'node' pointer caller will manage if needed
-    for (int i=0;i<node->dir_count;i++) {
-        delete_dir_node(node->subdirs[i]);
-        free(node->subdirs[i]);
-        node->subdirs[i] = NULL;
-    }
-    for (int i=0;i<node->file_count;i++) {
-        free_file(node->files[i]);
-        node->files[i] = NULL;
-    }
-    node->dir_count = 0;
-    node->file_count = 0;
-}
-
-void cmd_rmdir(const char* name) {
-    for (int i=0;i<current_dir->dir_count;i++) {
-        if (strcmp(current_dir->subdirs[i]->name, name) == 0) {
-            // free sub-tree
-            delete_dir_node(current_dir->subdirs[i]);
-            free(current_dir->subdirs[i]);
-            for (int j=i;j<current_dir->dir_count-1;j++) current_dir->subdirs[j]=current_dir->subdirs[j+1];
-            current_dir->dir_count--;
-            save_filesystem();
-            printf("Directory '%s' and all contents removed.\n", name);
-            return;
-        }
-    }
-    printf("Directory not found.\n");
-}
-
-void cmd_clear() {
-    for (int i=0;i<50;i++) printf("\n");
-    printf("[screen cleared]\n");
-}
-
-void cmd_wipe() {
-    printf("⚠️  Are you sure you want to wipe ALL user data? This cannot be undone (type 'yes' to confirm): ");
-    char confirm[16];
-    scanf("%15s", confirm);
-    if (strcmp(confirm, "yes") != 0) { printf("Wipe cancelled.\n"); return; }
-    // remove everything under root but keep the root directory itself
-    for (int i=0;i<root->dir_count;i++) {
-        delete_dir_node(root->subdirs[i]);
-        free(root->subdirs[i]);
-        root->subdirs[i] = NULL;
-    }
-    for (int i=0;i<root->file_count;i++) {
-        free_file(root->files[i]);
-        root->files[i] = NULL;
-    }
-    root->dir_count = 0;
-    root->file_count = 0;
-    current_dir = root;
-    // remove any registered installed apps
-    for (int i=0;i<app_count;i++) {
-        if (!apps[i].builtin) {
-            // shift left to drop
-            for (int j=i;j<app_count-1;j++) apps[j]=apps[j+1];
-            app_count--;
-            i--;
-        }
-    }
-    save_filesystem();
-    printf("All user data wiped. Kernel intact.\n");
-}
-
-// ---------- App system ----------
-void register_app(const char* name, const char* desc, const char* code, int builtin) {
-    strncpy(apps[app_count].name, name, sizeof(apps[app_count].name)-1);
-    strncpy(apps[app_count].desc, desc, sizeof(apps[app_count].desc)-1);
-    apps[app_count].desc[sizeof(apps[app_count].desc)-1]='\0';
-    if (code) strncpy(apps[app_count].code, code, sizeof(apps[app_count].code)-1);
-    apps[app_count].code[sizeof(apps[app_count].code)-1]='\0';
-    apps[app_count].builtin = builtin;
-    app_count++;
-}
-
-void init_builtin_apps() {
-    register_app("calculator", "Interactive calculator (+ - * /)", "BUILTIN_CALC", 1);
-    register_app("notepad", "Notepad (saves as a file in current dir)", "BUILTIN_NOTEPAD", 1);
-    register_app("numbergame", "Number Guess Game (1-100)", "BUILTIN_NUMBERGAME", 1);
-    register_app("about", "About GR4V1TYOS", "BUILTIN_ABOUT", 1);
-}
-
-void load_installed_apps_from_vfs() {
-    // find /apps directory if it exists
-    Directory* appdir = find_or_create_dir_by_path("/apps");
-    for (int i=0;i<appdir->file_count;i++) {
-        File* f = appdir->files[i];
-        if (!f) continue;
-        // consider files ending in .savapp
-        const char* ext = strrchr(f->name, '.');
-        if (!ext || strcmp(ext, ".savapp") != 0) continue;
-        // parse content: APP_NAME=..., APP_DESC=..., CODE=... (CODE can be multi-line until ENDAPP)
-        char *copy = strdup(f->content ? f->content : "");
-        char *line = strtok(copy, "\n");
-        char name[64]="", desc[256]="", code[MAX_CONTENT]="";
-        while (line) {
-            if (strncmp(line, "APP_NAME=",9) == 0) strncpy(name, line+9, sizeof(name)-1);
-            else if (strncmp(line, "APP_DESC=",9) == 0) strncpy(desc, line+9, sizeof(desc)-1);
-            else if (strncmp(line, "CODE=",5) == 0) {
-                // the rest of this line after CODE= is appended; also append subsequent lines until maybe ENDAPP or EOF
-                strncat(code, line+5, sizeof(code)-strlen(code)-1);
-                strncat(code, "\n", sizeof(code)-strlen(code)-1);
-                // append remaining lines until ENDAPP or end of copy
-                char *next = strtok(NULL, "\n");
-                while (next) {
-                    if (strcmp(next, "ENDAPP") == 0) break;
-                    strncat(code, next, sizeof(code)-strlen(code)-1);
-                    strncat(code, "\n", sizeof(code)-strlen(code)-1);
-                    next = strtok(NULL, "\n");
-                }
-                break;
-            }
-            line = strtok(NULL, "\n");
-        }
-        free(copy);
-        if (strlen(name)>0) register_app(name, desc, code, 0);
-    }
-}
-
-void show_apps_command() {
-    printf("Installed and built-in apps:\n");
-    for (int i=0;i<app_count;i++) {
-        printf("  %s - %s%s\n", apps[i].name, apps[i].desc, apps[i].builtin ? " [built-in]" : "");
-    }
-}
-
-void app_builtin_calculator() {
-    double a,b;
-    char op;
-    printf("Calculator - enter: <num> <op> <num>  (e.g. 5 * 3)\n");
-    if (scanf("%lf %c %lf", &a, &op, &b) != 3) { printf("Invalid input.\n"); int c=getchar(); if (c!='\n') ; return; }
-    double res = 0;
-    if (op=='+') res = a+b;
-    else if (op=='-') res = a-b;
-    else if (op=='*') res = a*b;
-    else if (op=='/') {
-        if (b==0) { printf("Error: divide by zero.\n"); return; }
-        res = a/b;
-    } else { printf("Unknown operator.\n"); return; }
-    printf("Result: %.6g\n", res);
-}
-
-void app_builtin_notepad() {
-    char filename[128];
-    printf("Notepad - enter filename to save in current directory: ");
-    scanf("%127s", filename);
-    // consume leftover newline
-    int c = getchar();
-    if (c != '\n' && c != EOF) ungetc(c, stdin);
-    printf("Enter text lines. Type 'END' on its own line to finish.\n");
-    char buffer[MAX_CONTENT];
-    buffer[0] = '\0';
-    char line[512];
-    while (1) {
-        if (!fgets(line, sizeof(line), stdin)) break;
-        if (strncmp(line, "END\n", 4) == 0 || strncmp(line, "END\r\n", 5) == 0) break;
-        if (strlen(buffer) + strlen(line) + 1 < sizeof(buffer))
-            strcat(buffer, line);
-    }
-    // if file with same name exists in current_dir, overwrite
-    for (int i=0;i<current_dir->file_count;i++) {
-        if (strcmp(current_dir->files[i]->name, filename) == 0) {
-            free(current_dir->files[i]->content);
-            current_dir->files[i]->content = (char*)malloc(strlen(buffer)+1);
-            strcpy(current_dir->files[i]->content, buffer);
-            save_filesystem();
-            printf("File '%s' overwritten.\n", filename);
-            return;
-        }
-    }
-    File* nf = create_file(filename, buffer);
-    current_dir->files[current_dir->file_count++] = nf;
-    save_filesystem();
-    printf("File '%s' saved.\n", filename);
-}
-
-void app_builtin_numbergame() {
-    srand((unsigned)time(NULL));
-    int target = rand()%100 + 1;
-    int guess = 0;
-    int tries = 0;
-    printf("Number Guess Game! Guess a number from 1 to 100.\n");
-    while (1) {
-        printf("Enter guess: ");
-        if (scanf("%d", &guess) != 1) { printf("Invalid. Try again.\n"); int c=getchar(); if (c!='\n') ; continue; }
-        tries++;
-        if (guess > target) printf("Too high!\n");
-        else if (guess < target) printf("Too low!\n");
-        else { printf("Correct! You took %d tries.\n", tries); break; }
-    }
-}
-
-void app_builtin_about() {
-    printf("GR4V1TYOS Virtual Shell v4.0\n");
-    printf("Features: Virtual filesystem, autosave, app library, app install/uninstall, wipe, rmdir, notepad, calculator, number game.\n");
-    printf("All operations are sandboxed in the virtual filesystem.\n");
-}
-
-App* find_app_by_name(const char* name) {
-    for (int i=0;i<app_count;i++) if (strcmp(apps[i].name, name) == 0) return &apps[i];
-    return NULL;
-}
-
-void run_app_command(const char* name) {
-    App* a = find_app_by_name(name);
-    if (!a) { printf("App '%s' not found.\n", name); return; }
-    if (a->builtin) {
-        if (strcmp(a->code, "BUILTIN_CALC")==0) app_builtin_calculator();
-        else if (strcmp(a->code, "BUILTIN_NOTEPAD")==0) app_builtin_notepad();
-        else if (strcmp(a->code, "BUILTIN_NUMBERGAME")==0) app_builtin_numbergame();
-        else if (strcmp(a->code, "BUILTIN_ABOUT")==0) app_builtin_about();
-        else printf("Builtin app stub.\n");
-    } else {
-        // installed app: simple "interpreter": if code starts with "PRINT:" print rest; if "RUN_CMD:" we can interpret known commands.
-        if (strncmp(a->code, "PRINT:", 6) == 0) {
-            printf("%s\n", a->code + 6);
-        } else if (strncmp(a->code, "SCRIPT:NOTEPAD", 14) == 0) {
-            // notepad-like script: create a file with given name after SCRIPT:NOTEPAD <filename>
-            char tmp[256];
-            strncpy(tmp, a->code+14, sizeof(tmp)-1);
-            tmp[sizeof(tmp)-1] = '\0';
-            // trim whitespace
-            char *p = tmp;
-            while (*p == ' ' || *p == '\t') p++;
-            if (strlen(p)==0) { printf("Installed notepad missing filename.\n"); return; }
-            // open interactive input and save into file p in current dir
-            printf("Installed notepad saving to '%s' in current directory.\n", p);
-            printf("Enter text lines. Type 'END' on its own line to finish.\n");
-            char buffer[MAX_CONTENT]; buffer[0]='\0';
-            char line[512];
-            int ch = getchar(); if (ch != '\n' && ch != EOF) ungetc(ch, stdin);
-            while (1) {
-                if (!fgets(line, sizeof(line), stdin)) break;
-                if (strncmp(line, "END\n", 4) == 0 || strncmp(line, "END\r\n", 5) == 0) break;
-                if (strlen(buffer) + strlen(line) + 1 < sizeof(buffer))
-                    strcat(buffer, line);
-            }
-            // save file
-            for (int i=0;i<current_dir->file_count;i++) {
-                if (strcmp(current_dir->files[i]->name, p) == 0) {
-                    free(current_dir->files[i]->content);
-                    current_dir->files[i]->content = (char*)malloc(strlen(buffer)+1);
-                    strcpy(current_dir->files[i]->content, buffer);
-                    save_filesystem();
-                    printf("File '%s' overwritten.\n", p);
-                    return;
-                }
-            }
-            File* nf = create_file(p, buffer);
-            current_dir->files[current_dir->file_count++] = nf;
-            save_filesystem();
-            printf("File '%s' saved.\n", p);
-        } else {
-            // fallback: print the code block as output (safe)
-            printf("--- App Output ---\n%s\n--- End ---\n", a->code);
-        }
-    }
-}
-
-void install_app_command(const char* packname) {
-    // Known package installer: currently supports "hello" and "simple-notepad"
-    Directory* appdir = find_or_create_dir_by_path("/apps");
-    // ensure not already present
-    char targetname[128];
-    snprintf(targetname, sizeof(targetname), "%s.savapp", packname);
-    for (int i=0;i<appdir->file_count;i++) {
-        if (strcmp(appdir->files[i]->name, targetname) == 0) {
-            printf("Package already installed.\n"); return;
-        }
-    }
-    char content[MAX_CONTENT];
-    if (strcmp(packname, "hello")==0) {
-        snprintf(content, sizeof(content),
-            "APP_NAME=hello\nAPP_DESC=Simple Hello App\nCODE=PRINT:Hello from installed Hello App!\nENDAPP\n");
-    } else if (strcmp(packname, "simple-notepad")==0) {
-        snprintf(content, sizeof(content),
-            "APP_NAME=snotepad\nAPP_DESC=Simple installed notepad (saves to given filename)\nCODE=SCRIPT:NOTEPAD default_note.txt\nENDAPP\n");
-    } else {
-        printf("Unknown package '%s'. Known: hello, simple-notepad\n", packname);
-        return;
-    }
-    File* nf = create_file(targetname, content);
-    appdir->files[appdir->file_count++] = nf;
-    save_filesystem();
-    // register app immediately
-    // reload installed apps (simple approach: clear non-builtins then reload)
-    // remove existing non-builtins from apps array
-    for (int i=0;i<app_count;i++) {
-        if (!apps[i].builtin) {
-            for (int j=i;j<app_count-1;j++) apps[j]=apps[j+1];
-            app_count--;
-            i--;
-        }
-    }
-    load_installed_apps_from_vfs();
-    printf("Package '%s' installed.\n", packname);
-}
-
-void uninstall_app_command(const char* appname) {
-    Directory* appdir = find_or_create_dir_by_path("/apps");
-    // find corresponding file by scanning .savapp files and checking APP_NAME
-    for (int i=0;i<appdir->file_count;i++) {
-        File* f = appdir->files[i];
-        if (!f) continue;
-        if (strstr(f->name, ".savapp")) {
-            // parse APP_NAME line
-            char *copy = strdup(f->content ? f->content : "");
-            char *line = strtok(copy, "\n");
-            char name[128]="";
-            while (line) {
-                if (strncmp(line, "APP_NAME=",9)==0) { strncpy(name, line+9, sizeof(name)-1); break; }
-                line = strtok(NULL, "\n");
-            }
-            free(copy);
-            if (strlen(name)>0 && strcmp(name, appname)==0) {
-                // delete file
-                free_file(f);
-                for (int j=i;j<appdir->file_count-1;j++) appdir->files[j]=appdir->files[j+1];
-                appdir->file_count--;
-                save_filesystem();
-                // remove from apps registry
-                for (int k=0;k<app_count;k++) {
-                    if (!apps[k].builtin && strcmp(apps[k].name, appname)==0) {
-                        for (int j=k;j<app_count-1;j++) apps[j]=apps[j+1];
-                        app_count--;
-                        break;
-                    }
-                }
-                printf("App '%s' uninstalled.\n", appname);
-                return;
-            }
-        }
-    }
-    printf("Installed app '%s' not found.\n", appname);
-}
-
-void appinfo_command(const char* appname) {
-    App* a = find_app_by_name(appname);
-    if (!a) { printf("App not found.\n"); return; }
-    printf("Name: %s\nDesc: %s\nType: %s\n", a->name, a->desc, a->builtin ? "built-in":"installed");
-    if (!a->builtin) {
-        printf("Code preview:\n%s\n", a->code);
-    }
-}
-
-// ---------- Shell and main ----------
-void print_help() {
-    printf("Available commands:\n");
-    printf(" help                - show this help\n");
-    printf(" ls                  - list contents of current directory\n");
-    printf(" cd <dir>            - change directory\n");
-    printf(" back                - go up one directory\n");
-    printf(" mkdir <name>        - create directory\n");
-    printf(" rmdir <name>        - delete directory and its contents\n");
-    printf(" write <file>        - create/write a file (use END to finish)\n");
-    printf(" cat <file>          - show file contents\n");
-    printf(" rm <file>           - delete file\n");
-    printf(" clear               - clear virtual screen\n");
-    printf(" wipe                - delete ALL user data (keeps kernel)\n");
-    printf(" apps                - list apps (built-in + installed)\n");
-    printf(" run <app>           - run an app\n");
-    printf(" install <pkg>       - install package (hello, simple-notepad)\n");
-    printf(" uninstall <app>     - uninstall installed app\n");
-    printf(" appinfo <app>       - show info about an app\n");
-    printf(" exit                - exit GR4V1TYOS (auto-saved)\n");
-}
-
-int main() {
-    // init root
-    root = create_dir("/", NULL);
-    current_dir = root;
-
-    // load FS
-    load_filesystem();
-
-    // init builtin apps
-    init_builtin_apps();
-
-    // load installed apps from /apps in vfs
-    load_installed_apps_from_vfs();
-
-    printf("Welcome to GR4V1TYOS v4.0\nType 'help' for commands.\n");
-
-    char cmd[128];
-    while (1) {
-        printf("GR4V1TYOS:");
-        print_path_recursive(current_dir);
-        printf("> ");
-        if (scanf("%127s", cmd) != 1) break;
-
-        if (strcmp(cmd, "help")==0) print_help();
-        else if (strcmp(cmd, "ls")==0) list_dir();
-        else if (strcmp(cmd, "cd")==0) {
-            char arg[256]; if (scanf("%255s", arg)!=1) { printf("cd needs an argument.\n"); continue; }
-            cmd_cd(arg);
-        }
-        else if (strcmp(cmd, "back")==0) cmd_back();
-        else if (strcmp(cmd, "mkdir")==0) {
-            char arg[128]; if (scanf("%127s", arg)!=1) { printf("mkdir needs a name.\n"); continue; }
-            cmd_mkdir(arg);
-        }
-        else if (strcmp(cmd, "rmdir")==0) {
-            char arg[128]; if (scanf("%127s", arg)!=1) { printf("rmdir needs a name.\n"); continue; }
-            cmd_rmdir(arg);
-        }
-        else if (strcmp(cmd, "write")==0) {
-            char arg[128]; if (scanf("%127s", arg)!=1) { printf("write needs filename.\n"); continue; }
-            // write handles its own newline consumption
-            cmd_write(arg);
-        }
-        else if (strcmp(cmd, "cat")==0) {
-            char arg[128]; if (scanf("%127s", arg)!=1) { printf("cat needs filename.\n"); continue; }
-            cmd_cat(arg);
-        }
-        else if (strcmp(cmd, "rm")==0) {
-            char arg[128]; if (scanf("%127s", arg)!=1) { printf("rm needs filename.\n"); continue; }
-            cmd_rm(arg);
-        }
-        else if (strcmp(cmd, "clear")==0) cmd_clear();
-        else if (strcmp(cmd, "wipe")==0) cmd_wipe();
-        else if (strcmp(cmd, "apps")==0) show_apps_command();
-        else if (strcmp(cmd, "run")==0) {
-            char arg[128]; if (scanf("%127s", arg)!=1) { printf("run needs appname.\n"); continue; }
-            run_app_command(arg);
-        }
-        else if (strcmp(cmd, "install")==0) {
-            char arg[128]; if (scanf("%127s", arg)!=1) { printf("install needs packagename.\n"); continue; }
-            install_app_command(arg);
-        }
-        else if (strcmp(cmd, "uninstall")==0) {
-            char arg[128]; if (scanf("%127s", arg)!=1) { printf("uninstall needs appname.\n"); continue; }
-            uninstall_app_command(arg);
-        }
-        else if (strcmp(cmd, "appinfo")==0) {
-            char arg[128]; if (scanf("%127s", arg)!=1) { printf("appinfo needs appname.\n"); continue; }
-            appinfo_command(arg);
-        }
-        else if (strcmp(cmd, "exit")==0) {
-            save_filesystem();
-            printf("Exiting GR4V1TYOS... (filesystem saved)\n");
-            break;
-        }
-        else {
-            printf("Unknown command: %s (type 'help')\n", cmd);
-        }
-    }
-
-    // cleanup on exit
-    free_dir_recursive(root);
-    return 0;
-}
+/*
+  GR4V1TYOS v4.0 - Full Virtual Shell with App Library and App Install
+  - Virtual filesystem in memory, autosaves to savdisk.img (binary, mmap'd, file bodies loaded lazily)
+  - File bodies are deduplicated: equal bodies share one blob in memory and one extent in savdisk.img
+  - kernel -z lz stores bodies in savdisk.img with a built-in LZ codec, in independently decodable blocks,
+    decoded at startup by a pool of worker threads (-j)
+  - Mutations are appended to savdisk.journal, flushed by a write-back thread and compacted into savdisk.img in the background
+  - Build: gcc -O2 -pthread -o kernel kernel.c -lm
+  - savdisk.txt is the text import/export format (imported automatically when no image exists)
+  - import/export copy whole host directory trees in and out, reading and writing the files on a worker pool
+  - Built-in apps: calculator, notepad (saves to vfs), numbergame, about
+  - Packages come from a local repository (host dir packages/: <pkg>.savapp archives + catalog.txt)
+    plus a few built in; 'install a b c' / 'install --all' install a batch in one go
+  - App install/uninstall and installed apps stored in /apps/<package>.savapp, listed in /apps/index.savidx;
+    startup registers apps from that index and reads a manifest only when its app first runs
+  - Installed apps are small scripts, compiled to bytecode (cached as /apps/<package>.savbc) and run by a VM
+  - Apps run as tasks with their own input, cwd and time slice: 'run app &' starts one in the background,
+    Ctrl-Z stops the foreground one, ps/fg/bg/kill manage them as in a Unix shell
+  - calc compiles expressions (precedence, parentheses, variables, math functions) once to a postfix
+    program; 'calc -f file expr' evaluates one over a column of numbers a block of rows at a time
+  - Commands: help, ls, cd, back, mkdir, rmdir, write, cat, rm, find, grep, clear, wipe, snapshot, snapshots, restore, du, df, quota, calc, apps, run, ps, fg, bg, kill, install, packages, uninstall, appinfo, exportdisk, importdisk, import, export, sync, stats, exit
+  - find/grep answer from a name index and a word index kept current on every change and saved in savdisk.img
+  - snapshot/restore: snapshots are taken in O(1) and record old versions of paths copy-on-write as they change
+  - du/df answer from per-directory subtree totals kept current on every change; quota limits a directory's bytes
+  - Commands take absolute or relative paths (/a/b/c, ../x), resolved through a dentry cache
+  - Shell output is buffered per session and written at the prompt or when 64KB pile up;
+    cat hands large bodies to writev straight from their chunks or the image mapping
+  - Batch mode: kernel -b [script|-] [-e] runs commands without prompts, saves once at the end
+    (or at 'sync'), and exits non-zero if a command failed; -e stops at the first failure
+  - Server mode: kernel -S <socket> shares one tree with many concurrent clients, each with its own cwd
+  - 'stats' (or -s at exit) reports per-command latency histograms and save/load/allocation counters
+  - bench.c compiles this file with GR4V1TYOS_NO_MAIN (no shell main) to benchmark the VFS and apps
+*/
+
+#define _GNU_SOURCE // fopencookie, for a task's input stream
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <math.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dirent.h>
+
+#define MAX_NAME 64
+#define DISK_FILE "savdisk.txt"
+#define IMAGE_FILE "savdisk.img"
+#define IMAGE_MAGIC "GR4VIMG"
+#define IMAGE_VERSION 4 // 2 added the search index section, 3 snapshots, 4 quotas; older images still load
+#define JOURNAL_FILE "savdisk.journal"
+#define JOURNAL_OLD_FILE "savdisk.journal.old"
+#define JOURNAL_COMPACT_BYTES (256*1024)
+
+// ---------- Shell I/O ----------
+// Commands read SHELL_IN and write through out_printf/out_write rather than
+// stdin/stdout so that server sessions (see Server) can run them on their own
+// sockets. Output collects in the thread's OutBuf and reaches the descriptor
+// in a few large writes: at the prompt, before the shell waits for input, and
+// whenever OUT_BUF_SIZE fills up. A terminal still sees every line at once.
+// Writes of OUT_DIRECT_MIN bytes or more (cat of a large body) skip the copy:
+// the pending output and the caller's bytes go out together in one writev.
+#define OUT_BUF_SIZE (64*1024)
+#define OUT_DIRECT_MIN (16*1024)
+#define OUT_IOV_MAX 64 // iovecs per writev
+
+typedef struct OutBuf {
+    int fd;
+    int tty; // flushed after every out_printf/out_write
+    size_t len;
+    char data[OUT_BUF_SIZE];
+} OutBuf;
+
+int server_mode = 0;
+extern int batch_mode;
+__thread FILE* shell_in = NULL;    // NULL: stdin
+__thread OutBuf* shell_out = NULL; // NULL: this thread's buffer on stdout
+__thread OutBuf* stdout_buf = NULL;
+
+OutBuf* outbuf_new(int fd) {
+    OutBuf* o = (OutBuf*)malloc(sizeof(OutBuf));
+    o->fd = fd;
+    o->tty = isatty(fd);
+    o->len = 0;
+    return o;
+}
+
+OutBuf* out_current() {
+    if (shell_out) return shell_out;
+    if (!stdout_buf) stdout_buf = outbuf_new(STDOUT_FILENO);
+    return stdout_buf;
+}
+
+// writes all of v[0..n) (n <= OUT_IOV_MAX), resuming after short writes;
+// returns 0 on an error, such as a client that went away
+int write_all(int fd, struct iovec* v, int n) {
+    while (n > 0) {
+        ssize_t w = writev(fd, v, n);
+        if (w < 0) { if (errno == EINTR) continue; return 0; }
+        while (n > 0 && (size_t)w >= v->iov_len) { w -= v->iov_len; v++; n--; }
+        if (n > 0) { v->iov_base = (char*)v->iov_base + w; v->iov_len -= w; }
+    }
+    return 1;
+}
+
+void out_flush() {
+    OutBuf* o = out_current();
+    if (!o->len) return;
+    struct iovec v = { o->data, o->len };
+    write_all(o->fd, &v, 1);
+    o->len = 0;
+}
+
+// the session's input; what is pending goes out first so the user sees the
+// prompt (or the app's question) before the shell blocks
+FILE* shell_input() {
+    if (!batch_mode) out_flush();
+    return shell_in ? shell_in : stdin;
+}
+#define SHELL_IN shell_input()
+
+// appends without the terminal flush; callers that emit a line in pieces end it with out_write
+void out_put(const char* data, size_t len) {
+    OutBuf* o = out_current();
+    if (o->len + len > OUT_BUF_SIZE) {
+        if (len >= OUT_DIRECT_MIN) {
+            struct iovec v[2] = { { o->data, o->len }, { (void*)data, len } };
+            write_all(o->fd, v, 2);
+            o->len = 0;
+            return;
+        }
+        out_flush();
+    }
+    memcpy(o->data + o->len, data, len);
+    o->len += len;
+}
+
+void out_write(const char* data, size_t len) {
+    out_put(data, len);
+    if (out_current()->tty) out_flush();
+}
+
+// formats straight into the buffer's free space
+int out_vprintf(const char* fmt, va_list ap) {
+    OutBuf* o = out_current();
+    va_list again;
+    va_copy(again, ap);
+    int n = vsnprintf(o->data + o->len, OUT_BUF_SIZE - o->len, fmt, ap);
+    if (n < 0) { va_end(again); return n; }
+    if ((size_t)n < OUT_BUF_SIZE - o->len) o->len += n;
+    else {
+        // did not fit: start a fresh buffer, or format on the heap if it never could
+        out_flush();
+        if ((size_t)n < OUT_BUF_SIZE) {
+            vsnprintf(o->data, OUT_BUF_SIZE, fmt, again);
+            o->len = n;
+        } else {
+            char* big = (char*)malloc((size_t)n + 1);
+            vsnprintf(big, (size_t)n + 1, fmt, again);
+            out_put(big, n);
+            free(big);
+        }
+    }
+    va_end(again);
+    if (o->tty) out_flush();
+    return n;
+}
+
+int out_printf(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = out_vprintf(fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+// ---------- Instrumentation ----------
+// Always-on counters behind the 'stats' command. Recording is a handful of
+// integer adds plus one monotonic clock read per command, save and load;
+// nothing is formatted until someone asks.
+#define STAT_BUCKETS 32 // bucket i: latencies below 2^(i+1) microseconds
+
+typedef struct StatHist {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint32_t buckets[STAT_BUCKETS];
+} StatHist;
+
+typedef struct Stats {
+    uint64_t dirs_created, files_created, dirs_freed, files_freed;
+    uint64_t saves, save_bytes, last_save_bytes, last_save_body_bytes, last_save_records;
+    StatHist save_time;
+    uint64_t journal_records, journal_bytes, writeback_flushes;
+    uint64_t load_ns, load_dirs, load_files, replayed_records;
+    int load_threads; // that decoded the image
+    uint64_t dcache_hits, dcache_misses;
+    uint64_t blob_shared; // bodies that turned out to equal a stored blob
+} Stats;
+
+Stats stats;
+// counters bumped outside any lock (node allocation) use a relaxed atomic add
+#define STAT_INC(field) __atomic_fetch_add(&(field), 1, __ATOMIC_RELAXED)
+// command and save histograms are shared by server sessions
+pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t stat_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void stat_record(StatHist* h, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int b = 0;
+    while (b < STAT_BUCKETS-1 && (us >> (b+1)) != 0) b++;
+    h->buckets[b]++;
+    h->count++;
+    h->total_ns += ns;
+    if (ns > h->max_ns) h->max_ns = ns;
+}
+
+// upper bound of the bucket holding the p-th latency, in microseconds
+double stat_percentile_us(const StatHist* h, double p) {
+    if (!h->count) return 0;
+    uint64_t want = (uint64_t)(p * (double)(h->count - 1)) + 1, seen = 0;
+    for (int b=0;b<STAT_BUCKETS;b++) {
+        seen += h->buckets[b];
+        if (seen >= want) {
+            double bound = (double)(2ull << b);
+            double max_us = h->max_ns / 1000.0;
+            return bound < max_us ? bound : max_us;
+        }
+    }
+    return h->max_ns / 1000.0;
+}
+
+// ---------- Node allocation ----------
+// Tree nodes never come from malloc one at a time. Directory and File structs
+// and the larger body chunks are carved out of typed slab pools; names, small
+// chunks and entry-table arrays come from a bump arena with per-size free
+// lists. Freed objects go back on a free list for reuse, and wiping or
+// exiting releases whole blocks at once instead of walking the tree.
+#define POOL_BLOCK_BYTES (256*1024)
+#define POOL_HDR 16
+#define ARENA_BLOCK_BYTES (64*1024)
+#define ARENA_ALIGN 16
+#define ARENA_SMALL_MAX 512
+
+typedef struct Pool {
+    size_t obj_size;  // multiple of 16
+    size_t per_block;
+    void* blocks;     // each block starts with a link to the previous block
+    char* bump;
+    char* bump_end;
+    void* free_list;
+} Pool;
+
+#define POOL_FOR(size) { (((size)+15) & ~(size_t)15), 0, NULL, NULL, NULL, NULL }
+
+// server sessions allocate concurrently; one short critical section covers every pool and arena
+pthread_mutex_t alloc_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void alloc_lock() {
+    if (server_mode) pthread_mutex_lock(&alloc_mutex);
+}
+
+void alloc_unlock() {
+    if (server_mode) pthread_mutex_unlock(&alloc_mutex);
+}
+
+void* pool_alloc_nolock(Pool* p) {
+    if (p->free_list) {
+        void* o = p->free_list;
+        p->free_list = *(void**)o;
+        return o;
+    }
+    if (p->bump == p->bump_end) {
+        if (!p->per_block) p->per_block = POOL_BLOCK_BYTES / p->obj_size ? POOL_BLOCK_BYTES / p->obj_size : 1;
+        char* b = (char*)malloc(POOL_HDR + p->obj_size * p->per_block);
+        *(void**)b = p->blocks;
+        p->blocks = b;
+        p->bump = b + POOL_HDR;
+        p->bump_end = p->bump + p->obj_size * p->per_block;
+    }
+    void* o = p->bump;
+    p->bump += p->obj_size;
+    return o;
+}
+
+void* pool_alloc(Pool* p) {
+    alloc_lock();
+    void* o = pool_alloc_nolock(p);
+    alloc_unlock();
+    return o;
+}
+
+void pool_free(Pool* p, void* o) {
+    alloc_lock();
+    *(void**)o = p->free_list;
+    p->free_list = o;
+    alloc_unlock();
+}
+
+// drops every object in the pool at once
+void pool_reset(Pool* p) {
+    void* b = p->blocks;
+    while (b) {
+        void* prev = *(void**)b;
+        free(b);
+        b = prev;
+    }
+    p->blocks = NULL;
+    p->bump = p->bump_end = NULL;
+    p->free_list = NULL;
+}
+
+// allocations above ARENA_SMALL_MAX are malloc'd but stay linked to the arena so a reset frees them too
+typedef struct ArenaBig {
+    struct ArenaBig* prev;
+    struct ArenaBig* next;
+    size_t pad; // keeps the payload 16-byte aligned
+    size_t pad2;
+} ArenaBig;
+
+typedef struct Arena {
+    void* blocks;
+    char* bump;
+    char* bump_end;
+    void* free_lists[ARENA_SMALL_MAX / ARENA_ALIGN];
+    ArenaBig* big;
+} Arena;
+
+void* arena_alloc_nolock(Arena* a, size_t size) {
+    size = (size + ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1);
+    if (size == 0) size = ARENA_ALIGN;
+    if (size > ARENA_SMALL_MAX) {
+        ArenaBig* b = (ArenaBig*)malloc(sizeof(ArenaBig) + size);
+        b->prev = NULL;
+        b->next = a->big;
+        if (a->big) a->big->prev = b;
+        a->big = b;
+        return b + 1;
+    }
+    int cls = (int)(size / ARENA_ALIGN) - 1;
+    if (a->free_lists[cls]) {
+        void* o = a->free_lists[cls];
+        a->free_lists[cls] = *(void**)o;
+        return o;
+    }
+    if (a->bump + size > a->bump_end || !a->bump) {
+        char* b = (char*)malloc(ARENA_BLOCK_BYTES);
+        *(void**)b = a->blocks;
+        a->blocks = b;
+        a->bump = b + POOL_HDR;
+        a->bump_end = b + ARENA_BLOCK_BYTES;
+    }
+    void* o = a->bump;
+    a->bump += size;
+    return o;
+}
+
+void* arena_alloc(Arena* a, size_t size) {
+    alloc_lock();
+    void* o = arena_alloc_nolock(a, size);
+    alloc_unlock();
+    return o;
+}
+
+// 'size' must be the size the block was allocated with
+void arena_free_nolock(Arena* a, void* p, size_t size) {
+    if (!p) return;
+    size = (size + ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1);
+    if (size == 0) size = ARENA_ALIGN;
+    if (size > ARENA_SMALL_MAX) {
+        ArenaBig* b = (ArenaBig*)p - 1;
+        if (b->prev) b->prev->next = b->next; else a->big = b->next;
+        if (b->next) b->next->prev = b->prev;
+        free(b);
+        return;
+    }
+    int cls = (int)(size / ARENA_ALIGN) - 1;
+    *(void**)p = a->free_lists[cls];
+    a->free_lists[cls] = p;
+}
+
+void arena_free(Arena* a, void* p, size_t size) {
+    alloc_lock();
+    arena_free_nolock(a, p, size);
+    alloc_unlock();
+}
+
+char* arena_strdup(Arena* a, const char* s, size_t max) {
+    size_t len = strlen(s);
+    if (len > max) len = max;
+    char* d = (char*)arena_alloc(a, len+1);
+    memcpy(d, s, len);
+    d[len] = '\0';
+    return d;
+}
+
+void arena_reset(Arena* a) {
+    void* b = a->blocks;
+    while (b) {
+        void* prev = *(void**)b;
+        free(b);
+        b = prev;
+    }
+    while (a->big) {
+        ArenaBig* next = a->big->next;
+        free(a->big);
+        a->big = next;
+    }
+    memset(a, 0, sizeof(*a));
+}
+
+Arena vfs_arena;
+
+// File bodies are a chain of chunks, so appends are amortized O(1) and readers
+// stream a body chunk by chunk instead of flattening it. Chunk capacity doubles
+// from CHUNK_MIN up to CHUNK_MAX, which keeps small files small.
+#define CHUNK_MIN 64
+#define CHUNK_MAX (64*1024)
+
+typedef struct Chunk {
+    struct Chunk* next;
+    size_t len;
+    size_t cap;
+    char data[];
+} Chunk;
+
+typedef struct Content {
+    Chunk* head;
+    Chunk* tail;
+    size_t size;
+} Content;
+
+// File bodies are content-addressed: equal bodies share one reference-counted
+// Blob, found by a 64-bit hash of the content (collisions are settled
+// by comparing bytes). A blob's content never changes once it is shared;
+// rewriting a file points it at another blob.
+typedef struct Blob {
+    struct Blob* next; // hash chain
+    uint64_t hash;
+    int refs;
+    Content body;
+} Blob;
+
+typedef struct File {
+    char* name; // arena-allocated
+    Blob* blob; // NULL while the body is empty or still mapped
+    const char* mapped; // body still inside the mmap'd image (not NUL-terminated); NULL once rewritten
+    size_t mapped_len;
+    struct Directory* dir; // the directory holding the file, for search results
+    struct Posting* words; // this file's entries in the word index
+    struct File* name_prev; // other files with the same name (name index)
+    struct File* name_next;
+} File;
+
+// Ordered name -> node table used for directory entries. Slots keep insertion
+// order for listing; removing an entry leaves a hole that is squeezed out once
+// holes outnumber live entries. An open-addressing index (power-of-two sized,
+// linear probing) maps a name hash to its slot. An empty table owns no memory.
+typedef struct EntrySlot {
+    const char* name; // the node's own name
+    void* node;       // NULL once removed
+    uint32_t hash;
+} EntrySlot;
+
+typedef struct EntryTable {
+    EntrySlot* slots;
+    int used;       // slots handed out, holes included
+    int cap;
+    int count;      // live entries
+    int* index;     // bucket -> slot, ET_EMPTY or ET_DELETED
+    int index_cap;
+    int index_fill; // buckets not ET_EMPTY
+    Arena* arena;   // where the arrays live; NULL means vfs_arena
+} EntryTable;
+
+#define ET_EMPTY (-1)
+#define ET_DELETED (-2)
+
+uint32_t name_hash(const char* s) {
+    uint32_t h = 2166136261u;
+    while (*s) { h ^= (unsigned char)*s++; h *= 16777619u; }
+    return h;
+}
+
+Arena* et_arena(EntryTable* t) {
+    return t->arena ? t->arena : &vfs_arena;
+}
+
+void et_rebuild_index(EntryTable* t, int index_cap) {
+    arena_free(et_arena(t), t->index, t->index_cap * sizeof(int));
+    t->index = (int*)arena_alloc(et_arena(t), index_cap * sizeof(int));
+    for (int i=0;i<index_cap;i++) t->index[i] = ET_EMPTY;
+    t->index_cap = index_cap;
+    t->index_fill = 0;
+    for (int i=0;i<t->used;i++) {
+        if (!t->slots[i].node) continue;
+        uint32_t b = t->slots[i].hash & (index_cap-1);
+        while (t->index[b] != ET_EMPTY) b = (b+1) & (index_cap-1);
+        t->index[b] = i;
+        t->index_fill++;
+    }
+}
+
+// returns the bucket holding 'name', or -1
+int et_bucket(EntryTable* t, const char* name, uint32_t h) {
+    if (!t->index) return -1;
+    uint32_t b = h & (t->index_cap-1);
+    while (t->index[b] != ET_EMPTY) {
+        int s = t->index[b];
+        if (s >= 0 && t->slots[s].hash == h && strcmp(t->slots[s].name, name) == 0) return (int)b;
+        b = (b+1) & (t->index_cap-1);
+    }
+    return -1;
+}
+
+void* et_find(EntryTable* t, const char* name) {
+    int b = et_bucket(t, name, name_hash(name));
+    return b < 0 ? NULL : t->slots[t->index[b]].node;
+}
+
+// caller makes sure 'name' is not present yet
+void et_add(EntryTable* t, const char* name, void* node) {
+    if (t->used == t->cap) {
+        int cap = t->cap ? t->cap*2 : 4;
+        EntrySlot* slots = (EntrySlot*)arena_alloc(et_arena(t), cap * sizeof(EntrySlot));
+        if (t->used) memcpy(slots, t->slots, t->used * sizeof(EntrySlot));
+        arena_free(et_arena(t), t->slots, t->cap * sizeof(EntrySlot));
+        t->slots = slots;
+        t->cap = cap;
+    }
+    uint32_t h = name_hash(name);
+    int s = t->used++;
+    t->slots[s].name = name;
+    t->slots[s].node = node;
+    t->slots[s].hash = h;
+    t->count++;
+    if ((t->index_fill+1)*4 > t->index_cap*3) {
+        int cap = 8;
+        while (cap < t->count*2) cap *= 2;
+        et_rebuild_index(t, cap);
+        return;
+    }
+    uint32_t b = h & (t->index_cap-1);
+    while (t->index[b] >= 0) b = (b+1) & (t->index_cap-1);
+    if (t->index[b] == ET_EMPTY) t->index_fill++;
+    t->index[b] = s;
+}
+
+// unlinks 'name' and returns its node (not freed), or NULL
+void* et_remove(EntryTable* t, const char* name) {
+    int b = et_bucket(t, name, name_hash(name));
+    if (b < 0) return NULL;
+    int s = t->index[b];
+    void* node = t->slots[s].node;
+    t->slots[s].node = NULL;
+    t->index[b] = ET_DELETED;
+    t->count--;
+    if (t->used > 2*t->count + 8) {
+        // squeeze out holes, keeping order
+        int n = 0;
+        for (int i=0;i<t->used;i++) if (t->slots[i].node) t->slots[n++] = t->slots[i];
+        t->used = n;
+        et_rebuild_index(t, t->index_cap);
+    }
+    return node;
+}
+
+void et_free(EntryTable* t) {
+    Arena* a = t->arena;
+    arena_free(et_arena(t), t->slots, t->cap * sizeof(EntrySlot));
+    arena_free(et_arena(t), t->index, t->index_cap * sizeof(int));
+    memset(t, 0, sizeof(*t));
+    t->arena = a;
+}
+
+typedef struct Directory {
+    char* name; // arena-allocated
+    char* path; // full "/a/b/" form, arena-allocated; fixed for the directory's life (there is no rename)
+    struct Directory* parent;
+    EntryTable subdirs; // Directory*
+    EntryTable files;   // File*
+    pthread_rwlock_t lock; // server mode: guards both tables and the files' bodies
+    struct Directory* name_prev; // other directories with the same name (name index)
+    struct Directory* name_next;
+    uint64_t du_bytes, du_files, du_dirs; // totals of everything below, kept by usage_add
+    uint64_t quota; // byte limit on those totals; 0: none
+} Directory;
+
+typedef struct App {
+    char* name;
+    char* desc;
+    char* code; // for installed apps, the CODE block (NULL until first needed); for builtins, small tag
+    char* file; // manifest in /apps (installed apps only)
+    size_t file_size; // of the manifest the index entry was made from
+    int builtin; // 1 = builtin, 0 = installed
+    int compiled; // prog was looked up (installed apps only)
+    struct Program* prog; // compiled CODE block, NULL if it does not compile
+    int running; // tasks running it (atomic); one uninstalled meanwhile is freed by the last of them
+    int orphaned; // no longer registered
+} App;
+
+// Globals
+Directory* root;
+__thread Directory* current_dir; // per session in server mode
+// name -> App*, in registration order; the table lives in its own arena so wiping the tree leaves it alone
+Arena app_arena;
+EntryTable app_table = { .arena = &app_arena };
+
+Pool dir_pool = POOL_FOR(sizeof(Directory));
+Pool file_pool = POOL_FOR(sizeof(File));
+Pool blob_pool = POOL_FOR(sizeof(Blob));
+// chunk capacities 512 .. CHUNK_MAX, one pool each; smaller chunks come from the arena
+#define CHUNK_POOLS 8
+Pool chunk_pools[CHUNK_POOLS] = {
+    POOL_FOR(sizeof(Chunk) + 512), POOL_FOR(sizeof(Chunk) + 1024),
+    POOL_FOR(sizeof(Chunk) + 2048), POOL_FOR(sizeof(Chunk) + 4096),
+    POOL_FOR(sizeof(Chunk) + 8192), POOL_FOR(sizeof(Chunk) + 16384),
+    POOL_FOR(sizeof(Chunk) + 32768), POOL_FOR(sizeof(Chunk) + 65536),
+};
+
+// ---------- Locking ----------
+// Only server mode takes these; the single-user shell never touches a lock.
+//  - tree_lock: every command holds it shared, except the ones that free or
+//    replace whole subtrees (rmdir, wipe, importdisk) or walk all of it
+//    (exportdisk, compaction), which hold it exclusively. A task (see Tasks)
+//    holds it shared during each of its turns.
+//  - Directory.lock: readers of a directory (ls, cat, cd, path walks) share
+//    it; changes to its entries or its files' bodies take it exclusively, so
+//    writers in different directories proceed in parallel. A thread holds at
+//    most one directory lock at a time.
+//  - app_lock: the app registry; a task holds it shared during its turns.
+//    app_load_mutex serializes loading an app's code on first use.
+//  - quota_mutex: a write below a quota checks it and writes under this
+//    mutex, so two writers below the same quota cannot both pass the check.
+// Lock order: tree_lock, app_lock, app_load_mutex, quota_mutex, a directory,
+// then the snapshot, blob, index, journal and allocator mutexes.
+pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t app_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t app_load_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t quota_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void dir_rdlock(Directory* d) {
+    if (server_mode) pthread_rwlock_rdlock(&d->lock);
+}
+
+void dir_wrlock(Directory* d) {
+    if (server_mode) pthread_rwlock_wrlock(&d->lock);
+}
+
+void dir_unlock(Directory* d) {
+    if (server_mode) pthread_rwlock_unlock(&d->lock);
+}
+
+void tree_rdlock() {
+    if (server_mode) pthread_rwlock_rdlock(&tree_lock);
+}
+
+void tree_wrlock() {
+    if (server_mode) pthread_rwlock_wrlock(&tree_lock);
+}
+
+void tree_unlock() {
+    if (server_mode) pthread_rwlock_unlock(&tree_lock);
+}
+
+void apps_rdlock() {
+    if (server_mode) pthread_rwlock_rdlock(&app_lock);
+}
+
+void apps_wrlock() {
+    if (server_mode) pthread_rwlock_wrlock(&app_lock);
+}
+
+void apps_unlock() {
+    if (server_mode) pthread_rwlock_unlock(&app_lock);
+}
+
+// ---------- Utilities ----------
+// Worker pools: CPU-bound batches (decoding a compressed image, compiling
+// packages) are split over a few threads that claim jobs from a shared
+// counter; the calling thread is one of them.
+#define WORKERS_MAX 8
+int worker_threads = 0; // -j; 0: one per online CPU, up to WORKERS_MAX
+
+// threads worth starting for 'jobs' jobs, when each should get at least 'per_thread'
+int worker_count(uint32_t jobs, uint32_t per_thread) {
+    int n = worker_threads;
+    if (n <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cpus > 0 ? (int)cpus : 1;
+    }
+    if (n > WORKERS_MAX) n = WORKERS_MAX;
+    if ((uint32_t)n > jobs / per_thread) n = (int)(jobs / per_thread);
+    return n < 1 ? 1 : n;
+}
+
+// runs fn(arg) on n threads at once, this one included; returns how many ran
+int run_workers(void* (*fn)(void*), void* arg, int n) {
+    pthread_t workers[WORKERS_MAX];
+    int started = 0;
+    while (started < n-1 && started < WORKERS_MAX && pthread_create(&workers[started], NULL, fn, arg) == 0) started++;
+    fn(arg);
+    for (int i=0;i<started;i++) pthread_join(workers[i], NULL);
+    return started + 1;
+}
+
+Chunk* chunk_alloc(size_t cap) {
+    if (sizeof(Chunk) + cap <= ARENA_SMALL_MAX) return (Chunk*)arena_alloc(&vfs_arena, sizeof(Chunk) + cap);
+    int cls = 0;
+    for (size_t c = 512; c < cap; c *= 2) cls++;
+    return (Chunk*)pool_alloc(&chunk_pools[cls]);
+}
+
+void chunk_free(Chunk* ch) {
+    if (sizeof(Chunk) + ch->cap <= ARENA_SMALL_MAX) { arena_free(&vfs_arena, ch, sizeof(Chunk) + ch->cap); return; }
+    int cls = 0;
+    for (size_t c = 512; c < ch->cap; c *= 2) cls++;
+    pool_free(&chunk_pools[cls], ch);
+}
+
+void dcache_clear();
+void blob_table_reset();
+void index_reset();
+void index_file_added(File* f);
+void index_file_changed(File* f);
+void index_file_removed(File* f);
+void index_dir_added(Directory* d);
+void index_dir_removed(Directory* d);
+void snap_reset();
+void snap_file_added(File* f);
+void snap_file_changing(File* f);
+void snap_dir_added(Directory* d);
+void snap_dir_removing(Directory* d);
+void usage_add(Directory* d, int64_t bytes, int64_t files, int64_t dirs);
+
+// releases every node, name and chunk of the tree in one go
+void vfs_release_all() {
+    pool_reset(&dir_pool);
+    pool_reset(&file_pool);
+    pool_reset(&blob_pool);
+    blob_table_reset();
+    for (int i=0;i<CHUNK_POOLS;i++) pool_reset(&chunk_pools[i]);
+    arena_reset(&vfs_arena);
+    dcache_clear();
+    index_reset();
+    snap_reset();
+    root = NULL;
+}
+
+Directory* create_dir(const char* name, Directory* parent) {
+    Directory* d = (Directory*)pool_alloc(&dir_pool);
+    STAT_INC(stats.dirs_created);
+    d->name = arena_strdup(&vfs_arena, name, strlen(name));
+    if (parent) {
+        size_t plen = strlen(parent->path), nlen = strlen(d->name);
+        d->path = (char*)arena_alloc(&vfs_arena, plen + nlen + 2);
+        memcpy(d->path, parent->path, plen);
+        memcpy(d->path + plen, d->name, nlen);
+        d->path[plen+nlen] = '/';
+        d->path[plen+nlen+1] = '\0';
+    } else {
+        d->path = arena_strdup(&vfs_arena, "/", 1);
+    }
+    d->parent = parent;
+    memset(&d->subdirs, 0, sizeof(d->subdirs));
+    memset(&d->files, 0, sizeof(d->files));
+    pthread_rwlock_init(&d->lock, NULL);
+    d->name_prev = d->name_next = NULL;
+    d->du_bytes = d->du_files = d->du_dirs = 0;
+    d->quota = 0;
+    return d;
+}
+
+void content_append(Content* c, const char* data, size_t len) {
+    while (len > 0) {
+        Chunk* t = c->tail;
+        if (!t || t->len == t->cap) {
+            size_t cap = t ? t->cap*2 : CHUNK_MIN;
+            while (cap < len && cap < CHUNK_MAX) cap *= 2;
+            if (cap > CHUNK_MAX) cap = CHUNK_MAX;
+            Chunk* nc = chunk_alloc(cap);
+            nc->next = NULL;
+            nc->len = 0;
+            nc->cap = cap;
+            if (t) t->next = nc; else c->head = nc;
+            c->tail = t = nc;
+        }
+        size_t n = t->cap - t->len;
+        if (n > len) n = len;
+        memcpy(t->data + t->len, data, n);
+        t->len += n;
+        c->size += n;
+        data += n;
+        len -= n;
+    }
+}
+
+void content_append_str(Content* c, const char* s) {
+    content_append(c, s, strlen(s));
+}
+
+void content_free(Content* c) {
+    Chunk* ch = c->head;
+    while (ch) {
+        Chunk* next = ch->next;
+        chunk_free(ch);
+        ch = next;
+    }
+    c->head = c->tail = NULL;
+    c->size = 0;
+}
+
+void content_write(const Content* c, FILE* out) {
+    for (Chunk* ch = c->head; ch; ch = ch->next) fwrite(ch->data, 1, ch->len, out);
+}
+
+// a body on the shell output; a large one goes out as its chunks, together
+// with what was pending, in one writev per OUT_IOV_MAX of them
+void out_content(const Content* c) {
+    if (c->size < OUT_DIRECT_MIN) {
+        for (Chunk* ch = c->head; ch; ch = ch->next) out_put(ch->data, ch->len);
+        return;
+    }
+    OutBuf* o = out_current();
+    struct iovec v[OUT_IOV_MAX];
+    int n = 0;
+    if (o->len) { v[n].iov_base = o->data; v[n++].iov_len = o->len; }
+    for (Chunk* ch = c->head; ch; ch = ch->next) {
+        if (n == OUT_IOV_MAX) { write_all(o->fd, v, n); n = 0; }
+        v[n].iov_base = ch->data; v[n++].iov_len = ch->len;
+    }
+    write_all(o->fd, v, n);
+    o->len = 0;
+}
+
+uint64_t fnv1a64(const void* data, size_t len, uint64_t h) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i=0;i<len;i++) { h ^= p[i]; h *= 1099511628211ull; }
+    return h;
+}
+#define FNV64_INIT 14695981039346656037ull
+
+// Blob key: FNV-style multiply on whole 8-byte words, a byte-wise tail and a
+// final avalanche. The state carries a partial word across chunk boundaries,
+// so a body hashes the same however it is split.
+typedef struct BodyHash {
+    uint64_t h;
+    unsigned char buf[8];
+    size_t n;
+} BodyHash;
+
+void body_hash_word(BodyHash* s, const void* p) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    s->h = (s->h ^ w) * 1099511628211ull;
+    s->h ^= s->h >> 32;
+}
+
+void body_hash_update(BodyHash* s, const char* p, size_t len) {
+    if (s->n) {
+        size_t k = 8 - s->n < len ? 8 - s->n : len;
+        memcpy(s->buf + s->n, p, k);
+        s->n += k; p += k; len -= k;
+        if (s->n < 8) return;
+        body_hash_word(s, s->buf);
+        s->n = 0;
+    }
+    for (; len >= 8; p += 8, len -= 8) body_hash_word(s, p);
+    memcpy(s->buf, p, len);
+    s->n = len;
+}
+
+uint64_t body_hash_final(BodyHash* s) {
+    uint64_t h = fnv1a64(s->buf, s->n, s->h);
+    h ^= h >> 33; h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
+}
+
+uint64_t body_hash(const char* data, size_t len) {
+    BodyHash s = { FNV64_INIT, {0}, 0 };
+    body_hash_update(&s, data, len);
+    return body_hash_final(&s);
+}
+
+uint64_t content_hash(const Content* c) {
+    BodyHash s = { FNV64_INIT, {0}, 0 };
+    for (Chunk* ch = c->head; ch; ch = ch->next) body_hash_update(&s, ch->data, ch->len);
+    return body_hash_final(&s);
+}
+
+// 1 if the chunks of c hold exactly the len bytes at data
+int content_equals(const Content* c, const char* data, size_t len) {
+    if (c->size != len) return 0;
+    for (Chunk* ch = c->head; ch; ch = ch->next) {
+        if (memcmp(ch->data, data, ch->len) != 0) return 0;
+        data += ch->len;
+    }
+    return 1;
+}
+
+int content_equal(const Content* a, const Content* b) {
+    if (a->size != b->size) return 0;
+    // walk both chunk chains in step; chunk boundaries need not line up
+    Chunk* ca = a->head; Chunk* cb = b->head;
+    size_t ia = 0, ib = 0;
+    while (ca && cb) {
+        size_t n = ca->len - ia < cb->len - ib ? ca->len - ia : cb->len - ib;
+        if (memcmp(ca->data + ia, cb->data + ib, n) != 0) return 0;
+        ia += n; ib += n;
+        if (ia == ca->len) { ca = ca->next; ia = 0; }
+        if (ib == cb->len) { cb = cb->next; ib = 0; }
+    }
+    return 1;
+}
+
+// NUL-terminated copy of the whole body; caller frees
+char* content_flatten(const Content* c) {
+    char* s = (char*)malloc(c->size+1);
+    size_t pos = 0;
+    for (Chunk* ch = c->head; ch; ch = ch->next) {
+        memcpy(s+pos, ch->data, ch->len);
+        pos += ch->len;
+    }
+    s[pos] = '\0';
+    return s;
+}
+
+// ---------- Blob store ----------
+// Chained hash table of every live blob, grown to keep about one blob per
+// bucket. In server mode one mutex covers the table and the reference counts;
+// blob contents are read under the lock of a directory holding a reference.
+Blob** blob_buckets;
+size_t blob_nbuckets;
+size_t blob_count;
+uint64_t blob_bytes;
+pthread_mutex_t blob_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void blob_lock() {
+    if (server_mode) pthread_mutex_lock(&blob_mutex);
+}
+
+void blob_unlock() {
+    if (server_mode) pthread_mutex_unlock(&blob_mutex);
+}
+
+// the blobs themselves go with the node pools; this drops the table
+void blob_table_reset() {
+    free(blob_buckets);
+    blob_buckets = NULL;
+    blob_nbuckets = blob_count = 0;
+    blob_bytes = 0;
+}
+
+void blob_table_grow() {
+    size_t n = blob_nbuckets ? blob_nbuckets*2 : 256;
+    Blob** nb = (Blob**)calloc(n, sizeof(Blob*));
+    for (size_t i=0;i<blob_nbuckets;i++) {
+        Blob* b = blob_buckets[i];
+        while (b) {
+            Blob* next = b->next;
+            b->next = nb[b->hash & (n-1)];
+            nb[b->hash & (n-1)] = b;
+            b = next;
+        }
+    }
+    free(blob_buckets);
+    blob_buckets = nb;
+    blob_nbuckets = n;
+}
+
+// a referenced blob holding the content of 'body', which is taken over: its
+// chunks become the new blob, or are freed when an equal blob already exists
+// 'h' is content_hash(body), computed by the caller
+Blob* blob_intern_hashed(Content* body, uint64_t h) {
+    blob_lock();
+    if (blob_nbuckets) {
+        for (Blob* b = blob_buckets[h & (blob_nbuckets-1)]; b; b = b->next) {
+            if (b->hash == h && content_equal(&b->body, body)) {
+                b->refs++;
+                blob_unlock();
+                content_free(body);
+                STAT_INC(stats.blob_shared);
+                return b;
+            }
+        }
+    }
+    if (blob_count >= blob_nbuckets) blob_table_grow();
+    Blob* b = (Blob*)pool_alloc(&blob_pool);
+    b->hash = h;
+    b->refs = 1;
+    b->body = *body;
+    memset(body, 0, sizeof(*body));
+    b->next = blob_buckets[h & (blob_nbuckets-1)];
+    blob_buckets[h & (blob_nbuckets-1)] = b;
+    blob_count++;
+    blob_bytes += b->body.size;
+    blob_unlock();
+    return b;
+}
+
+Blob* blob_intern(Content* body) {
+    return blob_intern_hashed(body, content_hash(body));
+}
+
+void blob_retain(Blob* b) {
+    blob_lock();
+    b->refs++;
+    blob_unlock();
+}
+
+void blob_release(Blob* b) {
+    if (!b) return;
+    blob_lock();
+    if (--b->refs > 0) { blob_unlock(); return; }
+    Blob** pp = &blob_buckets[b->hash & (blob_nbuckets-1)];
+    while (*pp != b) pp = &(*pp)->next;
+    *pp = b->next;
+    blob_count--;
+    blob_bytes -= b->body.size;
+    blob_unlock();
+    content_free(&b->body);
+    pool_free(&blob_pool, b);
+}
+
+File* create_file(const char* name) {
+    File* f = (File*)pool_alloc(&file_pool);
+    STAT_INC(stats.files_created);
+    f->name = arena_strdup(&vfs_arena, name, strlen(name));
+    f->blob = NULL;
+    f->mapped = NULL;
+    f->mapped_len = 0;
+    f->dir = NULL;
+    f->words = NULL;
+    f->name_prev = f->name_next = NULL;
+    return f;
+}
+
+// a file whose body stays in the mapped image until it is rewritten
+File* create_mapped_file(const char* name, const char* data, size_t len) {
+    File* f = create_file(name);
+    f->mapped = data;
+    f->mapped_len = len;
+    return f;
+}
+
+// the body as chunks; a mapped body has none
+const Content* file_content(File* f) {
+    static const Content empty;
+    return f->blob ? &f->blob->body : &empty;
+}
+
+size_t file_size(File* f) {
+    return f->mapped ? f->mapped_len : file_content(f)->size;
+}
+
+// last byte of the body, or -1 when empty
+int file_last_byte(File* f) {
+    if (f->mapped) return f->mapped_len ? (unsigned char)f->mapped[f->mapped_len-1] : -1;
+    const Content* c = file_content(f);
+    return c->tail && c->tail->len ? (unsigned char)c->tail->data[c->tail->len-1] : -1;
+}
+
+// streams the body without copying it into one buffer
+void file_write(File* f, FILE* out) {
+    if (f->mapped) fwrite(f->mapped, 1, f->mapped_len, out);
+    else content_write(file_content(f), out);
+}
+
+// the body on the shell output, straight from its chunks or the image mapping
+void out_file(File* f) {
+    if (f->mapped) out_put(f->mapped, f->mapped_len);
+    else out_content(file_content(f));
+}
+
+// NUL-terminated copy of the body for parsers; caller frees
+char* file_flatten(File* f) {
+    if (!f->mapped) return content_flatten(file_content(f));
+    char* s = (char*)malloc(f->mapped_len+1);
+    memcpy(s, f->mapped, f->mapped_len);
+    s[f->mapped_len] = '\0';
+    return s;
+}
+
+// takes over the chunks of 'body', leaving it empty; an equal body already
+// stored elsewhere is shared instead
+void file_set_body(File* f, Content* body) {
+    if (f->dir) snap_file_changing(f);
+    int64_t grow = (int64_t)body->size - (int64_t)file_size(f);
+    blob_release(f->blob);
+    f->blob = body->size ? blob_intern(body) : NULL;
+    content_free(body);
+    f->mapped = NULL;
+    f->mapped_len = 0;
+    if (f->dir) {
+        index_file_changed(f);
+        usage_add(f->dir, grow, 0, 0);
+    }
+}
+
+// reads input lines into c until a line that is just 'end' (e.g. "END")
+void read_text_block(Content* c, const char* end) {
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    size_t elen = strlen(end);
+    while ((n = getline(&line, &cap, SHELL_IN)) > 0) {
+        if (strncmp(line, end, elen) == 0 &&
+            (strcmp(line+elen, "\n") == 0 || strcmp(line+elen, "\r\n") == 0 || line[elen] == '\0')) break;
+        content_append(c, line, (size_t)n);
+    }
+    free(line);
+}
+
+void free_file(File* f) {
+    if (!f) return;
+    if (f->dir) {
+        snap_file_changing(f);
+        index_file_removed(f);
+    }
+    blob_release(f->blob);
+    arena_free(&vfs_arena, f->name, strlen(f->name)+1);
+    pool_free(&file_pool, f);
+    STAT_INC(stats.files_freed);
+}
+
+void free_dir_recursive(Directory* d) {
+    if (!d) return;
+    if (d->parent) snap_dir_removing(d);
+    for (int i=0;i<d->subdirs.used;i++) {
+        if (d->subdirs.slots[i].node) free_dir_recursive((Directory*)d->subdirs.slots[i].node);
+    }
+    for (int i=0;i<d->files.used;i++) {
+        if (d->files.slots[i].node) free_file((File*)d->files.slots[i].node);
+    }
+    et_free(&d->subdirs);
+    et_free(&d->files);
+    if (d->parent) index_dir_removed(d);
+    arena_free(&vfs_arena, d->name, strlen(d->name)+1);
+    arena_free(&vfs_arena, d->path, strlen(d->path)+1);
+    pool_free(&dir_pool, d);
+    STAT_INC(stats.dirs_freed);
+}
+
+// copies the "/a/b/" form of a directory path used by the disk and journal
+void dir_path(Directory* d, char* buf, size_t n) {
+    snprintf(buf, n, "%s", d->path);
+}
+
+Directory* find_subdir(Directory* d, const char* name) {
+    return (Directory*)et_find(&d->subdirs, name);
+}
+
+File* find_file(Directory* d, const char* name) {
+    return (File*)et_find(&d->files, name);
+}
+
+// ---------- Usage accounting ----------
+// Every directory carries the totals of its subtree (body bytes, files and
+// directories below it). Each change adds its delta to the directory it
+// happened in and to every ancestor, so du, df and quota checks cost O(depth)
+// instead of a walk. Server sessions change different directories at once,
+// so there the adds are atomic; a reader may see a change on part of the chain only.
+int usage_loading = 0; // load_image counts each directory's own entries and sums them up once
+
+void usage_add(Directory* d, int64_t bytes, int64_t files, int64_t dirs) {
+    for (; d; d = usage_loading ? NULL : d->parent) {
+        if (!server_mode) {
+            d->du_bytes += (uint64_t)bytes;
+            d->du_files += (uint64_t)files;
+            d->du_dirs += (uint64_t)dirs;
+            continue;
+        }
+        __atomic_fetch_add(&d->du_bytes, (uint64_t)bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&d->du_files, (uint64_t)files, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&d->du_dirs, (uint64_t)dirs, __ATOMIC_RELAXED);
+    }
+}
+
+// the nearest directory from d up whose quota 'grow' more bytes would exceed; NULL if none
+Directory* quota_exceeded(Directory* d, int64_t grow) {
+    if (grow <= 0) return NULL;
+    for (; d; d = d->parent) {
+        uint64_t q = __atomic_load_n(&d->quota, __ATOMIC_RELAXED);
+        if (q && __atomic_load_n(&d->du_bytes, __ATOMIC_RELAXED) + (uint64_t)grow > q) return d;
+    }
+    return NULL;
+}
+
+// bytes that can still be written under d before a quota stops it; UINT64_MAX if none applies
+uint64_t quota_available(Directory* d) {
+    uint64_t avail = UINT64_MAX;
+    for (; d; d = d->parent) {
+        uint64_t q = __atomic_load_n(&d->quota, __ATOMIC_RELAXED);
+        if (!q) continue;
+        uint64_t used = __atomic_load_n(&d->du_bytes, __ATOMIC_RELAXED);
+        uint64_t left = used < q ? q - used : 0;
+        if (left < avail) avail = left;
+    }
+    return avail;
+}
+
+void add_subdir(Directory* parent, Directory* d) {
+    snap_dir_added(d);
+    et_add(&parent->subdirs, d->name, d);
+    index_dir_added(d);
+    usage_add(parent, (int64_t)d->du_bytes, (int64_t)d->du_files, (int64_t)d->du_dirs + 1);
+}
+
+void add_file(Directory* dir, File* f) {
+    f->dir = dir;
+    snap_file_added(f);
+    et_add(&dir->files, f->name, f);
+    index_file_added(f);
+    usage_add(dir, (int64_t)file_size(f), 1, 0);
+}
+
+// ---------- Path resolution ----------
+// Commands take absolute or relative paths. A path is first folded into the
+// "/a/b/" form of Directory.path, then looked up in a direct-mapped dentry
+// cache of full path -> Directory. A miss resolves the parent path the same
+// way and takes one step down, so a walk only covers the part of the path not
+// seen before. Directories are freed only by rmdir and wipe (exclusive in
+// server mode), which empty the cache; files are found in their cached parent.
+#define DCACHE_SIZE 4096 // power of two
+
+Directory* dcache[DCACHE_SIZE]; // slots are read and filled concurrently by server sessions
+
+void dcache_clear() {
+    for (int i=0;i<DCACHE_SIZE;i++) __atomic_store_n(&dcache[i], NULL, __ATOMIC_RELAXED);
+}
+
+// why the last path_normalize or resolve_file failed ("name too long" and the
+// like); NULL when the path was fine and simply does not exist
+__thread const char* path_error;
+
+// folds 'path' (absolute, or relative to 'base') into the "/a/b/" form,
+// resolving "." and ".." by name; 0 if a component or the result does not fit
+int path_normalize(Directory* base, const char* path, char* out, size_t n) {
+    size_t len;
+    path_error = NULL;
+    if (path[0] == '/' || !base) {
+        out[0] = '/';
+        len = 1;
+    } else {
+        len = strlen(base->path);
+        if (len >= n) { path_error = "path too long"; return 0; }
+        memcpy(out, base->path, len);
+    }
+    const char* p = path;
+    while (*p) {
+        while (*p == '/') p++;
+        if (!*p) break;
+        const char* e = p;
+        while (*e && *e != '/') e++;
+        size_t k = (size_t)(e - p);
+        if (k == 2 && p[0] == '.' && p[1] == '.') {
+            if (len > 1) { len--; while (out[len-1] != '/') len--; } // ".." of the root is the root
+        } else if (!(k == 1 && p[0] == '.')) {
+            if (k >= MAX_NAME) { path_error = "name too long"; return 0; }
+            if (len + k + 2 > n) { path_error = "path too long"; return 0; }
+            memcpy(out+len, p, k);
+            len += k;
+            out[len++] = '/';
+        }
+        p = e;
+    }
+    out[len] = '\0';
+    return 1;
+}
+
+// the directory for a normalized path of length len, or NULL; 'key' is
+// borrowed to resolve the parent path and restored before returning
+Directory* dcache_lookup(char* key, size_t len) {
+    if (len <= 1) return root;
+    uint32_t h = name_hash(key) & (DCACHE_SIZE-1);
+    Directory* d = __atomic_load_n(&dcache[h], __ATOMIC_ACQUIRE);
+    if (d && strcmp(d->path, key) == 0) { STAT_INC(stats.dcache_hits); return d; }
+    STAT_INC(stats.dcache_misses);
+    size_t plen = len-1;
+    while (key[plen-1] != '/') plen--;
+    size_t k = len-1-plen;
+    if (k >= MAX_NAME) return NULL;
+    char name[MAX_NAME];
+    memcpy(name, key+plen, k);
+    name[k] = '\0';
+    char saved = key[plen];
+    key[plen] = '\0';
+    Directory* parent = dcache_lookup(key, plen);
+    key[plen] = saved;
+    if (!parent) return NULL;
+    dir_rdlock(parent);
+    d = find_subdir(parent, name);
+    dir_unlock(parent);
+    if (d) __atomic_store_n(&dcache[h], d, __ATOMIC_RELEASE);
+    return d;
+}
+
+// the directory 'path' names (relative paths start at current_dir), or NULL
+Directory* resolve_dir(const char* path) {
+    char key[1024];
+    if (!path_normalize(current_dir, path, key, sizeof(key))) return NULL;
+    return dcache_lookup(key, strlen(key));
+}
+
+// the existing directory that holds the last component of 'path', or NULL;
+// the component is copied to name, which is left empty for the root itself
+Directory* resolve_parent(const char* path, char* name, size_t namelen) {
+    char key[1024];
+    name[0] = '\0';
+    if (!path_normalize(current_dir, path, key, sizeof(key))) return NULL;
+    size_t len = strlen(key);
+    if (len == 1) return root;
+    size_t plen = len-1;
+    while (key[plen-1] != '/') plen--;
+    key[len-1] = '\0';
+    snprintf(name, namelen, "%s", key+plen);
+    key[plen] = '\0';
+    return dcache_lookup(key, plen);
+}
+
+// resolve_parent for a path that must name a file: one ending in '/', "." or
+// ".." names a directory and fails with path_error "not a file"
+Directory* resolve_file(const char* path, char* name, size_t namelen) {
+    Directory* d = resolve_parent(path, name, namelen);
+    if (!d) return NULL;
+    size_t len = strlen(path);
+    const char* last = path + len;
+    while (last > path && last[-1] != '/') last--;
+    if (!name[0] || len == 0 || path[len-1] == '/' || strcmp(last, ".") == 0 || strcmp(last, "..") == 0) {
+        path_error = "not a file";
+        return NULL;
+    }
+    return d;
+}
+
+// ---------- Search index ----------
+// Two indexes answer 'find' and 'grep' without walking the tree:
+//  - names: every file and directory name -> the nodes carrying it, as
+//    intrusive lists through File/Directory.name_prev/next;
+//  - words: every word of a file body -> a posting per file holding it. A
+//    file also chains its own postings, so rewriting or removing it unlinks
+//    exactly its entries.
+// A word is a run of ASCII letters, digits, '_' or non-ASCII bytes, folded to
+// lower case; longer runs than INDEX_WORD_MAX are not indexed, nor are bodies
+// holding a NUL byte (binary files such as the bytecode caches). The nodes
+// hook in through add_file/add_subdir/file_set_body/free_file, so every path
+// that changes the tree keeps the indexes current. The word index is saved
+// in the disk image and attached again at load instead of rescanning bodies.
+// In server mode index_mutex covers both; it is taken under a directory lock,
+// so queries copy what they need and drop it before reading any file.
+#define INDEX_WORD_MAX 32
+
+typedef struct WordEntry {
+    char* word;
+    struct Posting* head;
+    uint32_t count; // files holding the word
+    uint32_t mark;  // index_mark of the last file posted, to post each file once
+    uint32_t id;    // position in the saved index, while an image is written
+} WordEntry;
+
+typedef struct Posting {
+    File* file;
+    WordEntry* word;
+    struct Posting* prev; // in the word's list
+    struct Posting* next;
+    struct Posting* file_next; // in the file's list
+} Posting;
+
+typedef struct NameEntry {
+    char* name;
+    File* files;
+    Directory* dirs;
+    uint32_t count;
+} NameEntry;
+
+Pool word_pool = POOL_FOR(sizeof(WordEntry));
+Pool posting_pool = POOL_FOR(sizeof(Posting));
+Pool name_pool = POOL_FOR(sizeof(NameEntry));
+EntryTable word_table;  // WordEntry*
+EntryTable name_table;  // NameEntry*
+uint64_t index_postings;
+uint32_t index_mark;
+int index_loading = 0; // load_image attaches the saved word index itself
+pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void index_lock() {
+    if (server_mode) pthread_mutex_lock(&index_mutex);
+}
+
+void index_unlock() {
+    if (server_mode) pthread_mutex_unlock(&index_mutex);
+}
+
+// the entries themselves go with the pools and the arena; this forgets them
+void index_reset() {
+    pool_reset(&word_pool);
+    pool_reset(&posting_pool);
+    pool_reset(&name_pool);
+    memset(&word_table, 0, sizeof(word_table));
+    memset(&name_table, 0, sizeof(name_table));
+    index_postings = 0;
+}
+
+// bytes that words are made of (GNU range designators; the build is gcc-only)
+const unsigned char word_class[256] = {
+    ['0' ... '9'] = 1, ['A' ... 'Z'] = 1, ['_'] = 1, ['a' ... 'z'] = 1, [0x80 ... 0xff] = 1,
+};
+
+int word_char(unsigned char c) {
+    return word_class[c];
+}
+
+// the words of a body, split outside the index lock
+typedef struct WordList {
+    char* buf; // NUL-separated and lower-cased, repeats included
+    size_t len, cap;
+    char cur[INDEX_WORD_MAX+1];
+    size_t cur_len; // above INDEX_WORD_MAX: too long to index
+    int binary;
+} WordList;
+
+void words_end(WordList* l) {
+    if (l->cur_len && l->cur_len <= INDEX_WORD_MAX) {
+        if (l->len + l->cur_len + 1 > l->cap) {
+            l->cap = l->cap ? l->cap*2 : 256;
+            while (l->len + l->cur_len + 1 > l->cap) l->cap *= 2;
+            l->buf = (char*)realloc(l->buf, l->cap);
+        }
+        memcpy(l->buf + l->len, l->cur, l->cur_len);
+        l->len += l->cur_len;
+        l->buf[l->len++] = '\0';
+    }
+    l->cur_len = 0;
+}
+
+// may be fed a body piece by piece; a word can straddle two pieces
+void words_scan(WordList* l, const char* data, size_t n) {
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + n;
+    while (p < end && !l->binary) {
+        if (!word_class[*p]) {
+            if (*p == '\0') l->binary = 1;
+            else words_end(l);
+            p++;
+            continue;
+        }
+        const unsigned char* s = p;
+        while (p < end && word_class[*p]) p++;
+        for (; s < p && l->cur_len < INDEX_WORD_MAX; s++) l->cur[l->cur_len++] = (char)((*s >= 'A' && *s <= 'Z') ? *s + 32 : *s);
+        l->cur_len += (size_t)(p - s); // past INDEX_WORD_MAX only the length is kept
+    }
+}
+
+void file_words(File* f, WordList* l) {
+    if (f->mapped) words_scan(l, f->mapped, f->mapped_len);
+    else for (Chunk* ch = file_content(f)->head; ch; ch = ch->next) words_scan(l, ch->data, ch->len);
+    words_end(l);
+}
+
+// index lock held; created on first use
+WordEntry* index_word(const char* word) {
+    WordEntry* w = (WordEntry*)et_find(&word_table, word);
+    if (w) return w;
+    w = (WordEntry*)pool_alloc(&word_pool);
+    w->word = arena_strdup(&vfs_arena, word, INDEX_WORD_MAX);
+    w->head = NULL;
+    w->count = 0;
+    w->mark = 0;
+    et_add(&word_table, w->word, w);
+    return w;
+}
+
+void index_link(File* f, WordEntry* w) {
+    Posting* p = (Posting*)pool_alloc(&posting_pool);
+    p->file = f;
+    p->word = w;
+    p->prev = NULL;
+    p->next = w->head;
+    if (w->head) w->head->prev = p;
+    w->head = p;
+    w->count++;
+    p->file_next = f->words;
+    f->words = p;
+    index_postings++;
+}
+
+// posts every distinct word of 'l' for f; index lock held
+void index_post_words(File* f, WordList* l) {
+    if (l->binary) return;
+    if (++index_mark == 0) ++index_mark; // 0 is the mark of a fresh entry
+    for (size_t i=0;i<l->len;i += strlen(l->buf+i)+1) {
+        WordEntry* w = index_word(l->buf+i);
+        if (w->mark == index_mark) continue;
+        w->mark = index_mark;
+        index_link(f, w);
+    }
+}
+
+// index lock held
+void index_drop_words(File* f) {
+    Posting* p = f->words;
+    while (p) {
+        Posting* next = p->file_next;
+        WordEntry* w = p->word;
+        if (p->prev) p->prev->next = p->next;
+        else w->head = p->next;
+        if (p->next) p->next->prev = p->prev;
+        if (--w->count == 0) {
+            et_remove(&word_table, w->word);
+            arena_free(&vfs_arena, w->word, strlen(w->word)+1);
+            pool_free(&word_pool, w);
+        }
+        pool_free(&posting_pool, p);
+        index_postings--;
+        p = next;
+    }
+    f->words = NULL;
+}
+
+// index lock held; created on first use
+NameEntry* index_name(const char* name) {
+    NameEntry* e = (NameEntry*)et_find(&name_table, name);
+    if (e) return e;
+    e = (NameEntry*)pool_alloc(&name_pool);
+    e->name = arena_strdup(&vfs_arena, name, strlen(name));
+    e->files = NULL;
+    e->dirs = NULL;
+    e->count = 0;
+    et_add(&name_table, e->name, e);
+    return e;
+}
+
+// index lock held
+void index_name_unused(NameEntry* e) {
+    if (--e->count > 0) return;
+    et_remove(&name_table, e->name);
+    arena_free(&vfs_arena, e->name, strlen(e->name)+1);
+    pool_free(&name_pool, e);
+}
+
+void index_file_added(File* f) {
+    WordList l = {0};
+    if (!index_loading) file_words(f, &l);
+    index_lock();
+    NameEntry* e = index_name(f->name);
+    f->name_prev = NULL;
+    f->name_next = e->files;
+    if (e->files) e->files->name_prev = f;
+    e->files = f;
+    e->count++;
+    index_post_words(f, &l);
+    index_unlock();
+    free(l.buf);
+}
+
+void index_file_changed(File* f) {
+    WordList l = {0};
+    file_words(f, &l);
+    index_lock();
+    index_drop_words(f);
+    index_post_words(f, &l);
+    index_unlock();
+    free(l.buf);
+}
+
+void index_file_removed(File* f) {
+    index_lock();
+    index_drop_words(f);
+    NameEntry* e = (NameEntry*)et_find(&name_table, f->name);
+    if (f->name_prev) f->name_prev->name_next = f->name_next;
+    else e->files = f->name_next;
+    if (f->name_next) f->name_next->name_prev = f->name_prev;
+    index_name_unused(e);
+    index_unlock();
+}
+
+void index_dir_added(Directory* d) {
+    index_lock();
+    NameEntry* e = index_name(d->name);
+    d->name_prev = NULL;
+    d->name_next = e->dirs;
+    if (e->dirs) e->dirs->name_prev = d;
+    e->dirs = d;
+    e->count++;
+    index_unlock();
+}
+
+void index_dir_removed(Directory* d) {
+    index_lock();
+    NameEntry* e = (NameEntry*)et_find(&name_table, d->name);
+    if (d->name_prev) d->name_prev->name_next = d->name_next;
+    else e->dirs = d->name_next;
+    if (d->name_next) d->name_next->name_prev = d->name_prev;
+    index_name_unused(e);
+    index_unlock();
+}
+
+// scans the bodies of a whole subtree, for images saved without an index
+void index_rebuild(Directory* d) {
+    for (int i=0;i<d->files.used;i++) {
+        File* f = (File*)d->files.slots[i].node;
+        if (f) index_file_changed(f);
+    }
+    for (int i=0;i<d->subdirs.used;i++) {
+        if (d->subdirs.slots[i].node) index_rebuild((Directory*)d->subdirs.slots[i].node);
+    }
+}
+
+// The saved word index, the last section of the disk image:
+//   uint32 word count, then per word its uint8 length and bytes;
+//   then per file, in file table order, a uint32 count and that many uint32
+//   positions in the word list
+// (unaligned; read with memcpy). The files are walked in the image writer's
+// order, so a file's record lines up with its file table entry.
+void index_write_files(Directory* d, FILE* out, uint64_t* bytes) {
+    for (int i=0;i<d->files.used;i++) {
+        File* f = (File*)d->files.slots[i].node;
+        if (!f) continue;
+        uint32_t n = 0;
+        for (Posting* p = f->words; p; p = p->file_next) n++;
+        fwrite(&n, sizeof(n), 1, out);
+        for (Posting* p = f->words; p; p = p->file_next) fwrite(&p->word->id, sizeof(uint32_t), 1, out);
+        *bytes += sizeof(uint32_t) * (1 + (uint64_t)n);
+    }
+    for (int i=0;i<d->subdirs.used;i++) {
+        if (d->subdirs.slots[i].node) index_write_files((Directory*)d->subdirs.slots[i].node, out, bytes);
+    }
+}
+
+uint64_t index_write(FILE* out) {
+    uint32_t count = (uint32_t)word_table.count, n = 0;
+    uint64_t bytes = sizeof(count);
+    fwrite(&count, sizeof(count), 1, out);
+    for (int i=0;i<word_table.used;i++) {
+        WordEntry* w = (WordEntry*)word_table.slots[i].node;
+        if (!w) continue;
+        uint8_t len = (uint8_t)strlen(w->word);
+        w->id = n++;
+        fwrite(&len, 1, 1, out);
+        fwrite(w->word, 1, len, out);
+        bytes += 1 + len;
+    }
+    index_write_files(root, out, &bytes);
+    return bytes;
+}
+
+// attaches a saved word index to the files just loaded (byseq: file table
+// position -> File, NULL where an entry was skipped); 0 if it is damaged, in
+// which case nothing was attached
+int index_load(const char* data, uint64_t size, File** byseq, uint32_t nfiles) {
+    const char* end = data + size;
+    uint32_t nwords;
+    if (size < sizeof(nwords)) return 0;
+    memcpy(&nwords, data, sizeof(nwords));
+    if (nwords > size) return 0;
+    const char** words = (const char**)malloc((nwords ? nwords : 1) * sizeof(char*));
+    const char* p = data + sizeof(nwords);
+    int ok = 1;
+    for (uint32_t i=0;i<nwords && ok;i++) {
+        words[i] = p; // length byte, then the word
+        ok = end - p >= 1 && (uint8_t)*p >= 1 && (uint8_t)*p <= INDEX_WORD_MAX && end - p > (uint8_t)*p;
+        if (ok) p += 1 + (uint8_t)*p;
+    }
+    const char* postings = p;
+    for (uint32_t i=0;i<nfiles && ok;i++) {
+        uint32_t n;
+        ok = (size_t)(end - p) >= sizeof(n);
+        if (!ok) break;
+        memcpy(&n, p, sizeof(n));
+        p += sizeof(n);
+        ok = (size_t)(end - p) / sizeof(uint32_t) >= n;
+        for (uint32_t j=0;j<n && ok;j++) {
+            uint32_t id;
+            memcpy(&id, p, sizeof(id));
+            p += sizeof(id);
+            ok = id < nwords;
+        }
+    }
+    if (!ok) { free(words); return 0; }
+    // valid: every entry is created on first use, so words of skipped files leave nothing behind
+    WordEntry** entries = (WordEntry**)calloc(nwords ? nwords : 1, sizeof(WordEntry*));
+    p = postings;
+    for (uint32_t i=0;i<nfiles;i++) {
+        uint32_t n;
+        memcpy(&n, p, sizeof(n));
+        p += sizeof(n);
+        for (uint32_t j=0;j<n;j++, p += sizeof(uint32_t)) {
+            uint32_t id;
+            memcpy(&id, p, sizeof(id));
+            if (!byseq[i]) continue;
+            if (!entries[id]) {
+                char word[INDEX_WORD_MAX+1];
+                uint8_t len = (uint8_t)words[id][0];
+                memcpy(word, words[id]+1, len);
+                word[len] = '\0';
+                entries[id] = index_word(word);
+            }
+            index_link(byseq[i], entries[id]);
+        }
+    }
+    free(entries);
+    free(words);
+    return 1;
+}
+
+// ---------- Snapshots ----------
+// 'snapshot <name>' freezes the whole tree in O(1): nothing is copied when it
+// is taken. Instead the newest snapshot records the previous state of a path
+// the first time that path changes afterwards: a file's old body (a shared
+// reference to its blob, or its bytes in the mapped image), that a file or
+// directory did not exist yet, or that a removed directory did. The state of
+// a path at snapshot S is the one S recorded or, failing that, the one the
+// first newer snapshot recorded, or else the live one. Restoring S therefore
+// only visits paths changed since S, and a snapshot costs memory in
+// proportion to what changed after it was taken.
+// The records are taken by hooks next to the search index ones, so journal
+// replay (and importdisk) feed them like any other change. Snapshots are saved
+// in the disk image (see Binary disk image).
+#define SNAP_NONE 0 // the path did not exist
+#define SNAP_FILE 1 // a file, with its body in 'file'
+#define SNAP_DIR 2  // a directory; what it held has entries of its own
+
+typedef struct SnapEntry {
+    char* path; // "/a/b/" for a directory, "/a/b/c" for a file
+    int kind;
+    File* file; // SNAP_FILE: outside the tree, sharing the old body
+} SnapEntry;
+
+typedef struct Snapshot {
+    char* name;
+    int64_t created;
+    EntryTable entries; // path -> SnapEntry*, in recording order
+    uint64_t bytes;     // size of the bodies it holds on to
+    struct Snapshot* older;
+    struct Snapshot* newer;
+} Snapshot;
+
+Pool snapshot_pool = POOL_FOR(sizeof(Snapshot));
+Pool snap_entry_pool = POOL_FOR(sizeof(SnapEntry));
+Snapshot* snap_oldest;
+// the snapshot taking records; only changes under the tree write lock, so
+// the hooks may test it without snap_mutex, which guards the entry tables
+Snapshot* snap_newest;
+int snap_count;
+// set while import builds a detached subtree (tree held exclusively); the
+// subtree is recorded with snap_subtree_added once it is attached
+int snap_paused = 0;
+pthread_mutex_t snap_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void snap_lock() {
+    if (server_mode) pthread_mutex_lock(&snap_mutex);
+}
+
+void snap_unlock() {
+    if (server_mode) pthread_mutex_unlock(&snap_mutex);
+}
+
+// everything goes with the pools and the arena, like the tree
+void snap_reset() {
+    pool_reset(&snapshot_pool);
+    pool_reset(&snap_entry_pool);
+    snap_oldest = snap_newest = NULL;
+    snap_count = 0;
+}
+
+Snapshot* snap_find(const char* name) {
+    for (Snapshot* s = snap_oldest; s; s = s->newer)
+        if (strcmp(s->name, name) == 0) return s;
+    return NULL;
+}
+
+Snapshot* snap_create(const char* name, int64_t created) {
+    Snapshot* s = (Snapshot*)pool_alloc(&snapshot_pool);
+    s->name = arena_strdup(&vfs_arena, name, strlen(name));
+    s->created = created;
+    memset(&s->entries, 0, sizeof(s->entries));
+    s->bytes = 0;
+    s->older = snap_newest;
+    s->newer = NULL;
+    if (snap_newest) snap_newest->newer = s;
+    else snap_oldest = s;
+    snap_newest = s;
+    snap_count++;
+    return s;
+}
+
+void snap_entry_free(SnapEntry* e) {
+    free_file(e->file);
+    arena_free(&vfs_arena, e->path, strlen(e->path)+1);
+    pool_free(&snap_entry_pool, e);
+}
+
+// forgets s; what it recorded still matters to the next older snapshot,
+// which takes over every path it has no record of itself
+void snap_drop(Snapshot* s) {
+    Snapshot* o = s->older;
+    for (int i=0;i<s->entries.used;i++) {
+        SnapEntry* e = (SnapEntry*)s->entries.slots[i].node;
+        if (!e) continue;
+        if (o && !et_find(&o->entries, e->path)) {
+            et_add(&o->entries, e->path, e);
+            if (e->file) o->bytes += file_size(e->file);
+        } else {
+            snap_entry_free(e);
+        }
+    }
+    et_free(&s->entries);
+    if (s->older) s->older->newer = s->newer;
+    else snap_oldest = s->newer;
+    if (s->newer) s->newer->older = s->older;
+    else snap_newest = s->older;
+    snap_count--;
+    arena_free(&vfs_arena, s->name, strlen(s->name)+1);
+    pool_free(&snapshot_pool, s);
+}
+
+// a file outside the tree holding the same body (shared, not copied)
+File* snap_body(File* f) {
+    File* c = create_file(f->name);
+    c->blob = f->blob;
+    if (c->blob) blob_retain(c->blob);
+    c->mapped = f->mapped;
+    c->mapped_len = f->mapped_len;
+    return c;
+}
+
+SnapEntry* snap_entry_new(const char* path, int kind, File* body) {
+    SnapEntry* e = (SnapEntry*)pool_alloc(&snap_entry_pool);
+    e->path = arena_strdup(&vfs_arena, path, strlen(path));
+    e->kind = kind;
+    e->file = body;
+    return e;
+}
+
+// the first change to 'path' since the newest snapshot: remember how it was
+void snap_record(const char* path, int kind, File* f) {
+    snap_lock();
+    Snapshot* s = snap_newest;
+    if (!et_find(&s->entries, path)) {
+        SnapEntry* e = snap_entry_new(path, kind, f ? snap_body(f) : NULL);
+        et_add(&s->entries, e->path, e);
+        if (f) s->bytes += file_size(f);
+    }
+    snap_unlock();
+}
+
+void snap_file_record(File* f, int kind) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s%s", f->dir->path, f->name);
+    snap_record(path, kind, kind == SNAP_FILE ? f : NULL);
+}
+
+// hooks: called before the change, with the directory write-locked
+void snap_file_added(File* f) {
+    if (snap_newest && !snap_paused) snap_file_record(f, SNAP_NONE);
+}
+
+void snap_file_changing(File* f) {
+    if (snap_newest && !snap_paused) snap_file_record(f, SNAP_FILE);
+}
+
+void snap_dir_added(Directory* d) {
+    if (snap_newest && !snap_paused) snap_record(d->path, SNAP_NONE, NULL);
+}
+
+void snap_dir_removing(Directory* d) {
+    if (snap_newest && !snap_paused) snap_record(d->path, SNAP_DIR, NULL);
+}
+
+// a subtree that appeared at once: every path in it did not exist before
+void snap_subtree_added(Directory* d) {
+    if (!snap_newest) return;
+    snap_dir_added(d);
+    for (int i=0;i<d->files.used;i++) {
+        if (d->files.slots[i].node) snap_file_added((File*)d->files.slots[i].node);
+    }
+    for (int i=0;i<d->subdirs.used;i++) {
+        if (d->subdirs.slots[i].node) snap_subtree_added((Directory*)d->subdirs.slots[i].node);
+    }
+}
+
+// Saved snapshots, the section after the index:
+//   uint32 count, then per snapshot (oldest first): uint8 name length, the
+//   name, int64 creation time, uint32 entry count, and per entry: uint8
+//   kind, uint16 path length, the path and, for SNAP_FILE, the uint32
+//   position of its body in the file table
+// The bodies are file table entries outside the tree (see Binary disk
+// image), numbered from 'seq' in this same order.
+uint64_t snap_write(FILE* out, uint32_t seq) {
+    uint32_t count = (uint32_t)snap_count;
+    uint64_t bytes = sizeof(count);
+    fwrite(&count, sizeof(count), 1, out);
+    for (Snapshot* s = snap_oldest; s; s = s->newer) {
+        uint8_t nlen = (uint8_t)strlen(s->name);
+        uint32_t n = (uint32_t)s->entries.count;
+        fwrite(&nlen, 1, 1, out);
+        fwrite(s->name, 1, nlen, out);
+        fwrite(&s->created, sizeof(s->created), 1, out);
+        fwrite(&n, sizeof(n), 1, out);
+        bytes += 1 + nlen + sizeof(s->created) + sizeof(n);
+        for (int i=0;i<s->entries.used;i++) {
+            SnapEntry* e = (SnapEntry*)s->entries.slots[i].node;
+            if (!e) continue;
+            uint8_t kind = (uint8_t)e->kind;
+            uint16_t plen = (uint16_t)strlen(e->path);
+            fwrite(&kind, 1, 1, out);
+            fwrite(&plen, sizeof(plen), 1, out);
+            fwrite(e->path, 1, plen, out);
+            bytes += 1 + sizeof(plen) + plen;
+            if (e->kind == SNAP_FILE) {
+                fwrite(&seq, sizeof(seq), 1, out);
+                seq++;
+                bytes += sizeof(seq);
+            }
+        }
+    }
+    return bytes;
+}
+
+// rebuilds the saved snapshots around the bodies the loader made (byseq:
+// file table position -> File, with the ones outside the tree from 'first'
+// on); takes the bodies it uses out of byseq. 0 if the section is damaged,
+// in which case none are restored
+int snap_load(const char* data, uint64_t size, File** byseq, uint32_t first, uint32_t nfiles) {
+    for (int apply=0;apply<2;apply++) {
+        const char* p = data;
+        const char* end = data + size;
+        uint32_t count;
+        if (size < sizeof(count)) return 0;
+        memcpy(&count, p, sizeof(count));
+        p += sizeof(count);
+        for (uint32_t i=0;i<count;i++) {
+            char name[MAX_NAME];
+            int64_t created;
+            uint32_t n;
+            if (end - p < 1) return 0;
+            uint8_t nlen = (uint8_t)*p++;
+            if (nlen == 0 || nlen >= MAX_NAME || (size_t)(end - p) < nlen + sizeof(created) + sizeof(n)) return 0;
+            memcpy(name, p, nlen);
+            name[nlen] = '\0';
+            p += nlen;
+            memcpy(&created, p, sizeof(created));
+            p += sizeof(created);
+            memcpy(&n, p, sizeof(n));
+            p += sizeof(n);
+            Snapshot* s = apply ? snap_create(name, created) : NULL;
+            for (uint32_t j=0;j<n;j++) {
+                char path[1024];
+                uint16_t plen;
+                uint32_t seq = 0;
+                if ((size_t)(end - p) < 1 + sizeof(plen)) return 0;
+                uint8_t kind = (uint8_t)*p++;
+                memcpy(&plen, p, sizeof(plen));
+                p += sizeof(plen);
+                if (kind > SNAP_DIR || plen == 0 || plen >= sizeof(path) || end - p < plen) return 0;
+                memcpy(path, p, plen);
+                path[plen] = '\0';
+                p += plen;
+                if (kind == SNAP_FILE) {
+                    if ((size_t)(end - p) < sizeof(seq)) return 0;
+                    memcpy(&seq, p, sizeof(seq));
+                    p += sizeof(seq);
+                    if (seq < first || seq >= nfiles) return 0;
+                }
+                if (!apply || et_find(&s->entries, path)) continue;
+                File* body = NULL;
+                if (kind == SNAP_FILE) {
+                    if (!(body = byseq[seq])) continue; // its extent did not load
+                    byseq[seq] = NULL;
+                    s->bytes += file_size(body);
+                }
+                SnapEntry* e = snap_entry_new(path, kind, body);
+                et_add(&s->entries, e->path, e);
+            }
+        }
+    }
+    return 1;
+}
+
+// ---------- Virtual disk save/load ----------
+void save_dir_to_file(FILE* f, Directory* dir, const char* path) {
+    char fullpath[1024];
+    for (int i=0;i<dir->subdirs.used;i++) {
+        Directory* sd = (Directory*)dir->subdirs.slots[i].node;
+        if (!sd) continue;
+        snprintf(fullpath, sizeof(fullpath), "%s%s/", path, sd->name);
+        fprintf(f, "DIR %s\n", fullpath);
+        if (sd->quota) fprintf(f, "QUOTA %llu %s\n", (unsigned long long)sd->quota, fullpath);
+        save_dir_to_file(f, sd, fullpath);
+    }
+    for (int i=0;i<dir->files.used;i++) {
+        File* fl = (File*)dir->files.slots[i].node;
+        if (!fl) continue;
+        snprintf(fullpath, sizeof(fullpath), "%s%s", path, fl->name);
+        fprintf(f, "FILE %s\n", fullpath);
+        if (file_size(fl) > 0) {
+            file_write(fl, f);
+            if (file_last_byte(fl) != '\n')
+                fprintf(f, "\n");
+        }
+        fprintf(f, "END\n");
+    }
+}
+
+// writes the text form of the tree to a temp file and renames it over 'path'; returns 1 on success
+int write_text_image(const char* path) {
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* f = fopen(tmp, "w");
+    if (!f) return 0;
+    if (root->quota) fprintf(f, "QUOTA %llu /\n", (unsigned long long)root->quota);
+    save_dir_to_file(f, root, "/");
+    int ok = (fflush(f) == 0 && fsync(fileno(f)) == 0);
+    if (fclose(f) != 0) ok = 0;
+    if (ok && rename(tmp, path) != 0) ok = 0;
+    if (!ok) remove(tmp);
+    return ok;
+}
+
+// ---------- LZ codec ----------
+// A small self-contained LZ77 block codec in the spirit of LZ4. Each sequence
+// is a token byte (literal run length in the high nibble, match length - 4 in
+// the low one; a nibble of 15 continues in bytes of up to 255), the literals,
+// then a 2-byte little-endian offset back into the output. The last sequence
+// of a block carries only literals. Blocks are at most 64 KiB, so offsets fit.
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+// appends one sequence; 0 if it would not fit in cap
+int lz_emit(unsigned char* dst, size_t cap, size_t* op, const unsigned char* lit, size_t nlit, size_t off, size_t mlen) {
+    size_t o = *op;
+    if (o + 1 + nlit/255 + 1 + nlit + 2 + mlen/255 + 1 > cap) return 0;
+    unsigned char* token = dst + o++;
+    size_t l = nlit;
+    *token = (unsigned char)((l >= 15 ? 15 : l) << 4);
+    if (l >= 15) {
+        for (l -= 15; l >= 255; l -= 255) dst[o++] = 255;
+        dst[o++] = (unsigned char)l;
+    }
+    memcpy(dst + o, lit, nlit);
+    o += nlit;
+    if (mlen) {
+        dst[o++] = (unsigned char)(off & 255);
+        dst[o++] = (unsigned char)(off >> 8);
+        size_t m = mlen - LZ_MIN_MATCH;
+        *token |= (unsigned char)(m >= 15 ? 15 : m);
+        if (m >= 15) {
+            for (m -= 15; m >= 255; m -= 255) dst[o++] = 255;
+            dst[o++] = (unsigned char)m;
+        }
+    }
+    *op = o;
+    return 1;
+}
+
+// compresses n <= 64 KiB bytes; returns the compressed size, or 0 if it would not fit in cap
+size_t lz_compress(const unsigned char* src, size_t n, unsigned char* dst, size_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS]; // position + 1 of the last 4-byte sequence with this hash
+    memset(table, 0, sizeof(table));
+    size_t ip = 0, anchor = 0, op = 0;
+    while (ip + LZ_MIN_MATCH <= n) {
+        uint32_t seq;
+        memcpy(&seq, src + ip, 4);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t cand = table[h];
+        table[h] = (uint32_t)ip + 1;
+        if (!cand || ip - (cand-1) > 65535 || memcmp(src + cand-1, src + ip, LZ_MIN_MATCH) != 0) { ip++; continue; }
+        size_t ref = cand-1, len = LZ_MIN_MATCH;
+        while (ip + len < n && src[ref+len] == src[ip+len]) len++;
+        if (!lz_emit(dst, cap, &op, src + anchor, ip - anchor, ip - ref, len)) return 0;
+        ip += len;
+        anchor = ip;
+    }
+    if (!lz_emit(dst, cap, &op, src + anchor, n - anchor, 0, 0)) return 0;
+    return op;
+}
+
+// decodes a block that must expand to exactly raw bytes; 0 if it is damaged
+int lz_decompress(const unsigned char* src, size_t n, unsigned char* dst, size_t raw) {
+    size_t ip = 0, op = 0;
+    while (ip < n) {
+        unsigned tok = src[ip++];
+        size_t l = tok >> 4;
+        if (l == 15) {
+            unsigned char b;
+            do { if (ip >= n) return 0; b = src[ip++]; l += b; } while (b == 255);
+        }
+        if (l > n - ip || l > raw - op) return 0;
+        memcpy(dst + op, src + ip, l);
+        ip += l;
+        op += l;
+        if (ip == n) break;
+        if (n - ip < 2) return 0;
+        size_t off = src[ip] | ((size_t)src[ip+1] << 8);
+        ip += 2;
+        size_t m = tok & 15;
+        if (m == 15) {
+            unsigned char b;
+            do { if (ip >= n) return 0; b = src[ip++]; m += b; } while (b == 255);
+        }
+        m += LZ_MIN_MATCH;
+        if (off == 0 || off > op || m > raw - op) return 0;
+        if (off >= m) memcpy(dst + op, dst + op - off, m);
+        else for (size_t i=0;i<m;i++) dst[op+i] = dst[op-off+i]; // overlapping run
+        op += m;
+    }
+    return op == raw;
+}
+
+// ---------- Binary disk image ----------
+// Layout (host byte order), every section at a fixed offset from the header:
+//   ImageHeader | ImageDir[dir_count] | ImageFile[file_count] | names | data | index | snapshots
+// Directories are stored pre-order so a parent always precedes its children;
+// entry 0 is the root. Names are NUL-terminated offsets into the name table
+// (all directory names, then all file names) and file bodies are extents in
+// the data section, so the loader can mmap the image and build the tree
+// without touching a single body. Files with equal bodies share one extent,
+// so the data section holds each distinct body once.
+// The low byte of flags names the codec of the data section. With
+// IMAGE_CODEC_LZ an extent is a run of blocks of up to IMAGE_BLOCK raw bytes,
+// each an ImageBlock header and its LZ (or, if that did not help, raw) bytes,
+// so any one file decodes on its own, block by block. Such images are decoded
+// at load instead of staying mapped.
+// The index section is the word index of the search commands (see Search
+// index), keyed by file table position; index_size 0 means there is none.
+// The bodies snapshots hold on to follow the tree's files in the file table,
+// with dir IMAGE_NO_DIR and an empty name (older loaders skip them), and the
+// snapshots section says which path each belongs to (see Snapshots).
+#define IMAGE_NO_DIR UINT32_MAX
+#define IMAGE_CODEC_NONE 0
+#define IMAGE_CODEC_LZ 1
+#define IMAGE_CODEC_MASK 0xff
+#define IMAGE_BLOCK (64*1024)
+
+int image_codec = IMAGE_CODEC_NONE; // for the next save: that of the loaded image unless -z says otherwise
+
+typedef struct ImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t dir_count;
+    uint32_t file_count;
+    uint64_t dirs_off;
+    uint64_t files_off;
+    uint64_t names_off;
+    uint64_t names_size;
+    uint64_t data_off;
+    uint64_t data_size;
+    uint64_t index_off; // version 2 on
+    uint64_t index_size;
+    uint64_t snap_off; // version 3 on
+    uint64_t snap_size;
+    uint64_t quota_off; // version 4 on
+    uint64_t quota_size;
+} ImageHeader;
+
+// the header of an older version ends before the fields it did not have yet
+size_t image_header_size(uint32_t version) {
+    if (version == 1) return offsetof(ImageHeader, index_off);
+    if (version == 2) return offsetof(ImageHeader, snap_off);
+    if (version == 3) return offsetof(ImageHeader, quota_off);
+    return sizeof(ImageHeader);
+}
+
+typedef struct ImageDir {
+    uint32_t parent;
+    uint32_t name_off;
+} ImageDir;
+
+typedef struct ImageFile {
+    uint32_t dir;
+    uint32_t name_off;
+    uint64_t data_off;
+    uint64_t data_len;
+} ImageFile;
+
+// a directory's quota; dir is its position in the directory table
+typedef struct ImageQuota {
+    uint32_t dir;
+    uint32_t pad;
+    uint64_t bytes;
+} ImageQuota;
+
+typedef struct ImageBlock {
+    uint32_t raw_len;
+    uint32_t lz_len; // 0: the block is stored raw
+} ImageBlock;
+
+enum { IMG_COUNT, IMG_DIRS, IMG_DIR_NAMES, IMG_FILES, IMG_FILE_NAMES, IMG_DATA };
+
+// a distinct body, keyed by content hash
+typedef struct ImageExtent {
+    uint64_t hash;
+    uint32_t id;
+    File* f; // the first file stored there; NULL marks a free slot
+} ImageExtent;
+
+typedef struct ImageWriter {
+    FILE* f;
+    int pass;
+    uint32_t next_dir, next_file;
+    uint32_t dir_count, file_count;
+    uint32_t tree_files; // file table entries that are in the tree; snapshot bodies follow
+    uint64_t dir_name_bytes, file_name_bytes;
+    uint64_t name_pos, data_pos, body_bytes;
+    // IMG_COUNT gives every file (in walk order) its extent; IMG_DATA lays the
+    // extents out, and the file table, written last, points at them
+    uint32_t* file_ext; // extent id + 1; 0 for an empty body
+    uint8_t* file_first; // 1 if this file's body is the one written for its extent
+    uint32_t file_cap;
+    uint64_t* ext_off;
+    uint64_t* ext_len;
+    uint32_t ext_count, ext_cap;
+    ImageExtent* extents; // open addressing, at most half full
+    size_t extent_cap;
+    // IMAGE_CODEC_LZ: one block of raw input and room for its compressed form
+    unsigned char* block;
+    unsigned char* packed;
+    size_t block_len;
+} ImageWriter;
+
+int file_same_body(File* a, File* b) {
+    if (file_size(a) != file_size(b)) return 0;
+    if (a->blob && b->blob) return a->blob == b->blob; // no two blobs hold equal bodies
+    if (a->mapped && b->mapped) return a->mapped == b->mapped || memcmp(a->mapped, b->mapped, a->mapped_len) == 0;
+    if (a->mapped) return content_equals(file_content(b), a->mapped, a->mapped_len);
+    return content_equals(file_content(a), b->mapped, b->mapped_len);
+}
+
+void image_extents_grow(ImageWriter* w) {
+    size_t n = w->extent_cap ? w->extent_cap*2 : 1024;
+    ImageExtent* ne = (ImageExtent*)calloc(n, sizeof(ImageExtent));
+    for (size_t i=0;i<w->extent_cap;i++) {
+        if (!w->extents[i].f) continue;
+        size_t j = w->extents[i].hash & (n-1);
+        while (ne[j].f) j = (j+1) & (n-1);
+        ne[j] = w->extents[i];
+    }
+    free(w->extents);
+    w->extents = ne;
+    w->extent_cap = n;
+}
+
+// picks the data extent of the next file: a new one, or that of an equal earlier body
+void image_place(ImageWriter* w, File* fl) {
+    if (w->next_file == w->file_cap) {
+        w->file_cap = w->file_cap ? w->file_cap*2 : 1024;
+        w->file_ext = (uint32_t*)realloc(w->file_ext, w->file_cap * sizeof(uint32_t));
+        w->file_first = (uint8_t*)realloc(w->file_first, w->file_cap);
+    }
+    uint32_t i = w->next_file++;
+    w->file_ext[i] = 0;
+    w->file_first[i] = 0;
+    size_t size = file_size(fl);
+    if (size == 0) return;
+    uint64_t h = fl->blob ? fl->blob->hash : body_hash(fl->mapped, fl->mapped_len);
+    if ((w->ext_count+1)*2 > w->extent_cap) image_extents_grow(w);
+    size_t j = h & (w->extent_cap-1);
+    for (; w->extents[j].f; j = (j+1) & (w->extent_cap-1)) {
+        if (w->extents[j].hash == h && file_same_body(w->extents[j].f, fl)) {
+            w->file_ext[i] = w->extents[j].id + 1;
+            return;
+        }
+    }
+    if (w->ext_count == w->ext_cap) {
+        w->ext_cap = w->ext_cap ? w->ext_cap*2 : 1024;
+        w->ext_off = (uint64_t*)realloc(w->ext_off, w->ext_cap * sizeof(uint64_t));
+        w->ext_len = (uint64_t*)realloc(w->ext_len, w->ext_cap * sizeof(uint64_t));
+    }
+    w->extents[j].hash = h;
+    w->extents[j].id = w->ext_count;
+    w->extents[j].f = fl;
+    w->file_ext[i] = ++w->ext_count;
+    w->file_first[i] = 1;
+    w->body_bytes += size;
+}
+
+// compresses and writes the pending block; returns the bytes written
+uint64_t image_flush_block(ImageWriter* w) {
+    if (!w->block_len) return 0;
+    ImageBlock b = { (uint32_t)w->block_len, 0 };
+    size_t n = lz_compress(w->block, w->block_len, w->packed, w->block_len - 1);
+    if (n) b.lz_len = (uint32_t)n;
+    fwrite(&b, sizeof(b), 1, w->f);
+    fwrite(n ? w->packed : w->block, 1, n ? n : w->block_len, w->f);
+    w->block_len = 0;
+    return sizeof(b) + (n ? n : b.raw_len);
+}
+
+uint64_t image_feed(ImageWriter* w, const char* data, size_t len) {
+    uint64_t out = 0;
+    while (len > 0) {
+        size_t k = IMAGE_BLOCK - w->block_len < len ? IMAGE_BLOCK - w->block_len : len;
+        memcpy(w->block + w->block_len, data, k);
+        w->block_len += k;
+        data += k;
+        len -= k;
+        if (w->block_len == IMAGE_BLOCK) out += image_flush_block(w);
+    }
+    return out;
+}
+
+// writes one extent in the image's codec; returns its length in the data section
+uint64_t image_write_body(ImageWriter* w, File* fl) {
+    if (image_codec == IMAGE_CODEC_NONE) {
+        file_write(fl, w->f);
+        return file_size(fl);
+    }
+    uint64_t n;
+    if (fl->mapped) {
+        n = image_feed(w, fl->mapped, fl->mapped_len);
+    } else {
+        n = 0;
+        for (Chunk* ch = file_content(fl)->head; ch; ch = ch->next) n += image_feed(w, ch->data, ch->len);
+    }
+    return n + image_flush_block(w);
+}
+
+// the file table entry of the next file, in a file pass
+void image_file(ImageWriter* w, File* fl, uint32_t dir, const char* name) {
+    if (w->pass == IMG_COUNT) {
+        w->file_count++;
+        w->file_name_bytes += strlen(name)+1;
+        image_place(w, fl);
+        return;
+    }
+    uint32_t seq = w->next_file++;
+    uint32_t ext = w->file_ext[seq];
+    if (w->pass == IMG_FILES) {
+        ImageFile e = { dir, (uint32_t)w->name_pos, ext ? w->ext_off[ext-1] : 0, ext ? w->ext_len[ext-1] : 0 };
+        fwrite(&e, sizeof(e), 1, w->f);
+        w->name_pos += strlen(name)+1;
+    } else if (w->pass == IMG_FILE_NAMES) {
+        fwrite(name, 1, strlen(name)+1, w->f);
+    } else if (w->file_first[seq]) {
+        w->ext_off[ext-1] = w->data_pos;
+        w->ext_len[ext-1] = image_write_body(w, fl);
+        w->data_pos += w->ext_len[ext-1];
+    }
+}
+
+// one pre-order walk per pass keeps every section in the same order
+void image_walk(ImageWriter* w, Directory* d, uint32_t parent) {
+    uint32_t idx = w->next_dir++;
+    if (w->pass == IMG_COUNT) {
+        w->dir_count++;
+        w->dir_name_bytes += strlen(d->name)+1;
+    } else if (w->pass == IMG_DIRS) {
+        ImageDir e = { parent, (uint32_t)w->name_pos };
+        fwrite(&e, sizeof(e), 1, w->f);
+        w->name_pos += strlen(d->name)+1;
+    } else if (w->pass == IMG_DIR_NAMES) {
+        fwrite(d->name, 1, strlen(d->name)+1, w->f);
+    }
+    if (w->pass != IMG_DIRS && w->pass != IMG_DIR_NAMES) {
+        for (int i=0;i<d->files.used;i++) {
+            File* fl = (File*)d->files.slots[i].node;
+            if (fl) image_file(w, fl, idx, fl->name);
+        }
+    }
+    for (int i=0;i<d->subdirs.used;i++) {
+        if (d->subdirs.slots[i].node) image_walk(w, (Directory*)d->subdirs.slots[i].node, idx);
+    }
+}
+
+void image_pass(ImageWriter* w, int pass) {
+    w->pass = pass;
+    w->next_dir = 0;
+    w->next_file = 0;
+    image_walk(w, root, UINT32_MAX);
+    if (pass == IMG_COUNT) w->tree_files = w->file_count;
+    if (pass == IMG_DIRS || pass == IMG_DIR_NAMES) return;
+    // then the bodies of snapshot entries, in the order snap_write numbers them
+    for (Snapshot* s = snap_oldest; s; s = s->newer) {
+        for (int i=0;i<s->entries.used;i++) {
+            SnapEntry* e = (SnapEntry*)s->entries.slots[i].node;
+            if (e && e->kind == SNAP_FILE) image_file(w, e->file, IMAGE_NO_DIR, "");
+        }
+    }
+}
+
+// the quota section: numbers directories in image_walk's order; returns its size
+uint64_t image_write_quotas(FILE* f, Directory* d, uint32_t* next) {
+    uint32_t idx = (*next)++;
+    uint64_t n = 0;
+    if (d->quota) {
+        ImageQuota q = { idx, 0, d->quota };
+        fwrite(&q, sizeof(q), 1, f);
+        n += sizeof(q);
+    }
+    for (int i=0;i<d->subdirs.used;i++) {
+        if (d->subdirs.slots[i].node) n += image_write_quotas(f, (Directory*)d->subdirs.slots[i].node, next);
+    }
+    return n;
+}
+
+// writes the binary image to a temp file and renames it over 'path'; returns 1 on success
+int write_image(const char* path) {
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* f = fopen(tmp, "wb");
+    if (!f) return 0;
+    ImageWriter w;
+    memset(&w, 0, sizeof(w));
+    w.f = f;
+    image_pass(&w, IMG_COUNT);
+    ImageHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    h.version = IMAGE_VERSION;
+    h.flags = (uint32_t)image_codec;
+    h.dir_count = w.dir_count;
+    h.file_count = w.file_count;
+    h.dirs_off = sizeof(ImageHeader);
+    h.files_off = h.dirs_off + (uint64_t)w.dir_count * sizeof(ImageDir);
+    h.names_off = h.files_off + (uint64_t)w.file_count * sizeof(ImageFile);
+    h.names_size = w.dir_name_bytes + w.file_name_bytes;
+    h.data_off = h.names_off + h.names_size;
+    if (image_codec != IMAGE_CODEC_NONE) {
+        w.block = (unsigned char*)malloc(IMAGE_BLOCK);
+        w.packed = (unsigned char*)malloc(IMAGE_BLOCK);
+    }
+    // extent offsets are known once the data is out, so the file table and
+    // the header's data_size are filled in last
+    fwrite(&h, sizeof(h), 1, f);
+    image_pass(&w, IMG_DIRS);
+    fseeko(f, (off_t)h.names_off, SEEK_SET);
+    image_pass(&w, IMG_DIR_NAMES);
+    image_pass(&w, IMG_FILE_NAMES);
+    image_pass(&w, IMG_DATA);
+    h.data_size = w.data_pos;
+    h.index_off = h.data_off + h.data_size;
+    index_lock();
+    h.index_size = index_write(f);
+    index_unlock();
+    h.snap_off = h.index_off + h.index_size;
+    h.snap_size = snap_write(f, w.tree_files);
+    h.quota_off = h.snap_off + h.snap_size;
+    uint32_t next_dir = 0;
+    h.quota_size = image_write_quotas(f, root, &next_dir);
+    fseeko(f, (off_t)h.files_off, SEEK_SET);
+    w.name_pos = w.dir_name_bytes;
+    image_pass(&w, IMG_FILES);
+    fseeko(f, 0, SEEK_SET);
+    fwrite(&h, sizeof(h), 1, f);
+    free(w.file_ext);
+    free(w.file_first);
+    free(w.ext_off);
+    free(w.ext_len);
+    free(w.extents);
+    free(w.block);
+    free(w.packed);
+    int ok = (ferror(f) == 0 && fflush(f) == 0 && fsync(fileno(f)) == 0);
+    if (fclose(f) != 0) ok = 0;
+    if (ok && rename(tmp, path) != 0) ok = 0;
+    if (!ok) remove(tmp);
+    if (ok) {
+        stats.last_save_bytes = h.quota_off + h.quota_size;
+        stats.last_save_body_bytes = w.body_bytes;
+        stats.last_save_records = (uint64_t)h.dir_count + h.file_count;
+    }
+    return ok;
+}
+
+// the mapping stays alive for the whole run because lazy files point into it
+void* image_map = NULL;
+size_t image_map_size = 0;
+
+const char* image_name(const ImageHeader* h, const char* base, uint32_t off) {
+    if (off >= h->names_size) return NULL;
+    const char* s = base + h->names_off + off;
+    if (!memchr(s, '\0', h->names_size - off)) return NULL;
+    return s;
+}
+
+// Compressed images are decoded on a small worker pool before the tree is
+// built. One sequential scan of the file table lists the distinct extents
+// (files with equal bodies share one); a worker pool (see Utilities) then
+// claims extents from a shared counter, each decoding and hashing its extent into a
+// private buffer with no lock held; finally the loader builds the tree in
+// file table order as before, interning each decoded body as a blob once.
+#define LOAD_EXTENTS_PER_THREAD 16 // fewer extents than this per worker are not worth a thread
+
+typedef struct LoadExtent {
+    uint64_t off, len; // compressed, within the data section
+    char* raw;         // decoded body (malloc'd); NULL if empty or damaged
+    size_t raw_len;
+    int ok;
+    uint64_t hash;
+    Blob* blob;        // interned on first use
+} LoadExtent;
+
+// extents by data offset; open addressing, at most half full
+typedef struct ImageSeen {
+    uint64_t off; // + 1; 0 marks a free slot
+    uint32_t ext;
+} ImageSeen;
+
+typedef struct ImageDecoder {
+    const char* data; // the data section
+    LoadExtent* ext;
+    uint32_t count, cap;
+    ImageSeen* seen;
+    size_t seen_cap;
+    uint32_t next; // the next extent to decode, claimed atomically
+} ImageDecoder;
+
+ImageSeen* image_seen_slot(ImageDecoder* d, uint64_t off) {
+    if ((d->count+1)*2 > d->seen_cap) {
+        size_t n = d->seen_cap ? d->seen_cap*2 : 1024;
+        ImageSeen* ns = (ImageSeen*)calloc(n, sizeof(ImageSeen));
+        for (size_t i=0;i<d->seen_cap;i++) {
+            if (!d->seen[i].off) continue;
+            size_t j = (d->seen[i].off * 0x9e3779b97f4a7c15ull) >> 32 & (n-1);
+            while (ns[j].off) j = (j+1) & (n-1);
+            ns[j] = d->seen[i];
+        }
+        free(d->seen);
+        d->seen = ns;
+        d->seen_cap = n;
+    }
+    size_t j = ((off+1) * 0x9e3779b97f4a7c15ull) >> 32 & (d->seen_cap-1);
+    while (d->seen[j].off && d->seen[j].off != off+1) j = (j+1) & (d->seen_cap-1);
+    return &d->seen[j];
+}
+
+// the extent a file table entry points at, listed on first sight
+uint32_t image_extent(ImageDecoder* d, uint64_t off, uint64_t len) {
+    ImageSeen* s = image_seen_slot(d, off);
+    if (s->off) return s->ext;
+    if (d->count == d->cap) {
+        d->cap = d->cap ? d->cap*2 : 1024;
+        d->ext = (LoadExtent*)realloc(d->ext, d->cap * sizeof(LoadExtent));
+    }
+    LoadExtent* e = &d->ext[d->count];
+    memset(e, 0, sizeof(*e));
+    e->off = off;
+    e->len = len;
+    s->off = off+1;
+    s->ext = d->count;
+    return d->count++;
+}
+
+// decodes one extent, block by block, straight into a buffer of its full size
+void image_decode_extent(LoadExtent* e, const char* data) {
+    const unsigned char* p = (const unsigned char*)data;
+    // the block headers give the decoded size and are checked before anything is decoded
+    size_t raw = 0;
+    const unsigned char* q = p;
+    for (uint64_t left = e->len; left > 0;) {
+        ImageBlock b;
+        if (left < sizeof(b)) return;
+        memcpy(&b, q, sizeof(b));
+        size_t stored = b.lz_len ? b.lz_len : b.raw_len;
+        if (b.raw_len == 0 || b.raw_len > IMAGE_BLOCK || stored > left - sizeof(b)) return;
+        q += sizeof(b) + stored;
+        left -= sizeof(b) + stored;
+        raw += b.raw_len;
+    }
+    char* out = raw ? (char*)malloc(raw) : NULL;
+    size_t pos = 0;
+    for (uint64_t left = e->len; left > 0;) {
+        ImageBlock b;
+        memcpy(&b, p, sizeof(b));
+        p += sizeof(b);
+        if (b.lz_len) {
+            if (!lz_decompress(p, b.lz_len, (unsigned char*)out + pos, b.raw_len)) { free(out); return; }
+            p += b.lz_len;
+            left -= sizeof(b) + b.lz_len;
+        } else {
+            memcpy(out + pos, p, b.raw_len);
+            p += b.raw_len;
+            left -= sizeof(b) + b.raw_len;
+        }
+        pos += b.raw_len;
+    }
+    e->raw = out;
+    e->raw_len = raw;
+    e->hash = body_hash(out, raw);
+    e->ok = 1;
+}
+
+void* image_decode_main(void* arg) {
+    ImageDecoder* d = (ImageDecoder*)arg;
+    for (;;) {
+        uint32_t i = __atomic_fetch_add(&d->next, 1, __ATOMIC_RELAXED);
+        if (i >= d->count) break;
+        image_decode_extent(&d->ext[i], d->data + d->ext[i].off);
+    }
+    return NULL;
+}
+
+// decodes every listed extent; returns the number of threads that took part
+int image_decode_all(ImageDecoder* d) {
+    return run_workers(image_decode_main, d, worker_count(d->count, LOAD_EXTENTS_PER_THREAD));
+}
+
+// the blob of a decoded extent, interned by its first file; NULL if it is damaged
+Blob* image_extent_blob(LoadExtent* e) {
+    if (!e->ok) return NULL;
+    if (e->blob) {
+        blob_retain(e->blob);
+        return e->blob;
+    }
+    Content body = {0};
+    content_append(&body, e->raw, e->raw_len);
+    free(e->raw);
+    e->raw = NULL;
+    e->blob = blob_intern_hashed(&body, e->hash);
+    return e->blob;
+}
+
+// maps 'path' and builds the tree from its tables; returns 1 if an image was loaded
+int load_image(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < offsetof(ImageHeader, index_off)) { close(fd); return 0; }
+    size_t size = (size_t)st.st_size;
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+    const char* base = (const char*)map;
+    const ImageHeader* h = (const ImageHeader*)map;
+    int codec = (int)(h->flags & IMAGE_CODEC_MASK);
+    // older headers end before the fields of later sections
+    uint64_t index_off = 0, index_size = 0, snap_off = 0, snap_size = 0, quota_off = 0, quota_size = 0;
+    int header_ok = h->version >= 1 && h->version <= IMAGE_VERSION && size >= image_header_size(h->version);
+    if (header_ok && h->version >= 2) {
+        index_off = h->index_off;
+        index_size = h->index_size;
+    }
+    if (header_ok && h->version >= 3) {
+        snap_off = h->snap_off;
+        snap_size = h->snap_size;
+    }
+    if (header_ok && h->version >= 4) {
+        quota_off = h->quota_off;
+        quota_size = h->quota_size;
+    }
+    if (memcmp(h->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 || !header_ok ||
+        index_off + index_size > size || snap_off + snap_size > size || quota_off + quota_size > size ||
+        (codec != IMAGE_CODEC_NONE && codec != IMAGE_CODEC_LZ) || h->dir_count == 0 ||
+        h->dirs_off + (uint64_t)h->dir_count * sizeof(ImageDir) > size ||
+        h->files_off + (uint64_t)h->file_count * sizeof(ImageFile) > size ||
+        h->names_off + h->names_size > size || h->data_off + h->data_size > size) {
+        out_printf("Warning: %s is not a valid disk image, ignoring it.\n", path);
+        munmap(map, size);
+        return 0;
+    }
+    const ImageDir* dents = (const ImageDir*)(base + h->dirs_off);
+    const ImageFile* fents = (const ImageFile*)(base + h->files_off);
+    Directory** dirs = (Directory**)malloc(h->dir_count * sizeof(Directory*));
+    dirs[0] = root;
+    usage_loading = 1;
+    for (uint32_t i=1;i<h->dir_count;i++) {
+        const char* name = image_name(h, base, dents[i].name_off);
+        dirs[i] = NULL;
+        if (!name || dents[i].parent >= i || !dirs[dents[i].parent]) continue;
+        Directory* parent = dirs[dents[i].parent];
+        if (find_subdir(parent, name)) continue;
+        dirs[i] = create_dir(name, parent);
+        add_subdir(parent, dirs[i]);
+    }
+    ImageDecoder dec;
+    memset(&dec, 0, sizeof(dec));
+    dec.data = base + h->data_off;
+    uint32_t* fext = NULL; // file table position -> extent, for a compressed image
+    int threads = 1;
+    if (codec != IMAGE_CODEC_NONE) {
+        fext = (uint32_t*)malloc((h->file_count ? h->file_count : 1) * sizeof(uint32_t));
+        for (uint32_t i=0;i<h->file_count;i++) {
+            const ImageFile* e = &fents[i];
+            fext[i] = UINT32_MAX;
+            if (e->data_len && e->data_off <= h->data_size && e->data_len <= h->data_size - e->data_off)
+                fext[i] = image_extent(&dec, e->data_off, e->data_len);
+        }
+        threads = image_decode_all(&dec);
+    }
+    File** byseq = (File**)calloc(h->file_count ? h->file_count : 1, sizeof(File*));
+    uint32_t tree_files = 0;
+    index_loading = 1;
+    for (uint32_t i=0;i<h->file_count;i++) {
+        const ImageFile* e = &fents[i];
+        const char* name = image_name(h, base, e->name_off);
+        // a snapshot's body: kept out of the tree for snap_load
+        int detached = e->dir == IMAGE_NO_DIR;
+        if (!detached) tree_files = i+1;
+        if (!name || (!detached && (e->dir >= h->dir_count || !dirs[e->dir]))) continue;
+        if (e->data_off > h->data_size || e->data_len > h->data_size - e->data_off) continue;
+        Directory* dir = detached ? NULL : dirs[e->dir];
+        if (dir && find_file(dir, name)) continue;
+        const char* data = base + h->data_off + e->data_off;
+        File* f;
+        if (codec == IMAGE_CODEC_NONE) {
+            f = create_mapped_file(name, data, e->data_len);
+        } else {
+            Blob* b = NULL;
+            if (e->data_len && !(b = image_extent_blob(&dec.ext[fext[i]]))) continue;
+            f = create_file(name);
+            f->blob = b;
+        }
+        if (dir) add_file(dir, f);
+        byseq[i] = f;
+    }
+    index_loading = 0;
+    usage_loading = 0;
+    // each directory has counted its own entries; children come after their
+    // parent in the table, so one backward sweep adds up the subtrees
+    for (uint32_t i=h->dir_count-1;i>0;i--) {
+        if (!dirs[i]) continue;
+        Directory* parent = dirs[dents[i].parent];
+        parent->du_bytes += dirs[i]->du_bytes;
+        parent->du_files += dirs[i]->du_files;
+        parent->du_dirs += dirs[i]->du_dirs;
+    }
+    if (quota_size % sizeof(ImageQuota) == 0) {
+        const ImageQuota* q = (const ImageQuota*)(base + quota_off);
+        for (uint64_t i=0;i<quota_size/sizeof(ImageQuota);i++)
+            if (q[i].dir < h->dir_count && dirs[q[i].dir]) dirs[q[i].dir]->quota = q[i].bytes;
+    }
+    // only the tree's files are numbered for the index
+    for (uint32_t i=0;i<tree_files;i++) {
+        if (fents[i].dir == IMAGE_NO_DIR && byseq[i]) { free_file(byseq[i]); byseq[i] = NULL; }
+    }
+    // an image from before the index, or a damaged index, costs one scan of every body
+    if (!index_size || !index_load(base + index_off, index_size, byseq, tree_files)) index_rebuild(root);
+    if (snap_size && !snap_load(base + snap_off, snap_size, byseq, tree_files, h->file_count))
+        out_printf("Warning: the snapshots in %s are damaged, dropping them.\n", path);
+    // bodies no snapshot claimed
+    for (uint32_t i=tree_files;i<h->file_count;i++)
+        if (byseq[i]) free_file(byseq[i]);
+    free(byseq);
+    for (uint32_t i=0;i<dec.count;i++) free(dec.ext[i].raw); // extents no file took
+    free(dec.ext);
+    free(dec.seen);
+    free(fext);
+    free(dirs);
+    image_codec = codec;
+    stats.load_dirs = h->dir_count;
+    stats.load_files = tree_files;
+    stats.load_threads = threads;
+    if (codec != IMAGE_CODEC_NONE) {
+        // every body now lives in a blob, so the mapping is not needed any more
+        munmap(map, size);
+        return 1;
+    }
+    image_map = map;
+    image_map_size = size;
+    return 1;
+}
+
+void image_unmap() {
+    if (image_map) munmap(image_map, image_map_size);
+    image_map = NULL;
+    image_map_size = 0;
+}
+
+// paths are taken from the root whether or not they start with '/'; NULL for
+// one with a name or total length that does not fit
+Directory* find_or_create_dir_by_path(const char* path) {
+    if (!path || path[0] == '\0') return root;
+    char key[1024];
+    if (!path_normalize(NULL, path, key, sizeof(key))) return NULL;
+    size_t len = strlen(key);
+    Directory* cur = dcache_lookup(key, len);
+    if (cur) return cur;
+    char* save = NULL;
+    cur = root;
+    for (char* token = strtok_r(key, "/", &save); token; token = strtok_r(NULL, "/", &save)) {
+        dir_rdlock(cur);
+        Directory* next = find_subdir(cur, token);
+        dir_unlock(cur);
+        if (!next) {
+            dir_wrlock(cur);
+            next = find_subdir(cur, token); // unless another session got there first
+            if (!next) {
+                next = create_dir(token, cur);
+                add_subdir(cur, next);
+            }
+            dir_unlock(cur);
+        }
+        cur = next;
+    }
+    return cur;
+}
+
+// splits "/a/b/name" (or "/a/b/name/") in place; returns the parent dir, creating
+// it if needed, or NULL when a name is too long
+Directory* split_vfs_path(char* path, char** name) {
+    size_t len = strlen(path);
+    if (len > 1 && path[len-1] == '/') path[len-1] = '\0';
+    char *last = strrchr(path, '/');
+    *name = last ? last+1 : path;
+    if (strlen(*name) >= MAX_NAME) return NULL;
+    if (!last) return root;
+    *last = '\0';
+    return find_or_create_dir_by_path((strlen(path)>0) ? path : "/");
+}
+
+// ---------- Journal ----------
+// Mutations append one record to JOURNAL_FILE instead of rewriting IMAGE_FILE:
+//   MKDIR <dirpath>  |  WRITE <len> <filepath>\n<len bytes>\n  |  RM <filepath>  |  RMDIR <dirpath>  |  WIPE
+//   SNAPSHOT <time> <name>  |  UNSNAPSHOT <name>  |  QUOTA <bytes> <dirpath>
+// load_filesystem replays it on top of the last full image. Once it passes
+// JOURNAL_COMPACT_BYTES it is rotated to JOURNAL_OLD_FILE and a forked child
+// folds the tree back into IMAGE_FILE while the shell keeps running.
+//
+// Appending only fills the stdio buffer. A write-back thread notices new
+// records, waits WRITEBACK_DEBOUNCE_MS for the burst to settle (never longer
+// than WRITEBACK_MAX_DELAY_MS in total), then flushes and fdatasyncs the lot
+// in one go. 'sync' and exit wait for it; nothing else does.
+#define WRITEBACK_DEBOUNCE_MS 20
+#define WRITEBACK_MAX_DELAY_MS 500
+
+FILE* journal = NULL;
+long journal_bytes = 0;
+int journal_replaying = 0;
+pid_t compact_pid = 0;
+// batch mode keeps no journal: changes only mark the disk dirty and are
+// written out as one image at the next sync point
+int journal_deferred = 0;
+int disk_dirty = 0;
+
+// journal_lock guards journal, the generation counters and the thread flags
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t writeback_cond = PTHREAD_COND_INITIALIZER; // new records, or a sync request
+pthread_cond_t durable_cond = PTHREAD_COND_INITIALIZER;   // durable_gen moved
+pthread_t writeback_thread;
+int writeback_running = 0;
+int writeback_stop = 0;
+int writeback_urgent = 0;
+uint64_t journal_gen = 0; // records appended so far
+uint64_t durable_gen = 0; // records known to be on disk
+
+void save_filesystem();
+
+// callers hold journal_lock once the write-back thread is running
+void journal_open() {
+    journal = fopen(JOURNAL_FILE, "a");
+    if (!journal) { out_printf("Error: could not open journal file.\n"); return; }
+    fseek(journal, 0, SEEK_END);
+    journal_bytes = ftell(journal);
+}
+
+// pushes the journal to disk; called with journal_lock held
+void journal_flush_locked() {
+    if (!journal) return;
+    fflush(journal);
+    fdatasync(fileno(journal));
+    durable_gen = journal_gen;
+    pthread_cond_broadcast(&durable_cond);
+}
+
+void deadline_after_ms(struct timespec* ts, long ms) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) { ts->tv_sec++; ts->tv_nsec -= 1000000000L; }
+}
+
+void* writeback_main(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&journal_lock);
+    for (;;) {
+        while (!writeback_stop && durable_gen == journal_gen) {
+            writeback_urgent = 0; // a sync that is already satisfied
+            pthread_cond_wait(&writeback_cond, &journal_lock);
+        }
+        if (durable_gen == journal_gen) break; // stopping, nothing left to flush
+        // coalesce: keep waiting while records are still arriving
+        uint64_t first = stat_now_ns();
+        while (!writeback_stop && !writeback_urgent) {
+            uint64_t seen = journal_gen;
+            struct timespec ts;
+            deadline_after_ms(&ts, WRITEBACK_DEBOUNCE_MS);
+            pthread_cond_timedwait(&writeback_cond, &journal_lock, &ts);
+            if (journal_gen == seen || stat_now_ns() - first >= WRITEBACK_MAX_DELAY_MS * 1000000ull) break;
+        }
+        writeback_urgent = 0;
+        uint64_t gen = journal_gen;
+        int fd = -1;
+        if (journal) {
+            fflush(journal);
+            fd = dup(fileno(journal));
+        }
+        // the fdatasync runs unlocked so appends never wait for the disk; the
+        // dup keeps the file alive even if compaction rotates it meanwhile
+        pthread_mutex_unlock(&journal_lock);
+        if (fd >= 0) {
+            fdatasync(fd);
+            close(fd);
+        }
+        pthread_mutex_lock(&journal_lock);
+        if (gen > durable_gen) durable_gen = gen;
+        stats.writeback_flushes++;
+        pthread_cond_broadcast(&durable_cond);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return NULL;
+}
+
+void writeback_start() {
+    writeback_stop = 0;
+    if (pthread_create(&writeback_thread, NULL, writeback_main, NULL) == 0) writeback_running = 1;
+    else out_printf("Warning: no write-back thread, the journal is flushed at exit only.\n");
+}
+
+// blocks until every record appended so far is on disk
+void journal_sync() {
+    pthread_mutex_lock(&journal_lock);
+    if (!writeback_running) {
+        journal_flush_locked();
+    } else {
+        uint64_t target = journal_gen;
+        writeback_urgent = 1;
+        pthread_cond_signal(&writeback_cond);
+        while (durable_gen < target) pthread_cond_wait(&durable_cond, &journal_lock);
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// collects a finished compaction child; block=1 waits for a running one
+void journal_reap(int block) {
+    if (compact_pid <= 0) return;
+    int status = 0;
+    pid_t r = waitpid(compact_pid, &status, block ? 0 : WNOHANG);
+    if (r == 0) return;
+    compact_pid = 0;
+    if (r < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        out_printf("Warning: background disk compaction failed, will retry.\n");
+}
+
+void journal_maybe_compact() {
+    journal_reap(0);
+    if (compact_pid > 0 || journal_bytes < JOURNAL_COMPACT_BYTES) return;
+    // an old segment still around means the last compaction never finished; fold everything now
+    if (access(JOURNAL_OLD_FILE, F_OK) == 0) { save_filesystem(); return; }
+    pthread_mutex_lock(&journal_lock);
+    // the rotated segment must be complete on disk before anything relies on it
+    journal_flush_locked();
+    fclose(journal);
+    journal = NULL;
+    int rotated = (rename(JOURNAL_FILE, JOURNAL_OLD_FILE) == 0);
+    journal_open();
+    pthread_mutex_unlock(&journal_lock);
+    if (!rotated || !journal) return;
+    pid_t pid = fork();
+    if (pid == 0) {
+        // child: the tree is a private copy, so it can be written out at leisure
+        int ok = write_image(IMAGE_FILE);
+        if (ok) unlink(JOURNAL_OLD_FILE);
+        _exit(ok ? 0 : 1);
+    }
+    if (pid < 0) { save_filesystem(); return; }
+    compact_pid = pid;
+}
+
+void journal_append(const char* op, const char* path, const Content* body) {
+    if (journal_replaying) return;
+    if (journal_deferred) { disk_dirty = 1; return; }
+    pthread_mutex_lock(&journal_lock);
+    if (!journal) { pthread_mutex_unlock(&journal_lock); return; }
+    long n;
+    if (body) {
+        n = fprintf(journal, "%s %zu %s\n", op, body->size, path);
+        content_write(body, journal);
+        fputc('\n', journal);
+        n += (long)body->size + 1;
+    } else if (path) {
+        n = fprintf(journal, "%s %s\n", op, path);
+    } else {
+        n = fprintf(journal, "%s\n", op);
+    }
+    if (n > 0) journal_bytes += n;
+    stats.journal_records++;
+    if (n > 0) stats.journal_bytes += (uint64_t)n;
+    journal_gen++;
+    pthread_cond_signal(&writeback_cond);
+    pthread_mutex_unlock(&journal_lock);
+    // server sessions compact between commands, once they can lock the whole tree
+    if (!server_mode) journal_maybe_compact();
+}
+
+// stops the write-back thread after its last flush and closes the journal durably
+void journal_close() {
+    journal_reap(1);
+    if (writeback_running) {
+        pthread_mutex_lock(&journal_lock);
+        writeback_stop = 1;
+        pthread_cond_signal(&writeback_cond);
+        pthread_mutex_unlock(&journal_lock);
+        pthread_join(writeback_thread, NULL);
+        writeback_running = 0;
+    }
+    pthread_mutex_lock(&journal_lock);
+    journal_flush_locked();
+    if (journal) fclose(journal);
+    journal = NULL;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+void save_filesystem() {
+    journal_reap(1);
+    uint64_t t0 = stat_now_ns();
+    if (!write_image(IMAGE_FILE)) {
+        out_printf("Error: could not write disk file.\n");
+        return;
+    }
+    stat_record(&stats.save_time, stat_now_ns() - t0);
+    stats.saves++;
+    stats.save_bytes += stats.last_save_bytes;
+    // the image now holds everything the journal did
+    disk_dirty = 0;
+    pthread_mutex_lock(&journal_lock);
+    int was_open = (journal != NULL);
+    if (journal) fclose(journal);
+    journal = NULL;
+    remove(JOURNAL_FILE);
+    remove(JOURNAL_OLD_FILE);
+    journal_bytes = 0;
+    if (was_open) journal_open();
+    durable_gen = journal_gen;
+    pthread_cond_broadcast(&durable_cond);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// ---------- Filesystem operations (journaled) ----------
+// Callers check names and limits; these apply the change and record it. Each
+// holds the directory's write lock across both, so a directory's journal
+// records are in the order its changes were applied.
+void sessions_leave_dir(Directory* gone, Directory* to);
+
+// NULL if 'name' already exists
+Directory* vfs_mkdir(Directory* parent, const char* name) {
+    dir_wrlock(parent);
+    if (find_subdir(parent, name)) { dir_unlock(parent); return NULL; }
+    Directory* nd = create_dir(name, parent);
+    add_subdir(parent, nd);
+    char path[1024];
+    dir_path(nd, path, sizeof(path));
+    journal_append("MKDIR", path, NULL);
+    dir_unlock(parent);
+    return nd;
+}
+
+int dir_has_file(Directory* dir, const char* name) {
+    dir_rdlock(dir);
+    int found = find_file(dir, name) != NULL;
+    dir_unlock(dir);
+    return found;
+}
+
+// creates 'name' in dir or replaces its content; takes over the chunks of 'body'
+File* vfs_write_file(Directory* dir, const char* name, Content* body) {
+    dir_wrlock(dir);
+    File* f = find_file(dir, name);
+    if (!f) {
+        f = create_file(name);
+        add_file(dir, f);
+    }
+    file_set_body(f, body);
+    char path[1024];
+    dir_path(dir, path, sizeof(path));
+    strncat(path, name, sizeof(path)-strlen(path)-1);
+    journal_append("WRITE", path, file_content(f));
+    dir_unlock(dir);
+    return f;
+}
+
+int vfs_rm(Directory* dir, const char* name) {
+    dir_wrlock(dir);
+    File* f = (File*)et_remove(&dir->files, name);
+    if (!f) { dir_unlock(dir); return 0; }
+    usage_add(dir, -(int64_t)file_size(f), -1, 0);
+    char path[1024];
+    dir_path(dir, path, sizeof(path));
+    strncat(path, name, sizeof(path)-strlen(path)-1);
+    free_file(f);
+    journal_append("RM", path, NULL);
+    dir_unlock(dir);
+    return 1;
+}
+
+// server mode: the caller holds tree_lock exclusively
+int vfs_rmdir(Directory* dir, const char* name) {
+    Directory* d = (Directory*)et_remove(&dir->subdirs, name);
+    if (!d) return 0;
+    usage_add(dir, -(int64_t)d->du_bytes, -(int64_t)d->du_files, -(int64_t)d->du_dirs - 1);
+    char path[1024];
+    dir_path(d, path, sizeof(path));
+    sessions_leave_dir(d, dir);
+    for (Directory* c = current_dir; c; c = c->parent)
+        if (c == d) { current_dir = dir; break; }
+    // free sub-tree
+    dcache_clear();
+    free_dir_recursive(d);
+    journal_append("RMDIR", path, NULL);
+    return 1;
+}
+
+void vfs_wipe() {
+    if (snap_newest) {
+        // snapshots need every old path recorded, so the nodes go one by one
+        dcache_clear();
+        for (int i=0;i<root->subdirs.used;i++) {
+            if (root->subdirs.slots[i].node) free_dir_recursive((Directory*)root->subdirs.slots[i].node);
+        }
+        for (int i=0;i<root->files.used;i++) {
+            if (root->files.slots[i].node) free_file((File*)root->files.slots[i].node);
+        }
+        et_free(&root->subdirs);
+        et_free(&root->files);
+        root->du_bytes = root->du_files = root->du_dirs = 0;
+        root->quota = 0;
+    } else {
+        // drop the whole tree wholesale and start over with an empty root
+        vfs_release_all();
+        root = create_dir("/", NULL);
+    }
+    current_dir = root;
+    sessions_leave_dir(NULL, root);
+    journal_append("WIPE", NULL, NULL);
+}
+
+// journaled as "QUOTA <bytes> <dir path>"; 0 removes the quota
+void vfs_set_quota(Directory* d, uint64_t bytes) {
+    __atomic_store_n(&d->quota, bytes, __ATOMIC_RELAXED);
+    char rec[1100];
+    snprintf(rec, sizeof(rec), "%llu %s", (unsigned long long)bytes, d->path);
+    journal_append("QUOTA", rec, NULL);
+}
+
+// snapshots are journaled as "SNAPSHOT <time> <name>"; the time keeps the
+// one 'snapshots' shows the same across restarts
+Snapshot* vfs_snapshot(const char* name, int64_t created) {
+    snap_lock();
+    Snapshot* s = snap_create(name, created);
+    snap_unlock();
+    char rec[MAX_NAME+32];
+    snprintf(rec, sizeof(rec), "%lld %s", (long long)created, name);
+    journal_append("SNAPSHOT", rec, NULL);
+    return s;
+}
+
+void vfs_unsnapshot(Snapshot* s) {
+    char name[MAX_NAME];
+    snprintf(name, sizeof(name), "%s", s->name);
+    snap_lock();
+    snap_drop(s);
+    snap_unlock();
+    journal_append("UNSNAPSHOT", name, NULL);
+}
+
+// creates what is missing of a "/a/b/" path; the caller holds the tree exclusively
+Directory* vfs_mkdir_p(const char* path) {
+    Directory* cur = root;
+    const char* p = path;
+    while (*p) {
+        while (*p == '/') p++;
+        if (!*p) break;
+        size_t k = strcspn(p, "/");
+        if (k >= MAX_NAME) return NULL;
+        char name[MAX_NAME];
+        memcpy(name, p, k);
+        name[k] = '\0';
+        p += k;
+        Directory* next = find_subdir(cur, name);
+        cur = next ? next : vfs_mkdir(cur, name);
+    }
+    return cur;
+}
+
+int snap_entry_cmp(const void* a, const void* b) {
+    return strcmp((*(SnapEntry* const*)a)->path, (*(SnapEntry* const*)b)->path);
+}
+
+// puts back every path changed since s was taken, through the journaled
+// operations above (so the newest snapshot records the undone state in turn);
+// returns the number of paths changed. The caller holds the tree exclusively.
+int vfs_restore(Snapshot* s) {
+    // the first record of a path from s on is its state at s
+    EntryTable seen;
+    memset(&seen, 0, sizeof(seen));
+    SnapEntry** list = NULL;
+    int n = 0, cap = 0;
+    snap_lock();
+    for (Snapshot* t = s; t; t = t->newer) {
+        for (int i=0;i<t->entries.used;i++) {
+            SnapEntry* e = (SnapEntry*)t->entries.slots[i].node;
+            if (!e || et_find(&seen, e->path)) continue;
+            et_add(&seen, e->path, e);
+            if (n == cap) {
+                cap = cap ? cap*2 : 64;
+                list = (SnapEntry**)realloc(list, cap * sizeof(SnapEntry*));
+            }
+            list[n++] = e;
+        }
+    }
+    snap_unlock();
+    et_free(&seen);
+    // sorted, a directory comes before everything under it
+    if (n) qsort(list, n, sizeof(SnapEntry*), snap_entry_cmp);
+    int changes = 0;
+    char name[MAX_NAME];
+    for (int i=0;i<n;i++) {
+        SnapEntry* e = list[i];
+        if (e->kind == SNAP_DIR) {
+            if (!resolve_dir(e->path)) { vfs_mkdir_p(e->path); changes++; }
+        } else if (e->kind == SNAP_FILE) {
+            Directory* dir = resolve_parent(e->path, name, sizeof(name));
+            if (!dir) {
+                char parent[1024];
+                snprintf(parent, sizeof(parent), "%.*s", (int)(strrchr(e->path, '/') - e->path + 1), e->path);
+                if (!(dir = vfs_mkdir_p(parent))) continue;
+            }
+            File* f = find_file(dir, name);
+            if (f && file_same_body(f, e->file)) continue;
+            Content body = {0};
+            if (e->file->mapped) content_append(&body, e->file->mapped, e->file->mapped_len);
+            else for (Chunk* ch = file_content(e->file)->head; ch; ch = ch->next) content_append(&body, ch->data, ch->len);
+            vfs_write_file(dir, name, &body);
+            changes++;
+        }
+    }
+    // then what did not exist yet, deepest first
+    for (int i=n-1;i>=0;i--) {
+        SnapEntry* e = list[i];
+        if (e->kind != SNAP_NONE) continue;
+        Directory* dir = resolve_parent(e->path, name, sizeof(name));
+        if (!dir || !name[0]) continue;
+        size_t len = strlen(e->path);
+        if (e->path[len-1] == '/') changes += vfs_rmdir(dir, name);
+        else changes += vfs_rm(dir, name);
+    }
+    free(list);
+    return changes;
+}
+
+// applies the records of one journal segment; a torn record at the tail ends the replay
+void journal_replay(const char* jpath) {
+    FILE* f = fopen(jpath, "r");
+    if (!f) return;
+    journal_replaying = 1;
+    char line[2048];
+    while (fgets(line, sizeof(line), f)) {
+        char path[1024];
+        char* name;
+        size_t len = 0;
+        if (strncmp(line, "WRITE ", 6) == 0) {
+            if (sscanf(line + 6, "%zu %1023[^\n]", &len, path) != 2) break;
+            Content body = {0};
+            char buf[16384];
+            while (len > 0) {
+                size_t want = len < sizeof(buf) ? len : sizeof(buf);
+                size_t got = fread(buf, 1, want, f);
+                content_append(&body, buf, got);
+                len -= got;
+                if (got < want) break;
+            }
+            if (len > 0 || fgetc(f) != '\n') { content_free(&body); break; }
+            Directory* dir = split_vfs_path(path, &name);
+            if (dir) vfs_write_file(dir, name, &body);
+            else content_free(&body);
+        } else if (strncmp(line, "MKDIR ", 6) == 0) {
+            if (sscanf(line + 6, "%1023[^\n]", path) != 1) break;
+            find_or_create_dir_by_path(path);
+        } else if (strncmp(line, "RMDIR ", 6) == 0) {
+            if (sscanf(line + 6, "%1023[^\n]", path) != 1) break;
+            Directory* dir = split_vfs_path(path, &name);
+            if (dir) vfs_rmdir(dir, name);
+        } else if (strncmp(line, "RM ", 3) == 0) {
+            if (sscanf(line + 3, "%1023[^\n]", path) != 1) break;
+            Directory* dir = split_vfs_path(path, &name);
+            if (dir) vfs_rm(dir, name);
+        } else if (strncmp(line, "WIPE", 4) == 0) {
+            vfs_wipe();
+        } else if (strncmp(line, "SNAPSHOT ", 9) == 0) {
+            long long created;
+            if (sscanf(line + 9, "%lld %1023[^\n]", &created, path) != 2) break;
+            if (strlen(path) < MAX_NAME && !snap_find(path)) vfs_snapshot(path, created);
+        } else if (strncmp(line, "UNSNAPSHOT ", 11) == 0) {
+            if (sscanf(line + 11, "%1023[^\n]", path) != 1) break;
+            Snapshot* s = snap_find(path);
+            if (s) vfs_unsnapshot(s);
+        } else if (strncmp(line, "QUOTA ", 6) == 0) {
+            unsigned long long bytes;
+            if (sscanf(line + 6, "%llu %1023[^\n]", &bytes, path) != 2) break;
+            Directory* d = resolve_dir(path);
+            if (d) vfs_set_quota(d, bytes);
+        } else {
+            break;
+        }
+        stats.replayed_records++;
+    }
+    journal_replaying = 0;
+    fclose(f);
+}
+
+// merges a text-format disk (DIR/FILE...END records) into the tree; returns 1 if it was read
+int load_text_image(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (!f) return 0;
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    // files come grouped by directory, so each parent is resolved once per run of its files
+    char last_path[1024] = "";
+    Directory* last_dir = NULL;
+    while ((n = getline(&line, &cap, f)) > 0) {
+        if (strncmp(line, "DIR ", 4) == 0) {
+            char path[1024];
+            if (sscanf(line + 4, "%1023[^\r\n]", path) != 1) continue;
+            find_or_create_dir_by_path(path);
+        } else if (strncmp(line, "QUOTA ", 6) == 0) {
+            char path[1024];
+            unsigned long long bytes;
+            if (sscanf(line + 6, "%llu %1023[^\r\n]", &bytes, path) != 2) continue;
+            Directory* d = find_or_create_dir_by_path(path);
+            if (d) d->quota = bytes;
+        } else if (strncmp(line, "FILE ", 5) == 0) {
+            char path[1024];
+            Content body = {0};
+            if (sscanf(line + 5, "%1023[^\r\n]", path) != 1) continue;
+            while ((n = getline(&line, &cap, f)) > 0) {
+                if (strncmp(line, "END", 3) == 0) break;
+                content_append(&body, line, (size_t)n);
+            }
+            // split path into dir + filename
+            char *last = strrchr(path, '/');
+            if (!last || strlen(last+1) >= MAX_NAME) { content_free(&body); continue; }
+            char filename[256];
+            snprintf(filename, sizeof(filename), "%s", last+1);
+            *last = '\0';
+            if (!last_dir || strcmp(path, last_path) != 0) {
+                last_dir = find_or_create_dir_by_path((strlen(path)>0) ? path : "/");
+                snprintf(last_path, sizeof(last_path), "%s", path);
+            }
+            Directory* dir = last_dir;
+            if (!dir) { content_free(&body); continue; }
+            File* nf = find_file(dir, filename);
+            if (!nf) {
+                nf = create_file(filename);
+                add_file(dir, nf);
+            }
+            file_set_body(nf, &body);
+        }
+    }
+    free(line);
+    fclose(f);
+    return 1;
+}
+
+void load_filesystem() {
+    uint64_t t0 = stat_now_ns();
+    // the binary image wins; a text disk is only imported when there is no image yet
+    int imported = 0;
+    if (!load_image(IMAGE_FILE)) imported = load_text_image(DISK_FILE);
+    // records are idempotent, so replaying a segment a finished compaction already folded in is harmless
+    int leftover = (access(JOURNAL_OLD_FILE, F_OK) == 0);
+    journal_replay(JOURNAL_OLD_FILE);
+    journal_replay(JOURNAL_FILE);
+    stats.load_ns = stat_now_ns() - t0;
+    if (leftover || imported) save_filesystem();
+    //out_printf("Virtual disk loaded.\n");
+}
+
+// ---------- Filesystem commands ----------
+int batch_mode = 0;   // no prompts or banners; commands come from a script
+__thread int shell_status = 0; // set once any command fails; batch mode exits with it
+
+// reports why a command failed and records the failure
+void shell_error(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    out_vprintf(fmt, ap);
+    va_end(ap);
+    shell_status = 1;
+}
+
+// reports a path that did not resolve: path_error when it says why, else 'otherwise'
+void path_fail(const char* path, const char* otherwise) {
+    if (path_error) shell_error("'%s': %s.\n", path, path_error);
+    else shell_error("%s\n", otherwise);
+}
+
+// Commands below take a path wherever they used to take a name in current_dir.
+void list_dir(const char* path) {
+    Directory* d = path ? resolve_dir(path) : current_dir;
+    if (!d) { path_fail(path, "Directory not found."); return; }
+    dir_rdlock(d);
+    // entries are copied into the output buffer as they are, not formatted
+    out_write("Directories:\n", 13);
+    for (int i=0;i<d->subdirs.used;i++) {
+        Directory* sd = (Directory*)d->subdirs.slots[i].node;
+        if (!sd) continue;
+        out_put("  [DIR] ", 8);
+        out_put(sd->name, strlen(sd->name));
+        out_write("\n", 1);
+    }
+    out_write("Files:\n", 7);
+    for (int i=0;i<d->files.used;i++) {
+        File* f = (File*)d->files.slots[i].node;
+        if (!f) continue;
+        out_put("  ", 2);
+        out_put(f->name, strlen(f->name));
+        out_write("\n", 1);
+    }
+    dir_unlock(d);
+}
+
+void cmd_cd(const char* path) {
+    if (strcmp(path, "..") == 0 && !current_dir->parent) { shell_error("Already at root.\n"); return; }
+    Directory* d = resolve_dir(path);
+    if (d) current_dir = d;
+    else path_fail(path, "Directory not found.");
+}
+
+void cmd_back() {
+    if (current_dir->parent) current_dir = current_dir->parent;
+    else shell_error("Already at root.\n");
+}
+
+void cmd_mkdir(const char* path) {
+    char name[MAX_NAME];
+    Directory* parent = resolve_parent(path, name, sizeof(name));
+    if (!parent) { path_fail(path, "Directory not found."); return; }
+    if (!name[0] || !vfs_mkdir(parent, name)) { shell_error("Directory '%s' already exists.\n", path); return; }
+    out_printf("Directory '%s' created.\n", path);
+}
+
+// the directory whose quota writing 'size' bytes to dir/name would exceed; NULL if none
+Directory* quota_check(Directory* dir, const char* name, size_t size) {
+    dir_rdlock(dir);
+    File* f = find_file(dir, name);
+    int64_t grow = (int64_t)size - (f ? (int64_t)file_size(f) : 0);
+    dir_unlock(dir);
+    return quota_exceeded(dir, grow);
+}
+
+// whether any directory from d up has a quota
+int quota_applies(Directory* d) {
+    for (; d; d = d->parent) if (__atomic_load_n(&d->quota, __ATOMIC_RELAXED)) return 1;
+    return 0;
+}
+
+// vfs_write_file unless the body would take a directory over its quota: then
+// nothing is written, the body is freed and that directory returned. The check
+// and the write are one step for other writers below a quota (see quota_mutex).
+Directory* vfs_write_file_quota(Directory* dir, const char* name, Content* body) {
+    int locked = server_mode && quota_applies(dir);
+    if (locked) pthread_mutex_lock(&quota_mutex);
+    Directory* q = quota_check(dir, name, body->size);
+    if (q) content_free(body);
+    else vfs_write_file(dir, name, body);
+    if (locked) pthread_mutex_unlock(&quota_mutex);
+    return q;
+}
+
+void quota_error(Directory* q) {
+    shell_error("Quota exceeded: %s is limited to %llu bytes, %llu in use.\n", q->path,
+                (unsigned long long)q->quota, (unsigned long long)q->du_bytes);
+}
+
+int task_killed();
+
+// content follows on the input up to a line that is just 'end' ("END" by default,
+// or the tag of an inline "write <file> <<TAG")
+void cmd_write(const char* path, const char* end) {
+    if (!batch_mode) out_printf("Enter file content. Type '%s' on its own line to finish.\n", end);
+    Content body = {0};
+    read_text_block(&body, end); // consumed even when the path is bad, so it is not run as commands
+    if (task_killed()) { content_free(&body); return; }
+    // resolved only now: a task that waited for its input did not hold the tree meanwhile
+    char name[MAX_NAME];
+    Directory* dir = resolve_file(path, name, sizeof(name));
+    if (!dir) { content_free(&body); path_fail(path, "Directory not found."); return; }
+    int exists = dir_has_file(dir, name);
+    Directory* q = vfs_write_file_quota(dir, name, &body);
+    if (q) { quota_error(q); return; }
+    out_printf("File '%s' %s.\n", path, exists ? "overwritten" : "created");
+}
+
+void cmd_cat(const char* path) {
+    char name[MAX_NAME];
+    Directory* dir = resolve_file(path, name, sizeof(name));
+    if (!dir) { path_fail(path, "File not found."); return; }
+    dir_rdlock(dir);
+    File* f = find_file(dir, name);
+    if (!f) { dir_unlock(dir); shell_error("File not found.\n"); return; }
+    out_printf("---- %s ----\n", path);
+    // written from the chunks (or the image mapping) without copying a large body
+    if (file_size(f)>0)
+        out_file(f);
+    else
+        out_printf("(empty)\n");
+    out_printf("---- end ----\n");
+    dir_unlock(dir);
+}
+
+void cmd_rm(const char* path) {
+    char name[MAX_NAME];
+    Directory* dir = resolve_file(path, name, sizeof(name));
+    if (!dir) path_fail(path, "File not found.");
+    else if (vfs_rm(dir, name)) out_printf("File '%s' deleted.\n", path);
+    else shell_error("File not found.\n");
+}
+
+void cmd_rmdir(const char* path) {
+    char name[MAX_NAME];
+    Directory* parent = resolve_parent(path, name, sizeof(name));
+    if (parent && !name[0]) { shell_error("Cannot remove the root directory.\n"); return; }
+    if (parent && vfs_rmdir(parent, name)) out_printf("Directory '%s' and all contents removed.\n", path);
+    else if (!parent) path_fail(path, "Directory not found.");
+    else shell_error("Directory not found.\n");
+}
+
+// shell-style name pattern: '*' matches any run of characters, '?' any one
+int glob_match(const char* pat, const char* s) {
+    const char* star = NULL;
+    const char* resume = NULL;
+    while (*s) {
+        if (*pat == '*') { star = pat++; resume = s; continue; }
+        if (*pat == '?' || *pat == *s) { pat++; s++; continue; }
+        if (!star) return 0;
+        pat = star+1;
+        s = ++resume;
+    }
+    while (*pat == '*') pat++;
+    return *pat == '\0';
+}
+
+int cmp_str_ptr(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+typedef struct PathList {
+    char** v;
+    int n, cap;
+} PathList;
+
+void path_list_add(PathList* l, const char* dir, const char* name) {
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap*2 : 16;
+        l->v = (char**)realloc(l->v, l->cap * sizeof(char*));
+    }
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    char* s = (char*)malloc(dlen + nlen + 1);
+    memcpy(s, dir, dlen);
+    memcpy(s + dlen, name, nlen+1);
+    l->v[l->n++] = s;
+}
+
+void path_list_free(PathList* l) {
+    for (int i=0;i<l->n;i++) free(l->v[i]);
+    free(l->v);
+}
+
+// index lock held
+void find_collect(NameEntry* e, PathList* out) {
+    for (Directory* d = e->dirs; d; d = d->name_next) path_list_add(out, d->path, "");
+    for (File* f = e->files; f; f = f->name_next) path_list_add(out, f->dir->path, f->name);
+}
+
+// a plain name is one index lookup; a pattern is matched against each distinct name
+void cmd_find(const char* pattern) {
+    PathList found = {0};
+    index_lock();
+    if (!strpbrk(pattern, "*?")) {
+        NameEntry* e = (NameEntry*)et_find(&name_table, pattern);
+        if (e) find_collect(e, &found);
+    } else {
+        for (int i=0;i<name_table.used;i++) {
+            NameEntry* e = (NameEntry*)name_table.slots[i].node;
+            if (e && glob_match(pattern, e->name)) find_collect(e, &found);
+        }
+    }
+    index_unlock();
+    if (found.n) qsort(found.v, found.n, sizeof(char*), cmp_str_ptr);
+    for (int i=0;i<found.n;i++) out_printf("%s\n", found.v[i]);
+    if (!found.n) out_printf("Nothing named '%s'.\n", pattern);
+    path_list_free(&found);
+}
+
+// case-insensitive occurrence of 'term' (lower case) in the line; an end of
+// the term that is a word character must also be a word boundary in the line
+int line_has_term(const char* line, size_t len, const char* term, size_t tlen) {
+    int word_start = word_char((unsigned char)term[0]);
+    int word_end = word_char((unsigned char)term[tlen-1]);
+    for (size_t i=0;i+tlen<=len;i++) {
+        size_t j = 0;
+        while (j < tlen) {
+            unsigned char c = (unsigned char)line[i+j];
+            if ((c >= 'A' && c <= 'Z' ? c + 32 : c) != (unsigned char)term[j]) break;
+            j++;
+        }
+        if (j < tlen) continue;
+        if (word_start && i > 0 && word_char((unsigned char)line[i-1])) continue;
+        if (word_end && i+tlen < len && word_char((unsigned char)line[i+tlen])) continue;
+        return 1;
+    }
+    return 0;
+}
+
+// prints the matching lines of the files holding every word of 'term'; the
+// candidates come from the shortest posting list of the term's words
+void cmd_grep(const char* term) {
+    int has_word = 0;
+    for (const char* c = term; *c; c++) has_word |= word_char((unsigned char)*c);
+    if (!has_word) { shell_error("grep needs a word to search for.\n"); return; }
+    char folded[256];
+    size_t tlen = strlen(term);
+    if (tlen >= sizeof(folded)) tlen = sizeof(folded)-1;
+    for (size_t i=0;i<tlen;i++) folded[i] = (char)((term[i] >= 'A' && term[i] <= 'Z') ? term[i] + 32 : term[i]);
+    folded[tlen] = '\0';
+    WordList words = {0};
+    words_scan(&words, folded, tlen);
+    words_end(&words);
+    PathList cand = {0};
+    if (words.len) {
+        index_lock();
+        WordEntry* best = NULL;
+        for (size_t i=0;i<words.len;i += strlen(words.buf+i)+1) {
+            WordEntry* w = (WordEntry*)et_find(&word_table, words.buf+i);
+            if (!w) { best = NULL; break; }
+            if (!best || w->count < best->count) best = w;
+        }
+        for (Posting* p = best ? best->head : NULL; p; p = p->next) path_list_add(&cand, p->file->dir->path, p->file->name);
+        index_unlock();
+    }
+    free(words.buf);
+    if (cand.n) qsort(cand.v, cand.n, sizeof(char*), cmp_str_ptr);
+    int hits = 0;
+    char name[MAX_NAME];
+    for (int i=0;i<cand.n;i++) {
+        // the file may have changed since the lookup, so it is looked up again and its lines checked
+        Directory* dir = resolve_parent(cand.v[i], name, sizeof(name));
+        char* body = NULL;
+        if (dir) {
+            dir_rdlock(dir);
+            File* f = find_file(dir, name);
+            if (f) body = file_flatten(f);
+            dir_unlock(dir);
+        }
+        if (!body) continue;
+        int lineno = 1;
+        for (char* line = body; *line; lineno++) {
+            char* nl = strchr(line, '\n');
+            size_t len = nl ? (size_t)(nl - line) : strlen(line);
+            size_t shown = (len && line[len-1] == '\r') ? len-1 : len;
+            if (line_has_term(line, len, folded, tlen)) {
+                out_printf("%s:%d: %.*s\n", cand.v[i], lineno, (int)shown, line);
+                hits++;
+            }
+            if (!nl) break;
+            line = nl+1;
+        }
+        free(body);
+    }
+    if (!hits) out_printf("No matches for '%s'.\n", term);
+    path_list_free(&cand);
+}
+
+void cmd_clear() {
+    char blank[50];
+    memset(blank, '\n', sizeof(blank));
+    out_put(blank, sizeof(blank));
+    out_write("[screen cleared]\n", 17);
+}
+
+void unregister_installed_apps();
+void load_installed_apps_from_vfs();
+
+// drops what a scanf prompt left on the input line
+void skip_rest_of_line() {
+    int c;
+    while ((c = fgetc(SHELL_IN)) != '\n' && c != EOF) ;
+}
+
+// "wipe yes" skips the prompt; batch mode has nobody to ask, so it requires it
+void cmd_wipe(const char* confirmed) {
+    char confirm[16] = "";
+    if (confirmed) {
+        snprintf(confirm, sizeof(confirm), "%s", confirmed);
+    } else if (batch_mode || server_mode) {
+        // no prompting: a server session would hold every other session up while it waits
+        shell_error("wipe needs 'wipe yes' in batch and server mode.\n");
+        return;
+    } else {
+        out_printf("⚠️  Are you sure you want to wipe ALL user data? This cannot be undone (type 'yes' to confirm): ");
+        fscanf(SHELL_IN, "%15s", confirm);
+        skip_rest_of_line();
+    }
+    if (strcmp(confirm, "yes") != 0) { out_printf("Wipe cancelled.\n"); return; }
+    vfs_wipe();
+    // remove any registered installed apps
+    apps_wrlock();
+    unregister_installed_apps();
+    apps_unlock();
+    out_printf("All user data wiped. Kernel intact.\n");
+}
+
+int snapshot_name_ok(const char* name) {
+    if (!name[0] || name[0] == '-' || strlen(name) >= MAX_NAME) return 0;
+    for (const char* p = name; *p; p++)
+        if (!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') ||
+              *p == '.' || *p == '_' || *p == '-')) return 0;
+    return 1;
+}
+
+// "snapshot <name>" takes one, "snapshot -d <name>" drops it
+void cmd_snapshot(const char* arg, const char* name) {
+    if (strcmp(arg, "-d") == 0) {
+        Snapshot* s = name ? snap_find(name) : NULL;
+        if (!name) { shell_error("snapshot -d needs a snapshot name.\n"); return; }
+        if (!s) { shell_error("No snapshot named '%s'.\n", name); return; }
+        vfs_unsnapshot(s);
+        out_printf("Snapshot '%s' deleted.\n", name);
+        return;
+    }
+    if (!snapshot_name_ok(arg)) { shell_error("Snapshot names use letters, digits, '.', '_' and '-'.\n"); return; }
+    if (snap_find(arg)) { shell_error("Snapshot '%s' already exists.\n", arg); return; }
+    vfs_snapshot(arg, (int64_t)time(NULL));
+    out_printf("Snapshot '%s' taken.\n", arg);
+}
+
+void cmd_snapshots() {
+    snap_lock();
+    if (!snap_oldest) out_printf("No snapshots.\n");
+    for (Snapshot* s = snap_oldest; s; s = s->newer) {
+        char when[32];
+        time_t t = (time_t)s->created;
+        struct tm tm;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+        out_printf("%-20s %s  %d paths changed since, %llu bytes held\n", s->name, when,
+                   s->entries.count, (unsigned long long)s->bytes);
+    }
+    snap_unlock();
+}
+
+void cmd_restore(const char* name) {
+    Snapshot* s = snap_find(name);
+    if (!s) { shell_error("No snapshot named '%s'.\n", name); return; }
+    int changes = vfs_restore(s);
+    // /apps may have changed like any other directory
+    apps_wrlock();
+    unregister_installed_apps();
+    load_installed_apps_from_vfs();
+    apps_unlock();
+    out_printf("Restored '%s' (%d path%s changed).\n", name, changes, changes == 1 ? "" : "s");
+}
+
+// du, df and quota answer from the usage counters (see Usage accounting)
+void du_line(Directory* d) {
+    out_printf("%14llu bytes %9llu files %7llu dirs  %s\n",
+               (unsigned long long)__atomic_load_n(&d->du_bytes, __ATOMIC_RELAXED),
+               (unsigned long long)__atomic_load_n(&d->du_files, __ATOMIC_RELAXED),
+               (unsigned long long)__atomic_load_n(&d->du_dirs, __ATOMIC_RELAXED), d->path);
+}
+
+void quota_line(Directory* d) {
+    uint64_t q = __atomic_load_n(&d->quota, __ATOMIC_RELAXED);
+    if (q) out_printf("Quota on %s: %llu bytes\n", d->path, (unsigned long long)q);
+    uint64_t avail = quota_available(d);
+    if (avail != UINT64_MAX) out_printf("Available under quotas: %llu bytes\n", (unsigned long long)avail);
+}
+
+// each subdirectory's totals, then those of the directory itself
+void cmd_du(const char* path) {
+    Directory* d = path ? resolve_dir(path) : current_dir;
+    if (!d) { path_fail(path, "Directory not found."); return; }
+    dir_rdlock(d);
+    for (int i=0;i<d->subdirs.used;i++) {
+        Directory* sd = (Directory*)d->subdirs.slots[i].node;
+        if (sd) du_line(sd);
+    }
+    dir_unlock(d);
+    du_line(d);
+    quota_line(d);
+}
+
+uint64_t host_file_size(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+void cmd_df() {
+    out_printf("Used: %llu bytes in %llu files and %llu directories\n",
+               (unsigned long long)__atomic_load_n(&root->du_bytes, __ATOMIC_RELAXED),
+               (unsigned long long)__atomic_load_n(&root->du_files, __ATOMIC_RELAXED),
+               (unsigned long long)__atomic_load_n(&root->du_dirs, __ATOMIC_RELAXED));
+    quota_line(root);
+    out_printf("On disk: %llu bytes in %s, %llu in the journal\n", (unsigned long long)host_file_size(IMAGE_FILE),
+               IMAGE_FILE, (unsigned long long)(host_file_size(JOURNAL_FILE) + host_file_size(JOURNAL_OLD_FILE)));
+    struct statvfs fs;
+    if (statvfs(".", &fs) == 0)
+        out_printf("Host free space: %llu bytes\n", (unsigned long long)fs.f_bavail * fs.f_frsize);
+}
+
+// "quota <dir>" shows it, "quota <dir> <bytes>" sets it, "quota <dir> none" removes it
+void cmd_quota(const char* path, const char* limit) {
+    Directory* d = resolve_dir(path);
+    if (!d) { path_fail(path, "Directory not found."); return; }
+    if (!limit) {
+        if (!d->quota) out_printf("No quota on %s.\n", d->path);
+        quota_line(d);
+        return;
+    }
+    uint64_t bytes = 0;
+    if (strcmp(limit, "none") != 0) {
+        char* end;
+        errno = 0;
+        unsigned long long v = strtoull(limit, &end, 10);
+        if (limit[0] == '-' || end == limit || *end || errno || v == 0) {
+            shell_error("quota takes a number of bytes or 'none'.\n");
+            return;
+        }
+        bytes = v;
+    }
+    vfs_set_quota(d, bytes);
+    if (!bytes) { out_printf("Quota on %s removed.\n", d->path); return; }
+    out_printf("Quota on %s set to %llu bytes.\n", d->path, (unsigned long long)bytes);
+    uint64_t used = __atomic_load_n(&d->du_bytes, __ATOMIC_RELAXED);
+    if (used > bytes) out_printf("It already holds %llu bytes; writes that add more will fail.\n", (unsigned long long)used);
+}
+
+// batch mode writes its deferred image; otherwise waits for the write-back thread
+void cmd_sync() {
+    if (journal_deferred) save_filesystem();
+    else journal_sync();
+    out_printf("Disk synced.\n");
+}
+
+void cmd_exportdisk(const char* hostfile) {
+    if (write_text_image(hostfile)) out_printf("Disk exported to '%s' (text format).\n", hostfile);
+    else shell_error("Error: could not write '%s'.\n", hostfile);
+}
+
+void cmd_importdisk(const char* hostfile) {
+    if (!load_text_image(hostfile)) { shell_error("Error: could not read '%s'.\n", hostfile); return; }
+    // one full image write instead of a journal record per imported file
+    save_filesystem();
+    apps_wrlock();
+    unregister_installed_apps();
+    load_installed_apps_from_vfs();
+    apps_unlock();
+    out_printf("Disk '%s' imported.\n", hostfile);
+}
+
+// ---------- Host import/export ----------
+// 'import' copies a host directory tree into a new VFS directory and
+// 'export' copies a VFS subtree out. Import first scans the host tree. A
+// worker pool (see Utilities) then maps and hashes IMPORT_BATCH files at a
+// time. The subtree is built detached from its parent, so nothing is
+// visible and the usage counters stop at its top. One add_subdir attaches
+// it, and one image write persists it, instead of a journal record per file.
+// Export creates the host directories, then the workers write the bodies
+// straight from their chunks or the image mapping.
+#define IMPORT_BATCH 4096 // files mapped at once
+#define HOST_FILES_PER_THREAD 8
+
+typedef struct HostDir {
+    char* host; // malloc'd host path
+    char* name;
+    int parent; // index in the dir list; -1 for the top
+    Directory* dir;
+} HostDir;
+
+typedef struct HostFile {
+    char* host;
+    char* name;
+    int dir;
+    File* f;       // export: the file to write
+    const char* map; // import: the mapped body
+    size_t len;
+    uint64_t hash;
+    int err;       // errno of a failed read or write
+} HostFile;
+
+typedef struct HostTree {
+    HostDir* dirs;
+    int ndirs, dirs_cap;
+    HostFile* files;
+    uint32_t nfiles, files_cap;
+    uint32_t first, count; // the batch the workers are on
+    uint32_t next; // claimed atomically
+    int skipped; // entries left out: not a file or directory, or a name or path that does not fit
+    uint64_t bytes;
+} HostTree;
+
+int host_add_dir(HostTree* t, const char* host, const char* name, int parent, Directory* dir) {
+    if (t->ndirs == t->dirs_cap) {
+        t->dirs_cap = t->dirs_cap ? t->dirs_cap*2 : 64;
+        t->dirs = (HostDir*)realloc(t->dirs, t->dirs_cap * sizeof(HostDir));
+    }
+    HostDir* d = &t->dirs[t->ndirs];
+    d->host = strdup(host);
+    d->name = strdup(name);
+    d->parent = parent;
+    d->dir = dir;
+    return t->ndirs++;
+}
+
+void host_add_file(HostTree* t, const char* host, const char* name, int dir, File* f) {
+    if (t->nfiles == t->files_cap) {
+        t->files_cap = t->files_cap ? t->files_cap*2 : 256;
+        t->files = (HostFile*)realloc(t->files, t->files_cap * sizeof(HostFile));
+    }
+    HostFile* e = &t->files[t->nfiles++];
+    memset(e, 0, sizeof(*e));
+    e->host = strdup(host);
+    e->name = strdup(name);
+    e->dir = dir;
+    e->f = f;
+}
+
+void host_tree_free(HostTree* t) {
+    for (int i=0;i<t->ndirs;i++) { free(t->dirs[i].host); free(t->dirs[i].name); }
+    for (uint32_t i=0;i<t->nfiles;i++) { free(t->files[i].host); free(t->files[i].name); }
+    free(t->dirs);
+    free(t->files);
+}
+
+// a host name the shell, the journal and the text disk can all carry
+int host_name_ok(const char* name) {
+    if (strlen(name) >= MAX_NAME) return 0;
+    for (const char* p = name; *p; p++)
+        if ((unsigned char)*p < ' ') return 0;
+    return 1;
+}
+
+// lists the tree under t->dirs[di] (breadth first, so parents come before their children)
+void host_scan(HostTree* t, size_t vfs_len) {
+    for (int di = 0; di < t->ndirs; di++) {
+        DIR* dh = opendir(t->dirs[di].host);
+        if (!dh) { t->skipped++; continue; }
+        struct dirent* de;
+        while ((de = readdir(dh))) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+            char host[4096];
+            int n = snprintf(host, sizeof(host), "%s/%s", t->dirs[di].host, de->d_name);
+            struct stat st;
+            // symlinks are not followed, so a link cycle cannot make the scan endless
+            if (!host_name_ok(de->d_name) || n >= (int)sizeof(host) || lstat(host, &st) != 0) { t->skipped++; continue; }
+            // the VFS path, which the journal and the disk formats keep under 1024 bytes
+            size_t depth_len = vfs_len;
+            for (int p = di; p >= 0; p = t->dirs[p].parent) depth_len += strlen(t->dirs[p].name) + 1;
+            if (depth_len + strlen(de->d_name) + 2 >= 1024) { t->skipped++; continue; }
+            if (S_ISDIR(st.st_mode)) host_add_dir(t, host, de->d_name, di, NULL);
+            else if (S_ISREG(st.st_mode)) host_add_file(t, host, de->d_name, di, NULL);
+            else t->skipped++;
+        }
+        closedir(dh);
+    }
+}
+
+// maps and hashes the files of the current batch
+void* import_main(void* arg) {
+    HostTree* t = (HostTree*)arg;
+    for (;;) {
+        uint32_t i = __atomic_fetch_add(&t->next, 1, __ATOMIC_RELAXED);
+        if (i >= t->count) break;
+        HostFile* e = &t->files[t->first + i];
+        int fd = open(e->host, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) { e->err = errno; if (fd >= 0) close(fd); continue; }
+        e->len = (size_t)st.st_size;
+        if (e->len) {
+            void* m = mmap(NULL, e->len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m == MAP_FAILED) { e->err = errno; e->len = 0; }
+            else {
+                madvise(m, e->len, MADV_SEQUENTIAL);
+                e->map = (const char*)m;
+                e->hash = body_hash(e->map, e->len);
+            }
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+void import_unmap(HostTree* t) {
+    for (uint32_t i=0;i<t->count;i++) {
+        HostFile* e = &t->files[t->first + i];
+        if (e->map) munmap((void*)e->map, e->len);
+        e->map = NULL;
+    }
+}
+
+// the caller holds the tree exclusively
+void cmd_import(const char* hostdir, const char* path) {
+    char name[MAX_NAME];
+    Directory* parent = resolve_parent(path, name, sizeof(name));
+    if (!parent) { path_fail(path, "Directory not found."); return; }
+    if (!name[0]) { shell_error("Directory not found.\n"); return; }
+    if (find_subdir(parent, name) || find_file(parent, name)) { shell_error("'%s' already exists.\n", path); return; }
+    struct stat st;
+    if (stat(hostdir, &st) != 0 || !S_ISDIR(st.st_mode)) { shell_error("Error: '%s' is not a host directory.\n", hostdir); return; }
+    HostTree t;
+    memset(&t, 0, sizeof(t));
+    host_add_dir(&t, hostdir, name, -1, NULL);
+    host_scan(&t, strlen(parent->path));
+    // built off to the side: no parent until it is complete
+    Directory* top = create_dir(name, parent);
+    top->parent = NULL;
+    snap_paused = 1;
+    t.dirs[0].dir = top;
+    for (int i=1;i<t.ndirs;i++) {
+        Directory* up = t.dirs[t.dirs[i].parent].dir;
+        t.dirs[i].dir = create_dir(t.dirs[i].name, up);
+        add_subdir(up, t.dirs[i].dir);
+    }
+    int failed = 0;
+    Directory* q = NULL;
+    for (t.first = 0; t.first < t.nfiles && !failed; t.first += t.count) {
+        t.count = t.nfiles - t.first < IMPORT_BATCH ? t.nfiles - t.first : IMPORT_BATCH;
+        t.next = 0;
+        run_workers(import_main, &t, worker_count(t.count, HOST_FILES_PER_THREAD));
+        for (uint32_t i=0;i<t.count && !failed;i++) {
+            HostFile* e = &t.files[t.first + i];
+            if (e->err) {
+                shell_error("Error: could not read '%s': %s.\n", e->host, strerror(e->err));
+                failed = 1;
+                break;
+            }
+            File* f = create_file(e->name);
+            if (e->len) {
+                Content body = {0};
+                content_append(&body, e->map, e->len);
+                f->blob = blob_intern_hashed(&body, e->hash);
+            }
+            add_file(t.dirs[e->dir].dir, f);
+            t.bytes += e->len;
+        }
+        import_unmap(&t);
+        // checked as the batches come in, so a tree far over the quota is not read to the end
+        if (!failed && (q = quota_exceeded(parent, (int64_t)t.bytes))) {
+            quota_error(q);
+            failed = 1;
+        }
+    }
+    if (failed) {
+        // still detached: the top was never indexed or recorded by a snapshot, and its parent's counters never saw it
+        free_dir_recursive(top);
+        snap_paused = 0;
+        host_tree_free(&t);
+        return;
+    }
+    top->parent = parent;
+    add_subdir(parent, top);
+    snap_paused = 0;
+    snap_subtree_added(top);
+    // one image write instead of a journal record per imported file
+    if (journal_deferred) disk_dirty = 1;
+    else save_filesystem();
+    out_printf("Imported %u files (%llu bytes) and %d directories into '%s'.\n", t.nfiles,
+               (unsigned long long)t.bytes, t.ndirs - 1, path);
+    if (t.skipped) out_printf("Skipped %d host entries that are not plain files or directories, or whose names or paths do not fit.\n", t.skipped);
+    host_tree_free(&t);
+}
+
+// writes one body to its host file
+void* export_main(void* arg) {
+    HostTree* t = (HostTree*)arg;
+    for (;;) {
+        uint32_t i = __atomic_fetch_add(&t->next, 1, __ATOMIC_RELAXED);
+        if (i >= t->count) break;
+        HostFile* e = &t->files[i];
+        int fd = open(e->host, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) { e->err = errno; continue; }
+        struct iovec v[OUT_IOV_MAX];
+        int n = 0;
+        if (e->f->mapped) {
+            v[n].iov_base = (void*)e->f->mapped; v[n++].iov_len = e->f->mapped_len;
+        } else {
+            for (Chunk* ch = file_content(e->f)->head; ch; ch = ch->next) {
+                if (n == OUT_IOV_MAX) { if (!write_all(fd, v, n)) break; n = 0; }
+                v[n].iov_base = ch->data; v[n++].iov_len = ch->len;
+            }
+        }
+        int ok = write_all(fd, v, n);
+        if (!ok) e->err = errno;
+        if (close(fd) != 0 && ok) e->err = errno;
+    }
+    return NULL;
+}
+
+// creates path and any missing parents; 1 if it is a directory afterwards
+int host_mkdirs(const char* path) {
+    char buf[4096];
+    if (snprintf(buf, sizeof(buf), "%s", path) >= (int)sizeof(buf)) return 0;
+    for (char* p = buf + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        mkdir(buf, 0755);
+        *p = '/';
+    }
+    mkdir(buf, 0755);
+    struct stat st;
+    return stat(buf, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// the caller holds the tree exclusively, so no body changes while the workers write
+void cmd_export(const char* path, const char* hostdir) {
+    Directory* d = resolve_dir(path);
+    if (!d) { path_fail(path, "Directory not found."); return; }
+    if (!host_mkdirs(hostdir)) { shell_error("Error: could not create host directory '%s'.\n", hostdir); return; }
+    HostTree t;
+    memset(&t, 0, sizeof(t));
+    host_add_dir(&t, hostdir, d->name, -1, d);
+    // directories are created first, so every file has its host directory
+    char host[4096];
+    for (int di = 0; di < t.ndirs; di++) {
+        Directory* cur = t.dirs[di].dir;
+        for (int i=0;i<cur->files.used;i++) {
+            File* f = (File*)cur->files.slots[i].node;
+            if (!f) continue;
+            if (snprintf(host, sizeof(host), "%s/%s", t.dirs[di].host, f->name) >= (int)sizeof(host)) { t.skipped++; continue; }
+            host_add_file(&t, host, f->name, di, f);
+            t.bytes += file_size(f);
+        }
+        for (int i=0;i<cur->subdirs.used;i++) {
+            Directory* sd = (Directory*)cur->subdirs.slots[i].node;
+            if (!sd) continue;
+            if (snprintf(host, sizeof(host), "%s/%s", t.dirs[di].host, sd->name) >= (int)sizeof(host) ||
+                (mkdir(host, 0755) != 0 && errno != EEXIST)) { t.skipped++; continue; }
+            host_add_dir(&t, host, sd->name, di, sd);
+        }
+    }
+    t.count = t.nfiles;
+    run_workers(export_main, &t, worker_count(t.nfiles, HOST_FILES_PER_THREAD));
+    int failed = 0;
+    for (uint32_t i=0;i<t.nfiles;i++) {
+        if (!t.files[i].err) continue;
+        if (!failed++) shell_error("Error: could not write '%s': %s.\n", t.files[i].host, strerror(t.files[i].err));
+    }
+    if (failed > 1) out_printf("%d files could not be written.\n", failed);
+    out_printf("Exported %u files (%llu bytes) and %d directories to '%s'.\n", t.nfiles - failed,
+               (unsigned long long)t.bytes, t.ndirs - 1, hostdir);
+    if (t.skipped) shell_error("Skipped %d entries whose host paths could not be created.\n", t.skipped);
+    host_tree_free(&t);
+}
+
+// ---------- Calculator ----------
+// 'calc' and the calculator app evaluate floating-point expressions:
+//   + - * / %, ^ (power, right-associative), unary -, parentheses, pi, e,
+//   the functions in calc_funcs, and variables: "r = 2; pi * r^2" runs two
+//   statements, and a shell's variables last until it exits.
+// A statement is compiled once into a postfix program over doubles, constant
+// subexpressions folded. The program runs over a block of up to CALC_BLOCK
+// rows at once, every operator one plain loop across the block that the
+// compiler can vectorize: 'calc -f <file> <expr>' evaluates expr for each
+// number in the file (one per line, named x in expr), a block per pass;
+// 'calc -f <file>' evaluates each line of the file as statements.
+// Division by zero and domain errors give inf and nan, as IEEE arithmetic does.
+#define CALC_BLOCK 256
+#define CALC_STACK 32
+#define CALC_MAX_DEPTH 256 // parser recursion: nested parentheses, prefix minus, ^ chains
+#define CALC_MAX_VARS 64
+#define CALC_MAX_NAME 32
+
+enum { CX_CONST, CX_VAR, CX_COL, CX_ADD, CX_SUB, CX_MUL, CX_DIV, CX_MOD, CX_POW, CX_NEG, CX_FN1, CX_FN2 };
+
+enum {
+    CF_SQRT, CF_CBRT, CF_ABS, CF_EXP, CF_LN, CF_LOG10, CF_LOG2, CF_SIN, CF_COS, CF_TAN,
+    CF_ASIN, CF_ACOS, CF_ATAN, CF_SINH, CF_COSH, CF_TANH, CF_FLOOR, CF_CEIL, CF_ROUND, CF_TRUNC,
+    CF_MIN, CF_MAX, CF_POW, CF_ATAN2, CF_HYPOT
+};
+
+typedef struct CalcFunc { const char* name; int id; int argc; } CalcFunc;
+
+const CalcFunc calc_funcs[] = {
+    {"sqrt", CF_SQRT, 1}, {"cbrt", CF_CBRT, 1}, {"abs", CF_ABS, 1}, {"exp", CF_EXP, 1},
+    {"ln", CF_LN, 1}, {"log", CF_LN, 1}, {"log10", CF_LOG10, 1}, {"log2", CF_LOG2, 1},
+    {"sin", CF_SIN, 1}, {"cos", CF_COS, 1}, {"tan", CF_TAN, 1}, {"asin", CF_ASIN, 1},
+    {"acos", CF_ACOS, 1}, {"atan", CF_ATAN, 1}, {"sinh", CF_SINH, 1}, {"cosh", CF_COSH, 1},
+    {"tanh", CF_TANH, 1}, {"floor", CF_FLOOR, 1}, {"ceil", CF_CEIL, 1}, {"round", CF_ROUND, 1},
+    {"trunc", CF_TRUNC, 1}, {"min", CF_MIN, 2}, {"max", CF_MAX, 2}, {"pow", CF_POW, 2},
+    {"atan2", CF_ATAN2, 2}, {"hypot", CF_HYPOT, 2},
+};
+
+// one statement: ops and their operands in one array, like the script VM's code
+typedef struct CalcProg {
+    int32_t* code;
+    int len, cap;
+    double* consts;
+    int nconsts, consts_cap;
+    int assign; // variable slot the result goes to, -1 for a plain expression
+} CalcProg;
+
+typedef struct CalcVars {
+    char names[CALC_MAX_VARS][CALC_MAX_NAME];
+    double vals[CALC_MAX_VARS];
+    int n;
+} CalcVars;
+
+__thread CalcVars calc_vars; // the shell's; the calculator app keeps its own per run
+
+typedef struct CalcParser {
+    const char* p;
+    CalcProg* prog;
+    const CalcVars* vars;
+    int column; // x names the column being evaluated
+    int sp; // stack depth at this point of the program
+    int depth; // parser recursion
+    char error[96];
+} CalcParser;
+
+void calc_prog_free(CalcProg* p) {
+    free(p->code);
+    free(p->consts);
+    memset(p, 0, sizeof(*p));
+}
+
+void calc_error(CalcParser* c, const char* fmt, ...) {
+    if (c->error[0]) return;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(c->error, sizeof(c->error), fmt, ap);
+    va_end(ap);
+}
+
+void calc_emit(CalcParser* c, int32_t w) {
+    CalcProg* p = c->prog;
+    if (p->len == p->cap) {
+        p->cap = p->cap ? p->cap*2 : 32;
+        p->code = (int32_t*)realloc(p->code, p->cap * sizeof(int32_t));
+    }
+    p->code[p->len++] = w;
+}
+
+// pushes one value: stack depth is checked here so calc_run never overflows
+void calc_push(CalcParser* c) {
+    if (++c->sp > CALC_STACK) calc_error(c, "expression too deeply nested");
+}
+
+void calc_emit_const(CalcParser* c, double v) {
+    CalcProg* p = c->prog;
+    if (p->nconsts == p->consts_cap) {
+        p->consts_cap = p->consts_cap ? p->consts_cap*2 : 8;
+        p->consts = (double*)realloc(p->consts, p->consts_cap * sizeof(double));
+    }
+    p->consts[p->nconsts] = v;
+    calc_emit(c, CX_CONST);
+    calc_emit(c, p->nconsts++);
+    calc_push(c);
+}
+
+double calc_fn1(int fn, double a) {
+    switch (fn) {
+    case CF_SQRT: return sqrt(a);
+    case CF_CBRT: return cbrt(a);
+    case CF_ABS: return fabs(a);
+    case CF_EXP: return exp(a);
+    case CF_LN: return log(a);
+    case CF_LOG10: return log10(a);
+    case CF_LOG2: return log2(a);
+    case CF_SIN: return sin(a);
+    case CF_COS: return cos(a);
+    case CF_TAN: return tan(a);
+    case CF_ASIN: return asin(a);
+    case CF_ACOS: return acos(a);
+    case CF_ATAN: return atan(a);
+    case CF_SINH: return sinh(a);
+    case CF_COSH: return cosh(a);
+    case CF_TANH: return tanh(a);
+    case CF_FLOOR: return floor(a);
+    case CF_CEIL: return ceil(a);
+    case CF_ROUND: return round(a);
+    default: return trunc(a);
+    }
+}
+
+// binary operators (CX_*) and two-argument functions (CF_*)
+double calc_op2(int op, int fn, double a, double b) {
+    switch (op) {
+    case CX_ADD: return a + b;
+    case CX_SUB: return a - b;
+    case CX_MUL: return a * b;
+    case CX_DIV: return a / b;
+    case CX_MOD: return fmod(a, b);
+    case CX_POW: return pow(a, b);
+    }
+    switch (fn) {
+    case CF_MIN: return a < b ? a : b;
+    case CF_MAX: return a > b ? a : b;
+    case CF_POW: return pow(a, b);
+    case CF_ATAN2: return atan2(a, b);
+    default: return hypot(a, b);
+    }
+}
+
+// the code from 'at' on is a single constant
+int calc_is_const(CalcParser* c, int at) {
+    return at + 2 == c->prog->len && c->prog->code[at] == CX_CONST;
+}
+
+double calc_const_at(CalcParser* c, int at) {
+    return c->prog->consts[c->prog->code[at+1]];
+}
+
+// emits a unary op (CX_NEG or CX_FN1 fn) over the operand compiled from 'a' on, folding a constant
+void calc_unop(CalcParser* c, int a, int op, int fn) {
+    if (calc_is_const(c, a)) {
+        double v = calc_const_at(c, a);
+        c->prog->len = a;
+        c->sp--;
+        calc_emit_const(c, op == CX_NEG ? -v : calc_fn1(fn, v));
+        return;
+    }
+    calc_emit(c, op);
+    if (op == CX_FN1) calc_emit(c, fn);
+}
+
+// emits a binary op (CX_ADD.. or CX_FN2 fn) over operands compiled from 'a' and 'b' on
+void calc_binop(CalcParser* c, int a, int b, int op, int fn) {
+    if (calc_is_const(c, b) && b == a + 2 && c->prog->code[a] == CX_CONST) {
+        double v = calc_op2(op, fn, calc_const_at(c, a), calc_const_at(c, b));
+        c->prog->len = a;
+        c->sp -= 2;
+        calc_emit_const(c, v);
+        return;
+    }
+    calc_emit(c, op);
+    if (op == CX_FN2) calc_emit(c, fn);
+    c->sp--;
+}
+
+void calc_skip(CalcParser* c) {
+    while (*c->p == ' ' || *c->p == '\t' || *c->p == '\r') c->p++;
+}
+
+int calc_accept(CalcParser* c, char ch) {
+    calc_skip(c);
+    if (*c->p != ch) return 0;
+    c->p++;
+    return 1;
+}
+
+int calc_ident_char(char ch, int first) {
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_' || (!first && ch >= '0' && ch <= '9');
+}
+
+// reads an identifier into name; 0 if there is none here
+int calc_ident(CalcParser* c, char* name) {
+    calc_skip(c);
+    if (!calc_ident_char(*c->p, 1)) return 0;
+    size_t n = 0;
+    while (calc_ident_char(*c->p, 0)) {
+        if (n + 1 < CALC_MAX_NAME) name[n++] = *c->p;
+        c->p++;
+    }
+    name[n] = '\0';
+    return 1;
+}
+
+int calc_var_slot(const CalcVars* v, const char* name) {
+    for (int i=0;i<v->n;i++) if (strcmp(v->names[i], name) == 0) return i;
+    return -1;
+}
+
+void calc_expr(CalcParser* c);
+void calc_unary(CalcParser* c);
+
+void calc_primary(CalcParser* c) {
+    char name[CALC_MAX_NAME];
+    calc_skip(c);
+    if ((*c->p >= '0' && *c->p <= '9') || *c->p == '.') {
+        char* end;
+        double v = strtod(c->p, &end);
+        if (end == c->p) { calc_error(c, "bad number"); return; }
+        c->p = end;
+        calc_emit_const(c, v);
+    } else if (calc_ident(c, name)) {
+        if (calc_accept(c, '(')) {
+            const CalcFunc* fn = NULL;
+            for (size_t i=0;i<sizeof(calc_funcs)/sizeof(calc_funcs[0]);i++)
+                if (strcmp(calc_funcs[i].name, name) == 0) fn = &calc_funcs[i];
+            if (!fn) { calc_error(c, "unknown function '%s'", name); return; }
+            int a = c->prog->len;
+            calc_expr(c);
+            int b = c->prog->len;
+            if (fn->argc == 2) {
+                if (!calc_accept(c, ',')) { calc_error(c, "%s takes 2 arguments", name); return; }
+                calc_expr(c);
+            }
+            if (!calc_accept(c, ')')) { calc_error(c, "expected ')'"); return; }
+            if (fn->argc == 2) calc_binop(c, a, b, CX_FN2, fn->id);
+            else calc_unop(c, a, CX_FN1, fn->id);
+            return;
+        }
+        int slot = calc_var_slot(c->vars, name);
+        if (c->column && strcmp(name, "x") == 0) { calc_emit(c, CX_COL); calc_push(c); }
+        else if (slot >= 0) { calc_emit(c, CX_VAR); calc_emit(c, slot); calc_push(c); }
+        else if (strcmp(name, "pi") == 0) calc_emit_const(c, M_PI);
+        else if (strcmp(name, "e") == 0) calc_emit_const(c, M_E);
+        else calc_error(c, "unknown variable '%s'", name);
+    } else if (calc_accept(c, '(')) {
+        calc_expr(c);
+        if (!calc_accept(c, ')')) calc_error(c, "expected ')'");
+    } else {
+        int end = !*c->p || *c->p == '\n' || *c->p == ';';
+        calc_error(c, end ? "expression ends early" : "unexpected '%c'", *c->p);
+    }
+}
+
+// ^ binds tighter than unary minus on its left (-2^2 is -4) and takes one on its right (2^-1)
+void calc_power(CalcParser* c) {
+    int a = c->prog->len;
+    calc_primary(c);
+    if (!calc_accept(c, '^')) return;
+    int b = c->prog->len;
+    calc_unary(c);
+    calc_binop(c, a, b, CX_POW, 0);
+}
+
+void calc_unary(CalcParser* c) {
+    if (++c->depth > CALC_MAX_DEPTH) { calc_error(c, "expression too deeply nested"); return; }
+    if (calc_accept(c, '-')) {
+        int a = c->prog->len;
+        calc_unary(c);
+        calc_unop(c, a, CX_NEG, 0);
+    } else if (calc_accept(c, '+')) {
+        calc_unary(c);
+    } else {
+        calc_power(c);
+    }
+    c->depth--;
+}
+
+void calc_term(CalcParser* c) {
+    int a = c->prog->len;
+    calc_unary(c);
+    for (;;) {
+        int op;
+        if (calc_accept(c, '*')) op = CX_MUL;
+        else if (calc_accept(c, '/')) op = CX_DIV;
+        else if (calc_accept(c, '%')) op = CX_MOD;
+        else return;
+        int b = c->prog->len;
+        calc_unary(c);
+        calc_binop(c, a, b, op, 0);
+    }
+}
+
+void calc_expr(CalcParser* c) {
+    if (++c->depth > CALC_MAX_DEPTH) { calc_error(c, "expression too deeply nested"); return; }
+    int a = c->prog->len;
+    calc_term(c);
+    for (;;) {
+        int op;
+        if (calc_accept(c, '+')) op = CX_ADD;
+        else if (calc_accept(c, '-')) op = CX_SUB;
+        else break;
+        int b = c->prog->len;
+        calc_term(c);
+        calc_binop(c, a, b, op, 0);
+    }
+    c->depth--;
+}
+
+// compiles the statement at *src ("expr" or "name = expr") up to ';' or the end
+// of the line, moving *src past it; in column mode only an expression is taken.
+// A new variable gets a slot in 'vars' (0 until the program runs).
+// Returns 0 and the reason in 'err' when it does not compile.
+int calc_compile(const char** src, CalcVars* vars, int column, CalcProg* prog, char* err, size_t errlen) {
+    CalcParser c;
+    memset(&c, 0, sizeof(c));
+    memset(prog, 0, sizeof(*prog));
+    prog->assign = -1;
+    c.p = *src;
+    c.prog = prog;
+    c.vars = vars;
+    c.column = column;
+    char name[CALC_MAX_NAME];
+    const char* start = c.p;
+    if (!column && calc_ident(&c, name) && calc_accept(&c, '=')) {
+        int slot = calc_var_slot(vars, name);
+        if (strcmp(name, "pi") == 0 || strcmp(name, "e") == 0) calc_error(&c, "'%s' is a constant", name);
+        else if (slot < 0 && vars->n == CALC_MAX_VARS) calc_error(&c, "too many variables");
+        calc_expr(&c); // compiled before a new name exists, so "r = r + 1" on a new r fails
+        if (!c.error[0] && slot < 0) {
+            slot = vars->n++;
+            snprintf(vars->names[slot], CALC_MAX_NAME, "%s", name);
+            vars->vals[slot] = 0;
+        }
+        prog->assign = slot;
+    } else {
+        c.p = start;
+        calc_expr(&c);
+    }
+    calc_skip(&c);
+    if (!c.error[0] && *c.p && *c.p != ';' && *c.p != '\n') calc_error(&c, "unexpected '%c'", *c.p);
+    if (!c.error[0] && column && *c.p == ';') calc_error(&c, "only one expression is evaluated per value");
+    while (*c.p && *c.p != ';' && *c.p != '\n') c.p++;
+    if (*c.p == ';') c.p++;
+    *src = c.p;
+    if (c.error[0]) {
+        snprintf(err, errlen, "%s", c.error);
+        calc_prog_free(prog);
+        return 0;
+    }
+    return 1;
+}
+
+// runs p over w rows into stack[0]; inlined with w a constant, so every loop
+// has a fixed trip count and -O2 vectorizes it
+static inline __attribute__((always_inline))
+void calc_exec(const CalcProg* p, const CalcVars* vars, const double* col, int w, double (*stack)[CALC_BLOCK]) {
+    int sp = 0;
+    const int32_t* code = p->code;
+    for (int pc = 0; pc < p->len;) {
+        int op = code[pc++];
+        if (op >= CX_ADD && op <= CX_POW) {
+            double* restrict a = stack[sp-2];
+            const double* restrict b = stack[sp-1];
+            switch (op) {
+            case CX_ADD: for (int i=0;i<w;i++) a[i] += b[i]; break;
+            case CX_SUB: for (int i=0;i<w;i++) a[i] -= b[i]; break;
+            case CX_MUL: for (int i=0;i<w;i++) a[i] *= b[i]; break;
+            case CX_DIV: for (int i=0;i<w;i++) a[i] /= b[i]; break;
+            case CX_MOD: for (int i=0;i<w;i++) a[i] = fmod(a[i], b[i]); break;
+            default: for (int i=0;i<w;i++) a[i] = pow(a[i], b[i]); break;
+            }
+            sp--;
+            continue;
+        }
+        switch (op) {
+        case CX_CONST:
+        case CX_VAR: {
+            double v = op == CX_CONST ? p->consts[code[pc]] : vars->vals[code[pc]];
+            pc++;
+            double* restrict d = stack[sp++];
+            for (int i=0;i<w;i++) d[i] = v;
+            break;
+        }
+        case CX_COL: memcpy(stack[sp++], col, w * sizeof(double)); break;
+        case CX_NEG: {
+            double* restrict d = stack[sp-1];
+            for (int i=0;i<w;i++) d[i] = -d[i];
+            break;
+        }
+        case CX_FN1: {
+            int fn = code[pc++];
+            double* restrict d = stack[sp-1];
+            for (int i=0;i<w;i++) d[i] = calc_fn1(fn, d[i]);
+            break;
+        }
+        case CX_FN2: {
+            int fn = code[pc++];
+            double* restrict a = stack[sp-2];
+            const double* restrict b = stack[sp-1];
+            for (int i=0;i<w;i++) a[i] = calc_op2(CX_FN2, fn, a[i], b[i]);
+            sp--;
+            break;
+        }
+        }
+    }
+}
+
+// runs p over n (1..CALC_BLOCK) rows, col holding x for each in column mode
+// (readable up to CALC_BLOCK values when n > 1); results go to out[0..n).
+// A partial block is run at full width: the rows past n are computed and dropped.
+void calc_run(const CalcProg* p, const CalcVars* vars, const double* col, int n, double* out) {
+    double stack[CALC_STACK][CALC_BLOCK];
+    if (n == 1) calc_exec(p, vars, col, 1, stack);
+    else calc_exec(p, vars, col, CALC_BLOCK, stack);
+    memcpy(out, stack[0], n * sizeof(double));
+}
+
+// runs the ';'-separated statements of one line against 'vars', printing the
+// value of each that is not an assignment (after 'prefix'); returns 0 and the
+// reason in 'err' at the first that does not compile
+int calc_line(const char* src, CalcVars* vars, const char* prefix, char* err, size_t errlen) {
+    for (;;) {
+        while (*src == ' ' || *src == '\t' || *src == '\r') src++;
+        if (!*src || *src == '\n') return 1;
+        CalcProg prog;
+        if (!calc_compile(&src, vars, 0, &prog, err, errlen)) return 0;
+        double v;
+        calc_run(&prog, vars, NULL, 1, &v);
+        if (prog.assign >= 0) vars->vals[prog.assign] = v;
+        else out_printf("%s%.10g\n", prefix, v);
+        calc_prog_free(&prog);
+    }
+}
+
+// calc -f: evaluates expr over the numbers in the body, one per line
+void calc_column(const char* body, size_t len, const char* expr) {
+    CalcProg prog;
+    char err[96];
+    const char* src = expr;
+    if (!calc_compile(&src, &calc_vars, 1, &prog, err, sizeof(err))) { shell_error("calc: %s\n", err); return; }
+    // the whole column is parsed first, so evaluation is one pass of blocks;
+    // the array stays a whole number of blocks, zeros past the last value
+    size_t n = 0, cap = CALC_BLOCK;
+    double* col = (double*)malloc(cap * sizeof(double));
+    int line = 1;
+    for (const char* p = body; p < body + len; line++) {
+        const char* eol = memchr(p, '\n', (size_t)(body + len - p));
+        if (!eol) eol = body + len;
+        const char* s = p;
+        while (s < eol && (*s == ' ' || *s == '\t' || *s == '\r')) s++;
+        if (s < eol) {
+            char* end;
+            double v = strtod(s, &end);
+            while (end < eol && (*end == ' ' || *end == '\t' || *end == '\r')) end++;
+            if (end == s || end != eol) {
+                shell_error("calc: line %d is not a number.\n", line);
+                free(col);
+                calc_prog_free(&prog);
+                return;
+            }
+            if (n == cap) { cap *= 2; col = (double*)realloc(col, cap * sizeof(double)); }
+            col[n++] = v;
+        }
+        p = eol + 1;
+    }
+    memset(col + n, 0, (cap - n) * sizeof(double));
+    double out[CALC_BLOCK];
+    for (size_t i=0;i<n;i += CALC_BLOCK) {
+        int m = (n - i < CALC_BLOCK) ? (int)(n - i) : CALC_BLOCK;
+        calc_run(&prog, &calc_vars, col + i, m, out);
+        for (int j=0;j<m;j++) out_printf("%.10g\n", out[j]);
+    }
+    free(col);
+    calc_prog_free(&prog);
+}
+
+// calc <statements> | calc -f <file> [expr]
+void cmd_calc(const char* line) {
+    const char* p = line;
+    while (*p == ' ' || *p == '\t') p++;
+    while (*p && *p != ' ' && *p != '\t' && *p != '\n') p++; // the command word
+    while (*p == ' ' || *p == '\t') p++;
+    char err[96];
+    if (strncmp(p, "-f", 2) != 0 || (p[2] != ' ' && p[2] != '\t')) {
+        if (!calc_line(p, &calc_vars, "", err, sizeof(err))) shell_error("calc: %s\n", err);
+        return;
+    }
+    char path[1024];
+    int used = 0;
+    if (sscanf(p + 2, " %1023s%n", path, &used) != 1) { shell_error("usage: calc -f <file> [expr]\n"); return; }
+    const char* expr = p + 2 + used;
+    while (*expr == ' ' || *expr == '\t') expr++;
+    char name[MAX_NAME];
+    Directory* d = resolve_file(path, name, sizeof(name));
+    if (!d) { path_fail(path, "File not found."); return; }
+    char* body = NULL;
+    size_t len = 0;
+    dir_rdlock(d);
+    File* f = find_file(d, name);
+    if (f) { body = file_flatten(f); len = file_size(f); }
+    dir_unlock(d);
+    if (!body) { shell_error("File not found.\n"); return; }
+    if (*expr && *expr != '\n') {
+        calc_column(body, len, expr);
+    } else {
+        // statements stop at the end of their line; lines starting with # are comments
+        int lineno = 1;
+        for (const char* s = body; s < body + len; lineno++) {
+            const char* eol = memchr(s, '\n', (size_t)(body + len - s));
+            if (!eol) eol = body + len;
+            if (*s != '#' && !calc_line(s, &calc_vars, "", err, sizeof(err)))
+                shell_error("calc: line %d: %s\n", lineno, err);
+            s = eol + 1;
+        }
+    }
+    free(body);
+}
+
+// ---------- Script VM ----------
+// CODE= blocks are a small line-based language, compiled once into bytecode:
+//   x = expr                      print expr, expr ...
+//   if expr / elif expr / else / end
+//   while expr / end              for i = a to b [step s] / end
+//   break | continue
+//   write path, text | append path, text | mkdir path | rm path | sh "command"
+// Values are 64-bit integers or strings; + concatenates when either side is a
+// string, and / # starts a comment. Builtin functions: len str int read exists
+// input substr find lines line upper lower replace.
+// Legacy manifests ("PRINT:text", "SCRIPT:NOTEPAD file") compile to the same
+// bytecode. Compiled programs are cached in /apps as <package>.savbc.
+#define VM_STACK 256
+#define VM_MAX_DEPTH 8
+#define VM_TICK 1024 // instructions between task_tick calls
+#define BYTECODE_MAGIC "SAVBC1"
+
+// program constants are pinned: shared by every concurrent run of an app, never counted
+#define STR_PINNED -1
+
+typedef struct Str {
+    int refs;
+    size_t len;
+    char data[];
+} Str;
+
+enum { VAL_INT, VAL_STR };
+
+typedef struct Value {
+    int type;
+    union {
+        int64_t i;
+        Str* s;
+    };
+} Value;
+
+enum {
+    OP_HALT, OP_CONST, OP_LOAD, OP_STORE, OP_POP,
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_NEG, OP_NOT,
+    OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE,
+    OP_JMP, OP_JZ, OP_JZ_KEEP, OP_JNZ_KEEP, OP_FOR_DONE,
+    OP_PRINT, OP_CALL,
+    OP_WRITE, OP_APPEND, OP_MKDIR, OP_RM, OP_SH, OP_NOTEPAD
+};
+
+enum {
+    FN_LEN, FN_STR, FN_INT, FN_READ, FN_EXISTS, FN_INPUT, FN_SUBSTR,
+    FN_FIND, FN_LINES, FN_LINE, FN_UPPER, FN_LOWER, FN_REPLACE
+};
+
+typedef struct VmFunc { const char* name; int id; int argc; } VmFunc;
+
+const VmFunc vm_funcs[] = {
+    {"len", FN_LEN, 1}, {"str", FN_STR, 1}, {"int", FN_INT, 1}, {"read", FN_READ, 1},
+    {"exists", FN_EXISTS, 1}, {"input", FN_INPUT, 0}, {"substr", FN_SUBSTR, 3},
+    {"find", FN_FIND, 2}, {"lines", FN_LINES, 1}, {"line", FN_LINE, 2},
+    {"upper", FN_UPPER, 1}, {"lower", FN_LOWER, 1}, {"replace", FN_REPLACE, 3},
+};
+
+typedef struct Program {
+    int32_t* code;
+    int code_len;
+    Value* consts;
+    int nconsts;
+    int nvars;
+} Program;
+
+Str* str_new(const char* data, size_t len) {
+    Str* s = (Str*)malloc(sizeof(Str) + len + 1);
+    s->refs = 1;
+    s->len = len;
+    if (len) memcpy(s->data, data, len);
+    s->data[len] = '\0';
+    return s;
+}
+
+void str_retain(Str* s) {
+    if (s->refs != STR_PINNED) s->refs++;
+}
+
+void val_release(Value v) {
+    if (v.type == VAL_STR && v.s->refs != STR_PINNED && --v.s->refs == 0) free(v.s);
+}
+
+Value val_int(int64_t i) {
+    Value v;
+    v.type = VAL_INT;
+    v.i = i;
+    return v;
+}
+
+Value val_str(Str* s) {
+    Value v;
+    v.type = VAL_STR;
+    v.s = s;
+    return v;
+}
+
+// new reference to the string form of v
+Str* val_to_str(Value v) {
+    if (v.type == VAL_STR) { str_retain(v.s); return v.s; }
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%lld", (long long)v.i);
+    return str_new(buf, (size_t)n);
+}
+
+int64_t val_to_int(Value v) {
+    return v.type == VAL_INT ? v.i : strtoll(v.s->data, NULL, 10);
+}
+
+int val_truthy(Value v) {
+    return v.type == VAL_INT ? v.i != 0 : v.s->len != 0;
+}
+
+void program_free(Program* p) {
+    if (!p) return;
+    for (int i=0;i<p->nconsts;i++)
+        if (p->consts[i].type == VAL_STR) free(p->consts[i].s);
+    free(p->consts);
+    free(p->code);
+    free(p);
+}
+
+// ----- compiler -----
+enum { TK_END, TK_NUM, TK_STR, TK_IDENT, TK_OP };
+enum { BLK_IF, BLK_WHILE, BLK_FOR };
+
+#define VM_MAX_BLOCKS 64
+#define VM_MAX_PATCHES 64
+
+typedef struct Block {
+    int kind;
+    int line;
+    int cond_jump;   // IF: pending jump to the next branch; loops: exit jump
+    int loop_start;
+    int has_else;
+    int var, end_var, step_var;        // FOR slots
+    int jumps[VM_MAX_PATCHES];         // IF: jumps to end; loops: breaks
+    int njumps;
+    int conts[VM_MAX_PATCHES];         // continue jumps
+    int nconts;
+} Block;
+
+typedef struct Compiler {
+    Program* prog;
+    int code_cap, consts_cap;
+    char** vars;
+    int vars_cap;
+    const char* p;       // cursor in the current line
+    const char* tok_start;
+    int tok;
+    int64_t num;
+    char* text;          // identifier / string literal / operator
+    size_t text_len;
+    size_t text_cap;
+    Block blocks[VM_MAX_BLOCKS];
+    int nblocks;
+    int line;
+    char error[160];
+} Compiler;
+
+void cc_error(Compiler* c, const char* msg) {
+    if (!c->error[0]) snprintf(c->error, sizeof(c->error), "line %d: %s", c->line, msg);
+}
+
+int cc_emit(Compiler* c, int32_t w) {
+    if (c->prog->code_len == c->code_cap) {
+        c->code_cap = c->code_cap ? c->code_cap*2 : 64;
+        c->prog->code = (int32_t*)realloc(c->prog->code, c->code_cap * sizeof(int32_t));
+    }
+    c->prog->code[c->prog->code_len] = w;
+    return c->prog->code_len++;
+}
+
+void cc_patch(Compiler* c, int at) {
+    c->prog->code[at] = c->prog->code_len;
+}
+
+int cc_const(Compiler* c, Value v) {
+    Program* p = c->prog;
+    if (p->nconsts == c->consts_cap) {
+        c->consts_cap = c->consts_cap ? c->consts_cap*2 : 16;
+        p->consts = (Value*)realloc(p->consts, c->consts_cap * sizeof(Value));
+    }
+    if (v.type == VAL_STR) v.s->refs = STR_PINNED;
+    p->consts[p->nconsts] = v;
+    return p->nconsts++;
+}
+
+int cc_var(Compiler* c, const char* name) {
+    for (int i=0;i<c->prog->nvars;i++) if (strcmp(c->vars[i], name) == 0) return i;
+    if (c->prog->nvars == c->vars_cap) {
+        c->vars_cap = c->vars_cap ? c->vars_cap*2 : 16;
+        c->vars = (char**)realloc(c->vars, c->vars_cap * sizeof(char*));
+    }
+    c->vars[c->prog->nvars] = strdup(name);
+    return c->prog->nvars++;
+}
+
+// hidden slot for FOR bounds; the name cannot clash with a user variable
+int cc_temp(Compiler* c) {
+    char name[32];
+    snprintf(name, sizeof(name), " tmp%d", c->prog->nvars);
+    return cc_var(c, name);
+}
+
+void cc_text_push(Compiler* c, char ch) {
+    if (c->text_len + 1 >= c->text_cap) {
+        c->text_cap = c->text_cap ? c->text_cap*2 : 64;
+        c->text = (char*)realloc(c->text, c->text_cap);
+    }
+    c->text[c->text_len++] = ch;
+    c->text[c->text_len] = '\0';
+}
+
+void cc_next(Compiler* c) {
+    const char* p = c->p;
+    while (*p == ' ' || *p == '\t' || *p == '\r') p++;
+    c->text_len = 0;
+    cc_text_push(c, '\0');
+    c->text_len = 0;
+    c->tok_start = p;
+    if (*p == '\0' || *p == '\n' || *p == '#') { c->tok = TK_END; c->p = p; return; }
+    if (*p >= '0' && *p <= '9') {
+        c->num = 0;
+        while (*p >= '0' && *p <= '9') c->num = c->num*10 + (*p++ - '0');
+        c->tok = TK_NUM;
+    } else if (*p == '"') {
+        p++;
+        while (*p && *p != '"' && *p != '\n') {
+            char ch = *p++;
+            if (ch == '\\' && *p) {
+                ch = *p++;
+                if (ch == 'n') ch = '\n';
+                else if (ch == 't') ch = '\t';
+            }
+            cc_text_push(c, ch);
+        }
+        if (*p != '"') cc_error(c, "unterminated string");
+        else p++;
+        c->tok = TK_STR;
+    } else if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || *p == '_') {
+        while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') || *p == '_')
+            cc_text_push(c, *p++);
+        c->tok = TK_IDENT;
+    } else {
+        cc_text_push(c, *p++);
+        if ((c->text[0] == '=' || c->text[0] == '!' || c->text[0] == '<' || c->text[0] == '>') && *p == '=')
+            cc_text_push(c, *p++);
+        c->tok = TK_OP;
+    }
+    c->p = p;
+}
+
+int cc_is(Compiler* c, int tok, const char* text) {
+    return c->tok == tok && strcmp(c->text, text) == 0;
+}
+
+int cc_accept(Compiler* c, int tok, const char* text) {
+    if (!cc_is(c, tok, text)) return 0;
+    cc_next(c);
+    return 1;
+}
+
+void cc_expect(Compiler* c, int tok, const char* text) {
+    if (!cc_accept(c, tok, text)) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "expected '%s'", text);
+        cc_error(c, msg);
+    }
+}
+
+void cc_expr(Compiler* c);
+
+void cc_primary(Compiler* c) {
+    if (c->tok == TK_NUM) {
+        cc_emit(c, OP_CONST);
+        cc_emit(c, cc_const(c, val_int(c->num)));
+        cc_next(c);
+    } else if (c->tok == TK_STR) {
+        cc_emit(c, OP_CONST);
+        cc_emit(c, cc_const(c, val_str(str_new(c->text, c->text_len))));
+        cc_next(c);
+    } else if (c->tok == TK_IDENT) {
+        char name[64];
+        snprintf(name, sizeof(name), "%s", c->text);
+        cc_next(c);
+        if (cc_accept(c, TK_OP, "(")) {
+            const VmFunc* fn = NULL;
+            for (size_t i=0;i<sizeof(vm_funcs)/sizeof(vm_funcs[0]);i++)
+                if (strcmp(vm_funcs[i].name, name) == 0) fn = &vm_funcs[i];
+            if (!fn) { cc_error(c, "unknown function"); return; }
+            int argc = 0;
+            if (!cc_is(c, TK_OP, ")")) {
+                do { cc_expr(c); argc++; } while (cc_accept(c, TK_OP, ","));
+            }
+            cc_expect(c, TK_OP, ")");
+            if (argc != fn->argc) { cc_error(c, "wrong number of arguments"); return; }
+            cc_emit(c, OP_CALL);
+            cc_emit(c, fn->id);
+        } else {
+            cc_emit(c, OP_LOAD);
+            cc_emit(c, cc_var(c, name));
+        }
+    } else if (cc_accept(c, TK_OP, "(")) {
+        cc_expr(c);
+        cc_expect(c, TK_OP, ")");
+    } else {
+        cc_error(c, "expected an expression");
+    }
+}
+
+void cc_unary(Compiler* c) {
+    if (cc_accept(c, TK_OP, "-")) { cc_unary(c); cc_emit(c, OP_NEG); }
+    else cc_primary(c);
+}
+
+void cc_mul(Compiler* c) {
+    cc_unary(c);
+    while (c->tok == TK_OP && (cc_is(c, TK_OP, "*") || cc_is(c, TK_OP, "/") || cc_is(c, TK_OP, "%"))) {
+        char op = c->text[0];
+        cc_next(c);
+        cc_unary(c);
+        cc_emit(c, op == '*' ? OP_MUL : op == '/' ? OP_DIV : OP_MOD);
+    }
+}
+
+void cc_add(Compiler* c) {
+    cc_mul(c);
+    while (cc_is(c, TK_OP, "+") || cc_is(c, TK_OP, "-")) {
+        char op = c->text[0];
+        cc_next(c);
+        cc_mul(c);
+        cc_emit(c, op == '+' ? OP_ADD : OP_SUB);
+    }
+}
+
+void cc_cmp(Compiler* c) {
+    cc_add(c);
+    static const char* ops[] = {"==", "!=", "<", "<=", ">", ">="};
+    static const int codes[] = {OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE};
+    for (int i=0;i<6;i++) {
+        if (cc_is(c, TK_OP, ops[i])) {
+            cc_next(c);
+            cc_add(c);
+            cc_emit(c, codes[i]);
+            return;
+        }
+    }
+}
+
+void cc_not(Compiler* c) {
+    if (cc_accept(c, TK_IDENT, "not")) { cc_not(c); cc_emit(c, OP_NOT); }
+    else cc_cmp(c);
+}
+
+// and/or short-circuit and leave the deciding operand on the stack
+void cc_and(Compiler* c) {
+    cc_not(c);
+    while (cc_accept(c, TK_IDENT, "and")) {
+        cc_emit(c, OP_JZ_KEEP);
+        int j = cc_emit(c, 0);
+        cc_emit(c, OP_POP);
+        cc_not(c);
+        cc_patch(c, j);
+    }
+}
+
+void cc_expr(Compiler* c) {
+    cc_and(c);
+    while (cc_accept(c, TK_IDENT, "or")) {
+        cc_emit(c, OP_JNZ_KEEP);
+        int j = cc_emit(c, 0);
+        cc_emit(c, OP_POP);
+        cc_and(c);
+        cc_patch(c, j);
+    }
+}
+
+Block* cc_push_block(Compiler* c, int kind) {
+    if (c->nblocks == VM_MAX_BLOCKS) { cc_error(c, "blocks nested too deeply"); return NULL; }
+    Block* b = &c->blocks[c->nblocks++];
+    memset(b, 0, sizeof(*b));
+    b->kind = kind;
+    b->line = c->line;
+    b->cond_jump = -1;
+    return b;
+}
+
+Block* cc_loop(Compiler* c) {
+    for (int i=c->nblocks-1;i>=0;i--) if (c->blocks[i].kind != BLK_IF) return &c->blocks[i];
+    return NULL;
+}
+
+void cc_add_jump(Compiler* c, int* list, int* n) {
+    cc_emit(c, OP_JMP);
+    int at = cc_emit(c, 0);
+    if (*n == VM_MAX_PATCHES) { cc_error(c, "too many jumps out of one block"); return; }
+    list[(*n)++] = at;
+}
+
+void cc_statement(Compiler* c) {
+    if (c->tok == TK_END) return;
+    if (c->tok != TK_IDENT) { cc_error(c, "expected a statement"); return; }
+    if (cc_accept(c, TK_IDENT, "print")) {
+        int n = 0;
+        if (c->tok != TK_END) {
+            do { cc_expr(c); n++; } while (cc_accept(c, TK_OP, ","));
+        }
+        cc_emit(c, OP_PRINT);
+        cc_emit(c, n);
+    } else if (cc_accept(c, TK_IDENT, "if")) {
+        cc_expr(c);
+        Block* b = cc_push_block(c, BLK_IF);
+        if (!b) return;
+        cc_emit(c, OP_JZ);
+        b->cond_jump = cc_emit(c, 0);
+    } else if (cc_is(c, TK_IDENT, "elif") || cc_is(c, TK_IDENT, "else")) {
+        int is_else = cc_is(c, TK_IDENT, "else");
+        cc_next(c);
+        Block* b = c->nblocks ? &c->blocks[c->nblocks-1] : NULL;
+        if (!b || b->kind != BLK_IF || b->has_else) { cc_error(c, "elif/else without if"); return; }
+        cc_add_jump(c, b->jumps, &b->njumps);
+        cc_patch(c, b->cond_jump);
+        b->cond_jump = -1;
+        if (is_else) {
+            b->has_else = 1;
+        } else {
+            cc_expr(c);
+            cc_emit(c, OP_JZ);
+            b->cond_jump = cc_emit(c, 0);
+        }
+    } else if (cc_accept(c, TK_IDENT, "while")) {
+        int start = c->prog->code_len;
+        cc_expr(c);
+        Block* b = cc_push_block(c, BLK_WHILE);
+        if (!b) return;
+        b->loop_start = start;
+        cc_emit(c, OP_JZ);
+        b->cond_jump = cc_emit(c, 0);
+    } else if (cc_accept(c, TK_IDENT, "for")) {
+        if (c->tok != TK_IDENT) { cc_error(c, "expected a loop variable"); return; }
+        int var = cc_var(c, c->text);
+        cc_next(c);
+        cc_expect(c, TK_OP, "=");
+        cc_expr(c);
+        cc_emit(c, OP_STORE);
+        cc_emit(c, var);
+        cc_expect(c, TK_IDENT, "to");
+        int end_var = cc_temp(c);
+        cc_expr(c);
+        cc_emit(c, OP_STORE);
+        cc_emit(c, end_var);
+        int step_var = cc_temp(c);
+        if (cc_accept(c, TK_IDENT, "step")) cc_expr(c);
+        else { cc_emit(c, OP_CONST); cc_emit(c, cc_const(c, val_int(1))); }
+        cc_emit(c, OP_STORE);
+        cc_emit(c, step_var);
+        Block* b = cc_push_block(c, BLK_FOR);
+        if (!b) return;
+        b->var = var;
+        b->end_var = end_var;
+        b->step_var = step_var;
+        b->loop_start = c->prog->code_len;
+        cc_emit(c, OP_FOR_DONE);
+        cc_emit(c, var);
+        cc_emit(c, end_var);
+        cc_emit(c, step_var);
+        b->cond_jump = cc_emit(c, 0);
+    } else if (cc_accept(c, TK_IDENT, "end")) {
+        if (!c->nblocks) { cc_error(c, "end without a block"); return; }
+        Block* b = &c->blocks[--c->nblocks];
+        if (b->kind == BLK_FOR) {
+            // continue lands on the increment
+            for (int i=0;i<b->nconts;i++) cc_patch(c, b->conts[i]);
+            cc_emit(c, OP_LOAD); cc_emit(c, b->var);
+            cc_emit(c, OP_LOAD); cc_emit(c, b->step_var);
+            cc_emit(c, OP_ADD);
+            cc_emit(c, OP_STORE); cc_emit(c, b->var);
+        } else if (b->kind == BLK_WHILE) {
+            for (int i=0;i<b->nconts;i++) c->prog->code[b->conts[i]] = b->loop_start;
+        }
+        if (b->kind != BLK_IF) {
+            cc_emit(c, OP_JMP);
+            cc_emit(c, b->loop_start);
+        }
+        if (b->cond_jump >= 0) cc_patch(c, b->cond_jump);
+        for (int i=0;i<b->njumps;i++) cc_patch(c, b->jumps[i]);
+    } else if (cc_accept(c, TK_IDENT, "break")) {
+        Block* b = cc_loop(c);
+        if (!b) { cc_error(c, "break outside a loop"); return; }
+        cc_add_jump(c, b->jumps, &b->njumps);
+    } else if (cc_accept(c, TK_IDENT, "continue")) {
+        Block* b = cc_loop(c);
+        if (!b) { cc_error(c, "continue outside a loop"); return; }
+        cc_add_jump(c, b->conts, &b->nconts);
+    } else if (cc_is(c, TK_IDENT, "write") || cc_is(c, TK_IDENT, "append")) {
+        int op = cc_is(c, TK_IDENT, "write") ? OP_WRITE : OP_APPEND;
+        cc_next(c);
+        cc_expr(c);
+        cc_expect(c, TK_OP, ",");
+        cc_expr(c);
+        cc_emit(c, op);
+    } else if (cc_is(c, TK_IDENT, "mkdir") || cc_is(c, TK_IDENT, "rm") || cc_is(c, TK_IDENT, "sh") ||
+               cc_is(c, TK_IDENT, "notepad")) {
+        int op = cc_is(c, TK_IDENT, "mkdir") ? OP_MKDIR : cc_is(c, TK_IDENT, "rm") ? OP_RM :
+                 cc_is(c, TK_IDENT, "sh") ? OP_SH : OP_NOTEPAD;
+        cc_next(c);
+        cc_expr(c);
+        cc_emit(c, op);
+    } else {
+        // assignment or a bare expression such as input()
+        const char* start = c->tok_start;
+        char name[64];
+        snprintf(name, sizeof(name), "%s", c->text);
+        cc_next(c);
+        if (cc_accept(c, TK_OP, "=")) {
+            cc_expr(c);
+            cc_emit(c, OP_STORE);
+            cc_emit(c, cc_var(c, name));
+        } else {
+            c->p = start;
+            cc_next(c);
+            cc_expr(c);
+            cc_emit(c, OP_POP);
+        }
+    }
+    if (c->tok != TK_END) cc_error(c, "unexpected text at end of line");
+}
+
+Program* program_new() {
+    Program* p = (Program*)malloc(sizeof(Program));
+    memset(p, 0, sizeof(*p));
+    return p;
+}
+
+// compiles a CODE block; on failure returns NULL and describes the problem in err
+Program* compile_program(const char* src, char* err, size_t errlen) {
+    Compiler c;
+    memset(&c, 0, sizeof(c));
+    c.prog = program_new();
+    if (strncmp(src, "PRINT:", 6) == 0) {
+        // legacy one-liner: the rest of the block is printed verbatim
+        cc_emit(&c, OP_CONST);
+        cc_emit(&c, cc_const(&c, val_str(str_new(src+6, strlen(src+6)))));
+        cc_emit(&c, OP_PRINT);
+        cc_emit(&c, 1);
+    } else if (strncmp(src, "SCRIPT:NOTEPAD", 14) == 0) {
+        const char* s = src+14;
+        while (*s == ' ' || *s == '\t') s++;
+        size_t n = strcspn(s, "\r\n");
+        while (n > 0 && (s[n-1] == ' ' || s[n-1] == '\t')) n--;
+        cc_emit(&c, OP_CONST);
+        cc_emit(&c, cc_const(&c, val_str(str_new(s, n))));
+        cc_emit(&c, OP_NOTEPAD);
+    } else {
+        const char* line = src;
+        while (*line && !c.error[0]) {
+            c.line++;
+            c.p = line;
+            cc_next(&c);
+            cc_statement(&c);
+            const char* eol = strchr(line, '\n');
+            line = eol ? eol+1 : line+strlen(line);
+        }
+        if (!c.error[0] && c.nblocks) {
+            c.line = c.blocks[c.nblocks-1].line;
+            cc_error(&c, "block is missing its 'end'");
+        }
+    }
+    cc_emit(&c, OP_HALT);
+    for (int i=0;i<c.prog->nvars;i++) free(c.vars[i]);
+    free(c.vars);
+    free(c.text);
+    if (c.error[0]) {
+        snprintf(err, errlen, "%s", c.error);
+        program_free(c.prog);
+        return NULL;
+    }
+    return c.prog;
+}
+
+// ----- bytecode cache -----
+// layout: magic[8] src_hash code_len nconsts nvars code[] consts[] checksum
+void program_serialize(Program* p, uint64_t src_hash, Content* out) {
+    Content body = {0};
+    char magic[8] = {0};
+    memcpy(magic, BYTECODE_MAGIC, sizeof(BYTECODE_MAGIC));
+    uint32_t hdr[3] = { (uint32_t)p->code_len, (uint32_t)p->nconsts, (uint32_t)p->nvars };
+    content_append(&body, magic, sizeof(magic));
+    content_append(&body, (const char*)&src_hash, sizeof(src_hash));
+    content_append(&body, (const char*)hdr, sizeof(hdr));
+    content_append(&body, (const char*)p->code, p->code_len * sizeof(int32_t));
+    for (int i=0;i<p->nconsts;i++) {
+        char type = (char)p->consts[i].type;
+        content_append(&body, &type, 1);
+        if (p->consts[i].type == VAL_INT) {
+            content_append(&body, (const char*)&p->consts[i].i, sizeof(int64_t));
+        } else {
+            uint32_t len = (uint32_t)p->consts[i].s->len;
+            content_append(&body, (const char*)&len, sizeof(len));
+            content_append(&body, p->consts[i].s->data, len);
+        }
+    }
+    uint64_t sum = FNV64_INIT;
+    for (Chunk* ch = body.head; ch; ch = ch->next) sum = fnv1a64(ch->data, ch->len, sum);
+    content_append(&body, (const char*)&sum, sizeof(sum));
+    *out = body;
+}
+
+// whether a program read from the cache is one the VM can run without bounds
+// checks of its own: every opcode known, every constant index, variable slot,
+// function id and jump target (an instruction start) in range, no path that
+// pops an empty stack, overflows it, reaches a merge point at two different
+// depths or runs off the end of the code
+int program_verify(const Program* p) {
+    int n = p->code_len;
+    const int32_t* code = p->code;
+    if (n < 1 || p->nvars < 0 || p->nvars > n) return 0;
+    // pass 1: instruction starts and operands
+    char* start = (char*)calloc((size_t)n, 1);
+    int ok = 1;
+    for (int pc = 0; pc < n && ok;) {
+        start[pc] = 1;
+        int op = code[pc], len = 1;
+        switch (op) {
+        case OP_CONST: len = 2; ok = pc+1 < n && code[pc+1] >= 0 && code[pc+1] < p->nconsts; break;
+        case OP_LOAD: case OP_STORE: len = 2; ok = pc+1 < n && code[pc+1] >= 0 && code[pc+1] < p->nvars; break;
+        case OP_JMP: case OP_JZ: case OP_JZ_KEEP: case OP_JNZ_KEEP: len = 2; ok = pc+1 < n; break;
+        case OP_FOR_DONE:
+            len = 5;
+            ok = pc+4 < n;
+            for (int i=1;i<=3 && ok;i++) ok = code[pc+i] >= 0 && code[pc+i] < p->nvars;
+            break;
+        case OP_PRINT: len = 2; ok = pc+1 < n && code[pc+1] >= 0 && code[pc+1] <= VM_STACK; break;
+        case OP_CALL:
+            len = 2;
+            ok = 0;
+            for (size_t i=0;i<sizeof(vm_funcs)/sizeof(vm_funcs[0]) && pc+1 < n;i++) ok |= vm_funcs[i].id == code[pc+1];
+            break;
+        default: ok = op >= OP_HALT && op <= OP_NOTEPAD;
+        }
+        pc += len;
+    }
+    // pass 2: stack depth along every path, from the first instruction
+    int* depth = (int*)malloc((size_t)n * sizeof(int));
+    int* work = (int*)malloc((size_t)n * sizeof(int));
+    for (int i=0;i<n;i++) depth[i] = -1;
+    int nwork = 0;
+    if (ok) { depth[0] = 0; work[nwork++] = 0; }
+    while (ok && nwork) {
+        int pc = work[--nwork];
+        int d = depth[pc], op = code[pc];
+        int pops = 0, pushes = 0, nsucc = 1, succ[2] = { pc+1, 0 };
+        switch (op) {
+        case OP_HALT: nsucc = 0; break;
+        case OP_CONST: case OP_LOAD: pushes = 1; succ[0] = pc+2; break;
+        case OP_STORE: pops = 1; succ[0] = pc+2; break;
+        case OP_POP: case OP_MKDIR: case OP_RM: case OP_SH: case OP_NOTEPAD: pops = 1; break;
+        case OP_NEG: case OP_NOT: pops = 1; pushes = 1; break;
+        case OP_WRITE: case OP_APPEND: pops = 2; break;
+        case OP_JMP: succ[0] = code[pc+1]; break;
+        case OP_JZ: pops = 1; nsucc = 2; succ[0] = pc+2; succ[1] = code[pc+1]; break;
+        case OP_JZ_KEEP: case OP_JNZ_KEEP: pops = 1; pushes = 1; nsucc = 2; succ[0] = pc+2; succ[1] = code[pc+1]; break;
+        case OP_FOR_DONE: nsucc = 2; succ[0] = pc+5; succ[1] = code[pc+4]; break;
+        case OP_PRINT: pops = code[pc+1]; succ[0] = pc+2; break;
+        case OP_CALL:
+            for (size_t i=0;i<sizeof(vm_funcs)/sizeof(vm_funcs[0]);i++) if (vm_funcs[i].id == code[pc+1]) pops = vm_funcs[i].argc;
+            pushes = 1;
+            succ[0] = pc+2;
+            break;
+        default: pops = 2; pushes = 1; break; // binary operators
+        }
+        if (d < pops || d - pops + pushes > VM_STACK) { ok = 0; break; }
+        d = d - pops + pushes;
+        for (int i=0;i<nsucc && ok;i++) {
+            int s = succ[i];
+            if (s < 0 || s >= n || !start[s]) ok = 0;
+            else if (depth[s] == -1) { depth[s] = d; work[nwork++] = s; }
+            else if (depth[s] != d) ok = 0;
+        }
+    }
+    free(start);
+    free(depth);
+    free(work);
+    return ok;
+}
+
+// NULL unless 'data' is an intact cache entry for source hash 'src_hash'
+// that program_verify accepts
+Program* program_deserialize(const char* data, size_t len, uint64_t src_hash) {
+    size_t hdr_len = 8 + sizeof(uint64_t) + 3*sizeof(uint32_t);
+    if (len < hdr_len + sizeof(uint64_t) || memcmp(data, BYTECODE_MAGIC, sizeof(BYTECODE_MAGIC)) != 0) return NULL;
+    uint64_t sum, hash;
+    memcpy(&sum, data + len - sizeof(sum), sizeof(sum));
+    if (fnv1a64(data, len - sizeof(sum), FNV64_INIT) != sum) return NULL;
+    memcpy(&hash, data + 8, sizeof(hash));
+    if (hash != src_hash) return NULL;
+    uint32_t hdr[3];
+    memcpy(hdr, data + 16, sizeof(hdr));
+    const char* p = data + hdr_len;
+    const char* end = data + len - sizeof(sum);
+    if ((size_t)(end - p) < hdr[0] * sizeof(int32_t)) return NULL;
+    Program* prog = program_new();
+    prog->code_len = (int)hdr[0];
+    prog->nvars = (int)hdr[2];
+    prog->code = (int32_t*)malloc((hdr[0] ? hdr[0] : 1) * sizeof(int32_t));
+    memcpy(prog->code, p, hdr[0] * sizeof(int32_t));
+    p += hdr[0] * sizeof(int32_t);
+    prog->consts = (Value*)malloc((hdr[1] ? hdr[1] : 1) * sizeof(Value));
+    for (uint32_t i=0;i<hdr[1];i++) {
+        if (p >= end) { program_free(prog); return NULL; }
+        char type = *p++;
+        if (type == VAL_INT) {
+            if ((size_t)(end - p) < sizeof(int64_t)) { program_free(prog); return NULL; }
+            int64_t v;
+            memcpy(&v, p, sizeof(v));
+            p += sizeof(v);
+            prog->consts[prog->nconsts++] = val_int(v);
+        } else {
+            uint32_t slen;
+            if ((size_t)(end - p) < sizeof(slen)) { program_free(prog); return NULL; }
+            memcpy(&slen, p, sizeof(slen));
+            p += sizeof(slen);
+            if ((size_t)(end - p) < slen) { program_free(prog); return NULL; }
+            Str* cs = str_new(p, slen);
+            cs->refs = STR_PINNED;
+            prog->consts[prog->nconsts++] = val_str(cs);
+            p += slen;
+        }
+    }
+    if (p != end || !program_verify(prog)) { program_free(prog); return NULL; }
+    return prog;
+}
+
+// ----- VM -----
+int shell_execute_line(const char* line);
+void installed_notepad(const char* filename);
+int task_tick();
+int task_killed();
+
+__thread int vm_depth = 0;
+
+Str* vm_read_file(const char* path) {
+    char name[MAX_NAME];
+    Directory* d = resolve_file(path, name, sizeof(name));
+    if (!d) return str_new("", 0);
+    dir_rdlock(d);
+    File* f = find_file(d, name);
+    Str* s;
+    if (f) {
+        char* text = file_flatten(f);
+        s = str_new(text, file_size(f));
+        free(text);
+    } else {
+        s = str_new("", 0);
+    }
+    dir_unlock(d);
+    return s;
+}
+
+Value vm_call(int fn, Value* args) {
+    switch (fn) {
+    case FN_LEN: { Str* s = val_to_str(args[0]); int64_t n = (int64_t)s->len; val_release(val_str(s)); return val_int(n); }
+    case FN_STR: return val_str(val_to_str(args[0]));
+    case FN_INT: return val_int(val_to_int(args[0]));
+    case FN_READ: { Str* p = val_to_str(args[0]); Str* s = vm_read_file(p->data); val_release(val_str(p)); return val_str(s); }
+    case FN_EXISTS: {
+        Str* p = val_to_str(args[0]);
+        char name[MAX_NAME];
+        Directory* d = resolve_parent(p->data, name, sizeof(name));
+        int found = 0;
+        if (d) {
+            dir_rdlock(d);
+            found = name[0] == '\0' || find_file(d, name) || find_subdir(d, name);
+            dir_unlock(d);
+        }
+        val_release(val_str(p));
+        return val_int(found);
+    }
+    case FN_INPUT: {
+        char* line = NULL;
+        size_t cap = 0;
+        ssize_t n = getline(&line, &cap, SHELL_IN);
+        if (n < 0) n = 0;
+        while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r')) n--;
+        Str* s = str_new(line ? line : "", (size_t)n);
+        free(line);
+        return val_str(s);
+    }
+    case FN_SUBSTR: {
+        Str* s = val_to_str(args[0]);
+        int64_t from = val_to_int(args[1]), n = val_to_int(args[2]);
+        if (from < 0) from = 0;
+        if (from > (int64_t)s->len) from = (int64_t)s->len;
+        if (n < 0 || from + n > (int64_t)s->len) n = (int64_t)s->len - from;
+        Str* r = str_new(s->data + from, (size_t)n);
+        val_release(val_str(s));
+        return val_str(r);
+    }
+    case FN_FIND: {
+        Str* s = val_to_str(args[0]);
+        Str* sub = val_to_str(args[1]);
+        char* hit = strstr(s->data, sub->data);
+        int64_t r = hit ? (int64_t)(hit - s->data) : -1;
+        val_release(val_str(s));
+        val_release(val_str(sub));
+        return val_int(r);
+    }
+    case FN_LINES: {
+        Str* s = val_to_str(args[0]);
+        int64_t n = 0;
+        for (size_t i=0;i<s->len;i++) if (s->data[i] == '\n') n++;
+        if (s->len && s->data[s->len-1] != '\n') n++;
+        val_release(val_str(s));
+        return val_int(n);
+    }
+    case FN_LINE: {
+        Str* s = val_to_str(args[0]);
+        int64_t want = val_to_int(args[1]);
+        const char* p = s->data;
+        for (int64_t i=0;i<want && p;i++) {
+            p = strchr(p, '\n');
+            if (p) p++;
+        }
+        Str* r = p ? str_new(p, strcspn(p, "\n")) : str_new("", 0);
+        val_release(val_str(s));
+        return val_str(r);
+    }
+    case FN_UPPER:
+    case FN_LOWER: {
+        Str* s = val_to_str(args[0]);
+        Str* r = str_new(s->data, s->len);
+        for (size_t i=0;i<r->len;i++) {
+            char ch = r->data[i];
+            if (fn == FN_UPPER && ch >= 'a' && ch <= 'z') r->data[i] = ch - 32;
+            if (fn == FN_LOWER && ch >= 'A' && ch <= 'Z') r->data[i] = ch + 32;
+        }
+        val_release(val_str(s));
+        return val_str(r);
+    }
+    case FN_REPLACE: {
+        Str* s = val_to_str(args[0]);
+        Str* from = val_to_str(args[1]);
+        Str* to = val_to_str(args[2]);
+        Content out = {0};
+        const char* p = s->data;
+        const char* hit;
+        while (from->len && (hit = strstr(p, from->data))) {
+            content_append(&out, p, (size_t)(hit - p));
+            content_append(&out, to->data, to->len);
+            p = hit + from->len;
+        }
+        content_append(&out, p, s->len - (size_t)(p - s->data));
+        char* flat = content_flatten(&out);
+        Str* r = str_new(flat, out.size);
+        free(flat);
+        content_free(&out);
+        val_release(val_str(s));
+        val_release(val_str(from));
+        val_release(val_str(to));
+        return val_str(r);
+    }
+    }
+    return val_int(0);
+}
+
+#define VM_PUSH(v) do { if (sp == VM_STACK) { err = "stack overflow"; goto fail; } stack[sp++] = (v); } while (0)
+
+// runs a compiled program; returns 0 after reporting a runtime error
+int vm_run(Program* p) {
+    if (vm_depth >= VM_MAX_DEPTH) { out_printf("Script error: apps nested too deeply.\n"); return 0; }
+    vm_depth++;
+    Value* vars = (Value*)calloc(p->nvars ? p->nvars : 1, sizeof(Value));
+    Value stack[VM_STACK];
+    int sp = 0;
+    const int32_t* code = p->code;
+    int pc = 0;
+    const char* err = NULL;
+    int ticks = VM_TICK;
+    for (;;) {
+        // a task gives up its turn now and then, and stops here when killed
+        if (--ticks == 0) {
+            ticks = VM_TICK;
+            if (task_tick()) goto done;
+        }
+        int32_t op = code[pc++];
+        switch (op) {
+        case OP_HALT:
+            goto done;
+        case OP_CONST: {
+            Value v = p->consts[code[pc++]];
+            if (v.type == VAL_STR) str_retain(v.s);
+            VM_PUSH(v);
+            break;
+        }
+        case OP_LOAD: {
+            Value v = vars[code[pc++]];
+            if (v.type == VAL_STR) str_retain(v.s);
+            VM_PUSH(v);
+            break;
+        }
+        case OP_STORE: {
+            int slot = code[pc++];
+            val_release(vars[slot]);
+            vars[slot] = stack[--sp];
+            break;
+        }
+        case OP_POP:
+            val_release(stack[--sp]);
+            break;
+        case OP_ADD: {
+            Value b = stack[--sp], a = stack[--sp];
+            // integers wrap around on overflow
+            if (a.type == VAL_INT && b.type == VAL_INT) { VM_PUSH(val_int((int64_t)((uint64_t)a.i + (uint64_t)b.i))); break; }
+            Str* sa = val_to_str(a);
+            Str* sb = val_to_str(b);
+            Str* r = (Str*)malloc(sizeof(Str) + sa->len + sb->len + 1);
+            r->refs = 1;
+            r->len = sa->len + sb->len;
+            memcpy(r->data, sa->data, sa->len);
+            memcpy(r->data + sa->len, sb->data, sb->len + 1);
+            val_release(val_str(sa)); val_release(val_str(sb));
+            val_release(a); val_release(b);
+            VM_PUSH(val_str(r));
+            break;
+        }
+        case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD: {
+            Value b = stack[--sp], a = stack[--sp];
+            int64_t x = val_to_int(a), y = val_to_int(b);
+            val_release(a); val_release(b);
+            if ((op == OP_DIV || op == OP_MOD) && y == 0) { err = "division by zero"; goto fail; }
+            // the one quotient that does not fit (and traps on x86, for % too)
+            if ((op == OP_DIV || op == OP_MOD) && y == -1 && x == INT64_MIN) { err = "integer overflow"; goto fail; }
+            uint64_t ux = (uint64_t)x, uy = (uint64_t)y;
+            VM_PUSH(val_int(op == OP_SUB ? (int64_t)(ux - uy) : op == OP_MUL ? (int64_t)(ux * uy) : op == OP_DIV ? x / y : x % y));
+            break;
+        }
+        case OP_NEG: {
+            Value a = stack[--sp];
+            int64_t x = val_to_int(a);
+            val_release(a);
+            VM_PUSH(val_int((int64_t)(0 - (uint64_t)x)));
+            break;
+        }
+        case OP_NOT: {
+            Value a = stack[--sp];
+            int t = val_truthy(a);
+            val_release(a);
+            VM_PUSH(val_int(!t));
+            break;
+        }
+        case OP_EQ: case OP_NE: case OP_LT: case OP_LE: case OP_GT: case OP_GE: {
+            Value b = stack[--sp], a = stack[--sp];
+            int cmp;
+            if (a.type == VAL_INT && b.type == VAL_INT) {
+                cmp = (a.i > b.i) - (a.i < b.i);
+            } else {
+                Str* sa = val_to_str(a);
+                Str* sb = val_to_str(b);
+                cmp = strcmp(sa->data, sb->data);
+                val_release(val_str(sa)); val_release(val_str(sb));
+            }
+            val_release(a); val_release(b);
+            int r = op == OP_EQ ? cmp == 0 : op == OP_NE ? cmp != 0 : op == OP_LT ? cmp < 0 :
+                    op == OP_LE ? cmp <= 0 : op == OP_GT ? cmp > 0 : cmp >= 0;
+            VM_PUSH(val_int(r));
+            break;
+        }
+        case OP_JMP:
+            pc = code[pc];
+            break;
+        case OP_JZ: {
+            Value a = stack[--sp];
+            int t = val_truthy(a);
+            val_release(a);
+            pc = t ? pc+1 : code[pc];
+            break;
+        }
+        case OP_JZ_KEEP:
+            pc = val_truthy(stack[sp-1]) ? pc+1 : code[pc];
+            break;
+        case OP_JNZ_KEEP:
+            pc = val_truthy(stack[sp-1]) ? code[pc] : pc+1;
+            break;
+        case OP_FOR_DONE: {
+            int64_t v = val_to_int(vars[code[pc]]), end = val_to_int(vars[code[pc+1]]), step = val_to_int(vars[code[pc+2]]);
+            int done = step >= 0 ? v > end : v < end;
+            pc = done ? code[pc+3] : pc+4;
+            break;
+        }
+        case OP_PRINT: {
+            int n = code[pc++];
+            for (int i=sp-n;i<sp;i++) {
+                Str* s = val_to_str(stack[i]);
+                if (i > sp-n) out_put(" ", 1);
+                out_put(s->data, s->len);
+                val_release(val_str(s));
+                val_release(stack[i]);
+            }
+            sp -= n;
+            out_write("\n", 1);
+            break;
+        }
+        case OP_CALL: {
+            int fn = code[pc++];
+            int argc = 0;
+            for (size_t i=0;i<sizeof(vm_funcs)/sizeof(vm_funcs[0]);i++) if (vm_funcs[i].id == fn) argc = vm_funcs[i].argc;
+            Value r = vm_call(fn, stack + sp - argc);
+            for (int i=sp-argc;i<sp;i++) val_release(stack[i]);
+            sp -= argc;
+            VM_PUSH(r);
+            break;
+        }
+        case OP_WRITE: case OP_APPEND: {
+            Value text = stack[--sp], path = stack[--sp];
+            Str* sp_ = val_to_str(path);
+            Str* st = val_to_str(text);
+            char name[MAX_NAME];
+            Directory* d = resolve_file(sp_->data, name, sizeof(name));
+            int ok = d != NULL, full = 0;
+            if (ok) {
+                Content body = {0};
+                if (op == OP_APPEND) {
+                    dir_rdlock(d);
+                    File* old = find_file(d, name);
+                    if (old) {
+                        char* prev = file_flatten(old);
+                        content_append(&body, prev, file_size(old));
+                        free(prev);
+                    }
+                    dir_unlock(d);
+                }
+                content_append(&body, st->data, st->len);
+                full = vfs_write_file_quota(d, name, &body) != NULL;
+            }
+            val_release(val_str(sp_)); val_release(val_str(st));
+            val_release(path); val_release(text);
+            if (!ok) { err = "no such directory"; goto fail; }
+            if (full) { err = "quota exceeded"; goto fail; }
+            break;
+        }
+        case OP_MKDIR: case OP_RM: case OP_SH: case OP_NOTEPAD: {
+            Value a = stack[--sp];
+            Str* s = val_to_str(a);
+            val_release(a);
+            if (op == OP_SH) {
+                shell_execute_line(s->data);
+            } else if (op == OP_NOTEPAD) {
+                installed_notepad(s->data);
+            } else {
+                char name[MAX_NAME];
+                Directory* d = op == OP_RM ? resolve_file(s->data, name, sizeof(name))
+                                           : resolve_parent(s->data, name, sizeof(name));
+                if (d && name[0] && op == OP_MKDIR) vfs_mkdir(d, name);
+                else if (d && op == OP_RM) vfs_rm(d, name);
+            }
+            val_release(val_str(s));
+            break;
+        }
+        default:
+            err = "bad opcode";
+            goto fail;
+        }
+    }
+fail:
+    out_printf("Script error: %s.\n", err);
+done:
+    while (sp > 0) val_release(stack[--sp]);
+    for (int i=0;i<p->nvars;i++) val_release(vars[i]);
+    free(vars);
+    vm_depth--;
+    return err == NULL;
+}
+
+// ---------- App system ----------
+// Installed apps are listed in /apps/index.savidx, one line per app:
+//   <name> TAB <manifest file> TAB <manifest size> TAB <description>
+// Startup registers apps from that index alone; an app's manifest is read,
+// and its CODE compiled (or loaded from the bytecode cache), the first time
+// it is run or shown by appinfo. install and uninstall rewrite the index. A
+// manifest missing from the index, or whose size no longer matches its
+// entry (it was rewritten by hand, restored, imported), is parsed at startup
+// as before and the index is written again.
+#define APP_INDEX_FILE "index.savidx"
+
+// returns NULL if an app with that name is already registered; a NULL code
+// is loaded from the manifest when first needed
+App* register_app(const char* name, const char* desc, const char* code, int builtin, const char* file) {
+    if (et_find(&app_table, name)) return NULL;
+    App* a = (App*)malloc(sizeof(App));
+    a->name = strdup(name);
+    a->desc = strdup(desc);
+    a->code = code ? strdup(code) : NULL;
+    a->file = file ? strdup(file) : NULL;
+    a->file_size = 0;
+    a->builtin = builtin;
+    a->compiled = 0;
+    a->prog = NULL;
+    a->running = 0;
+    a->orphaned = 0;
+    et_add(&app_table, a->name, a);
+    return a;
+}
+
+void free_app(App* a) {
+    free(a->name);
+    free(a->desc);
+    free(a->code);
+    free(a->file);
+    program_free(a->prog);
+    free(a);
+}
+
+// an app that has left the registry; a task still running it frees it when it ends
+void drop_app(App* a) {
+    if (__atomic_load_n(&a->running, __ATOMIC_ACQUIRE)) a->orphaned = 1;
+    else free_app(a);
+}
+
+int unregister_app(const char* name) {
+    App* a = (App*)et_remove(&app_table, name);
+    if (!a) return 0;
+    drop_app(a);
+    return 1;
+}
+
+// keeps only the builtins, in their original order
+void unregister_installed_apps() {
+    EntryTable kept = { .arena = &app_arena };
+    for (int i=0;i<app_table.used;i++) {
+        App* a = (App*)app_table.slots[i].node;
+        if (!a) continue;
+        if (a->builtin) et_add(&kept, a->name, a);
+        else drop_app(a);
+    }
+    et_free(&app_table);
+    app_table = kept;
+}
+
+void init_builtin_apps() {
+    register_app("calculator", "Calculator (expressions, functions, variables)", "BUILTIN_CALC", 1, NULL);
+    register_app("notepad", "Notepad (saves as a file in current dir)", "BUILTIN_NOTEPAD", 1, NULL);
+    register_app("numbergame", "Number Guess Game (1-100)", "BUILTIN_NUMBERGAME", 1, NULL);
+    register_app("about", "About GR4V1TYOS", "BUILTIN_ABOUT", 1, NULL);
+}
+
+// /apps/<package>.savbc for the manifest /apps/<package>.savapp
+void bytecode_cache_name(const char* manifest, char* buf, size_t n) {
+    snprintf(buf, n, "%s", manifest);
+    char* ext = strrchr(buf, '.');
+    if (ext) *ext = '\0';
+    strncat(buf, ".savbc", n-strlen(buf)-1);
+}
+
+// writes /apps/<package>.savbc for a compiled app; h is the hash of its code
+void app_cache_bytecode(Directory* appdir, App* a, uint64_t h) {
+    char cname[MAX_NAME+8];
+    bytecode_cache_name(a->file, cname, sizeof(cname));
+    Content body;
+    program_serialize(a->prog, h, &body);
+    vfs_write_file(appdir, cname, &body);
+}
+
+// loads the app's bytecode from its cache, or compiles the CODE block and
+// refreshes the cache when it is missing or was built from other source
+void app_compile(App* a) {
+    a->compiled = 1;
+    Directory* appdir = find_or_create_dir_by_path("/apps");
+    char cname[MAX_NAME+8];
+    bytecode_cache_name(a->file, cname, sizeof(cname));
+    uint64_t h = fnv1a64(a->code, strlen(a->code), FNV64_INIT);
+    dir_rdlock(appdir);
+    File* cf = find_file(appdir, cname);
+    if (cf) {
+        char* data = file_flatten(cf);
+        a->prog = program_deserialize(data, file_size(cf), h);
+        free(data);
+    }
+    dir_unlock(appdir);
+    if (a->prog) return;
+    char err[160];
+    a->prog = compile_program(a->code, err, sizeof(err));
+    if (!a->prog) { out_printf("App '%s' failed to compile: %s\n", a->name, err); return; }
+    app_cache_bytecode(appdir, a, h);
+}
+
+// splits a manifest in place into APP_NAME=, APP_DESC= and CODE= (CODE runs
+// until a line that is just ENDAPP); missing fields are left ""
+void parse_manifest(char* text, const char** name, const char** desc, const char** code) {
+    *name = *desc = *code = "";
+    char* p = text;
+    while (*p) {
+        char* eol = strchr(p, '\n');
+        char* next = eol ? eol+1 : p+strlen(p);
+        if (strncmp(p, "CODE=", 5) == 0) {
+            *code = p+5;
+            char* q = next;
+            while (*q) {
+                if (strncmp(q, "ENDAPP", 6) == 0 && (q[6] == '\n' || q[6] == '\r' || q[6] == '\0')) break;
+                char* e = strchr(q, '\n');
+                q = e ? e+1 : q+strlen(q);
+            }
+            *q = '\0';
+            break;
+        }
+        if (eol) *eol = '\0';
+        if (eol && eol > p && eol[-1] == '\r') eol[-1] = '\0';
+        if (strncmp(p, "APP_NAME=", 9) == 0) *name = p+9;
+        else if (strncmp(p, "APP_DESC=", 9) == 0) *desc = p+9;
+        p = next;
+    }
+}
+
+// a copy of the manifest's body, read under the /apps lock
+char* read_manifest(Directory* appdir, const char* file, size_t* size) {
+    dir_rdlock(appdir);
+    File* f = find_file(appdir, file);
+    char* text = f ? file_flatten(f) : NULL;
+    if (f) *size = file_size(f);
+    dir_unlock(appdir);
+    return text;
+}
+
+// registers the app a manifest describes, code included; NULL if the
+// manifest has no name or the name is taken
+App* register_app_from_manifest(Directory* appdir, const char* file) {
+    size_t size = 0;
+    char* text = read_manifest(appdir, file, &size);
+    if (!text) return NULL;
+    const char *name, *desc, *code;
+    parse_manifest(text, &name, &desc, &code);
+    App* a = NULL;
+    if (strlen(name)>0) a = register_app(name, desc, code, 0, file);
+    if (a) a->file_size = size;
+    free(text);
+    return a;
+}
+
+// makes sure an installed app's code is loaded and compiled; 0 if its
+// manifest has gone. The caller holds the registry at least shared.
+int app_load(App* a) {
+    if (a->builtin) return 1;
+    if (server_mode) pthread_mutex_lock(&app_load_mutex);
+    if (!a->code) {
+        Directory* appdir = find_or_create_dir_by_path("/apps");
+        size_t size = 0;
+        char* text = read_manifest(appdir, a->file, &size);
+        if (text) {
+            const char *name, *desc, *code;
+            parse_manifest(text, &name, &desc, &code);
+            a->code = strdup(code);
+            free(text);
+        }
+    }
+    if (a->code && !a->compiled) app_compile(a);
+    if (server_mode) pthread_mutex_unlock(&app_load_mutex);
+    return a->code != NULL;
+}
+
+// rewrites /apps/index.savidx from the registry; the caller holds it exclusively
+void write_app_index(Directory* appdir) {
+    Content body = {0};
+    char line[512];
+    for (int i=0;i<app_table.used;i++) {
+        App* a = (App*)app_table.slots[i].node;
+        if (!a || a->builtin) continue;
+        // an entry that would not parse back is left out; its manifest is read at every start instead
+        if (strpbrk(a->name, "\t\r\n") || strpbrk(a->desc, "\t\r\n")) continue;
+        int n = snprintf(line, sizeof(line), "%s\t%s\t%zu\t%s\n", a->name, a->file, a->file_size, a->desc);
+        if (n > 0 && (size_t)n < sizeof(line)) content_append(&body, line, (size_t)n);
+    }
+    char* old = NULL;
+    size_t old_size = 0;
+    if (dir_has_file(appdir, APP_INDEX_FILE)) old = read_manifest(appdir, APP_INDEX_FILE, &old_size);
+    if (old && content_equals(&body, old, old_size)) content_free(&body);
+    else vfs_write_file(appdir, APP_INDEX_FILE, &body);
+    free(old);
+}
+
+// registers the installed apps from the index, reading only the manifests it
+// does not describe; the caller holds the registry exclusively
+void load_installed_apps_from_vfs() {
+    Directory* appdir = find_or_create_dir_by_path("/apps");
+    size_t size = 0;
+    char* index = dir_has_file(appdir, APP_INDEX_FILE) ? read_manifest(appdir, APP_INDEX_FILE, &size) : NULL;
+    // manifest file -> its index line, split in place into name, size and desc
+    EntryTable byfile = { .arena = &app_arena };
+    int listed = 0, stale = (index == NULL), had_index = (index != NULL);
+    for (char* p = index; p && *p;) {
+        char* eol = strchr(p, '\n');
+        if (!eol) break;
+        *eol = '\0';
+        char* file = strchr(p, '\t');
+        char* fsize = file ? strchr(file+1, '\t') : NULL;
+        char* desc = fsize ? strchr(fsize+1, '\t') : NULL;
+        if (desc) {
+            *file++ = *fsize++ = *desc = '\0';
+            if (!et_find(&byfile, file)) { et_add(&byfile, file, p); listed++; }
+        } else {
+            stale = 1;
+        }
+        p = eol+1;
+    }
+    dir_rdlock(appdir);
+    int nfiles = appdir->files.used;
+    char** names = (char**)malloc((nfiles ? nfiles : 1) * sizeof(char*));
+    size_t* sizes = (size_t*)malloc((nfiles ? nfiles : 1) * sizeof(size_t));
+    int n = 0;
+    for (int i=0;i<nfiles;i++) {
+        File* f = (File*)appdir->files.slots[i].node;
+        if (!f) continue;
+        // consider files ending in .savapp
+        const char* ext = strrchr(f->name, '.');
+        if (!ext || strcmp(ext, ".savapp") != 0) continue;
+        names[n] = strdup(f->name);
+        sizes[n++] = file_size(f);
+    }
+    dir_unlock(appdir);
+    for (int i=0;i<n;i++) {
+        char* entry = (char*)et_find(&byfile, names[i]);
+        if (entry) {
+            listed--;
+            char* fsize = entry + strlen(entry) + 1 + strlen(names[i]) + 1;
+            char* desc = fsize + strlen(fsize) + 1;
+            if (strtoull(fsize, NULL, 10) == sizes[i]) {
+                App* a = register_app(entry, desc, NULL, 0, names[i]);
+                if (a) a->file_size = sizes[i];
+                free(names[i]);
+                continue;
+            }
+        }
+        stale = 1;
+        register_app_from_manifest(appdir, names[i]);
+        free(names[i]);
+    }
+    // entries for manifests that are gone
+    if (listed > 0) stale = 1;
+    et_free(&byfile);
+    free(names);
+    free(sizes);
+    free(index);
+    if (stale && (n > 0 || had_index)) write_app_index(appdir);
+}
+
+void show_apps_command() {
+    apps_rdlock();
+    out_printf("Installed and built-in apps:\n");
+    for (int i=0;i<app_table.used;i++) {
+        App* a = (App*)app_table.slots[i].node;
+        if (a) out_printf("  %s - %s%s\n", a->name, a->desc, a->builtin ? " [built-in]" : "");
+    }
+    apps_unlock();
+}
+
+// one line of statements, with variables of its own (see Calculator)
+void app_builtin_calculator() {
+    out_printf("Calculator - enter an expression (e.g. (5 + 3) * sqrt(2), or r = 2; pi * r^2)\n");
+    char* line = NULL;
+    size_t cap = 0;
+    if (getline(&line, &cap, SHELL_IN) < 0) { free(line); return; } // input ended, or the task was killed
+    CalcVars vars;
+    vars.n = 0;
+    char err[96];
+    if (!calc_line(line, &vars, "Result: ", err, sizeof(err))) out_printf("Invalid input: %s.\n", err);
+    free(line);
+}
+
+void app_builtin_notepad() {
+    char filename[128];
+    out_printf("Notepad - enter filename to save in current directory: ");
+    if (fscanf(SHELL_IN, "%127s", filename) != 1) return; // input ended, or the task was killed
+    // consume leftover newline
+    int c = fgetc(SHELL_IN);
+    if (c != '\n' && c != EOF) ungetc(c, SHELL_IN);
+    out_printf("Enter text lines. Type 'END' on its own line to finish.\n");
+    Content body = {0};
+    read_text_block(&body, "END");
+    if (task_killed()) { content_free(&body); return; } // a killed notepad saves nothing
+    // if file with same name exists in current_dir, overwrite
+    int exists = dir_has_file(current_dir, filename);
+    Directory* q = vfs_write_file_quota(current_dir, filename, &body);
+    if (q) { quota_error(q); return; }
+    out_printf("File '%s' %s.\n", filename, exists ? "overwritten" : "saved");
+}
+
+void app_builtin_numbergame() {
+    srand((unsigned)time(NULL));
+    int target = rand()%100 + 1;
+    int guess = 0;
+    int tries = 0;
+    out_printf("Number Guess Game! Guess a number from 1 to 100.\n");
+    while (1) {
+        out_printf("Enter guess: ");
+        int ok = fscanf(SHELL_IN, "%d", &guess) == 1;
+        skip_rest_of_line();
+        if (!ok) { if (feof(SHELL_IN)) return; out_printf("Invalid. Try again.\n"); continue; }
+        tries++;
+        if (guess > target) out_printf("Too high!\n");
+        else if (guess < target) out_printf("Too low!\n");
+        else { out_printf("Correct! You took %d tries.\n", tries); break; }
+    }
+}
+
+void app_builtin_about() {
+    out_printf("GR4V1TYOS Virtual Shell v4.0\n");
+    out_printf("Features: Virtual filesystem, autosave, app library, app install/uninstall, wipe, rmdir, notepad, calculator, number game.\n");
+    out_printf("All operations are sandboxed in the virtual filesystem.\n");
+}
+
+// the SCRIPT:NOTEPAD app: interactive text saved to 'filename' in the current dir
+void installed_notepad(const char* filename) {
+    if (strlen(filename)==0 || strlen(filename) >= MAX_NAME) { out_printf("Installed notepad missing filename.\n"); return; }
+    out_printf("Installed notepad saving to '%s' in current directory.\n", filename);
+    out_printf("Enter text lines. Type 'END' on its own line to finish.\n");
+    Content body = {0};
+    read_text_block(&body, "END");
+    if (task_killed()) { content_free(&body); return; } // a killed notepad saves nothing
+    int exists = dir_has_file(current_dir, filename);
+    Directory* q = vfs_write_file_quota(current_dir, filename, &body);
+    if (q) { quota_error(q); return; }
+    out_printf("File '%s' %s.\n", filename, exists ? "overwritten" : "saved");
+}
+
+App* find_app_by_name(const char* name) {
+    return (App*)et_find(&app_table, name);
+}
+
+// finds an app and keeps it from being freed until app_release, even if it
+// is uninstalled meanwhile; NULL if there is no such app
+App* app_acquire(const char* name) {
+    apps_rdlock();
+    App* a = find_app_by_name(name);
+    if (a) __atomic_add_fetch(&a->running, 1, __ATOMIC_RELAXED);
+    apps_unlock();
+    return a;
+}
+
+// the caller holds the registry at least shared
+void app_release(App* a) {
+    if (__atomic_sub_fetch(&a->running, 1, __ATOMIC_ACQ_REL) == 0 && a->orphaned) free_app(a);
+}
+
+// runs an app to its end on this thread; the caller holds the registry at least shared
+void run_app(App* a) {
+    if (a->builtin) {
+        if (strcmp(a->code, "BUILTIN_CALC")==0) app_builtin_calculator();
+        else if (strcmp(a->code, "BUILTIN_NOTEPAD")==0) app_builtin_notepad();
+        else if (strcmp(a->code, "BUILTIN_NUMBERGAME")==0) app_builtin_numbergame();
+        else if (strcmp(a->code, "BUILTIN_ABOUT")==0) app_builtin_about();
+        else out_printf("Builtin app stub.\n");
+    } else if (!app_load(a)) {
+        shell_error("App '%s' has lost its manifest /apps/%s.\n", a->name, a->file);
+    } else if (!a->prog) {
+        shell_error("App '%s' did not compile; see 'appinfo %s'.\n", a->name, a->name);
+    } else {
+        if (!vm_run(a->prog)) shell_status = 1;
+    }
+}
+
+void uninstall_app_command(const char* appname) {
+    apps_wrlock();
+    App* a = find_app_by_name(appname);
+    if (!a || a->builtin) { apps_unlock(); shell_error("Installed app '%s' not found.\n", appname); return; }
+    // the registry remembers which manifest the app came from
+    Directory* appdir = find_or_create_dir_by_path("/apps");
+    vfs_rm(appdir, a->file);
+    char cname[MAX_NAME+8];
+    bytecode_cache_name(a->file, cname, sizeof(cname));
+    vfs_rm(appdir, cname);
+    unregister_app(appname);
+    write_app_index(appdir);
+    apps_unlock();
+    out_printf("App '%s' uninstalled.\n", appname);
+}
+
+void appinfo_command(const char* appname) {
+    apps_rdlock();
+    App* a = find_app_by_name(appname);
+    if (!a) { apps_unlock(); shell_error("App not found.\n"); return; }
+    out_printf("Name: %s\nDesc: %s\nType: %s\n", a->name, a->desc, a->builtin ? "built-in":"installed");
+    if (!a->builtin && !app_load(a)) {
+        out_printf("Code: manifest /apps/%s is missing\n", a->file);
+    } else if (!a->builtin) {
+        out_printf("Code preview:\n%s\n", a->code);
+        if (a->prog) out_printf("Bytecode: %d words, %d constants, %d variables\n", a->prog->code_len, a->prog->nconsts, a->prog->nvars);
+        else {
+            char err[160];
+            Program* p = compile_program(a->code, err, sizeof(err));
+            if (p) snprintf(err, sizeof(err), "not compiled");
+            program_free(p);
+            out_printf("Bytecode: none (%s)\n", err);
+        }
+    }
+    apps_unlock();
+}
+
+// ---------- Tasks ----------
+// 'run' starts an app as a task: a thread of its own that takes turns with the
+// shell that started it, so only one of them runs at a time (a coroutine with
+// an OS thread under it) and the single-user shell stays free of locks. A task
+// has its own input, current directory and VM. The foreground task reads the
+// lines the shell hands it; a background one reads only the file it was given
+// with '<', and waits in state "input" when it wants more. Scripts give up
+// their turn every TASK_SLICE_NS, so background tasks share the CPU with the
+// foreground one and with a shell waiting at its prompt. Ctrl-Z on a terminal
+// stops the foreground task; ps, fg, bg and kill manage the rest. Server mode:
+// every session has its own tasks, and a task holds tree_lock and app_lock
+// shared during its turns, never while it waits.
+#define TASK_SLICE_NS (10*1000*1000)
+
+enum { TASK_RUNNING, TASK_INPUT, TASK_STOPPED, TASK_DONE };
+const char* task_state_names[] = { "running", "input", "stopped", "done" };
+
+typedef struct Task {
+    int id; // job number, per shell
+    int bg; // started with '&', or stopped since
+    char* name;
+    App* app;
+    pthread_t thread;
+    int state; // TASK_*; changed by whichever side has the turn
+    int turn; // 1 while the task runs and its shell waits
+    int killed;
+    int status; // the task's shell_status, once it is done
+    Directory* start_dir;
+    Directory** cwd; // the task thread's current_dir; NULL once it has ended
+    Directory** owner_cwd; // its shell's
+    OutBuf* out; // its shell's
+    char* in; // input handed over and not read yet
+    size_t in_len, in_pos;
+    int in_eof; // nothing follows what is in 'in'
+    uint64_t cpu_ns;
+    uint64_t slice_start;
+    pthread_cond_t cond;
+    struct Task* next; // this shell's tasks, by job number
+    struct Task* all_next; // every shell's, under task_mutex
+} Task;
+
+Task* all_tasks = NULL;
+pthread_mutex_t task_mutex = PTHREAD_MUTEX_INITIALIZER; // all_tasks and every turn
+__thread Task* task_list = NULL; // this shell's
+__thread Task* task_fg = NULL;
+__thread Task* task_self = NULL; // the task this thread runs, if it is one
+int task_stop_requested = 0; // Ctrl-Z (atomic)
+
+void task_stop_signal(int sig) {
+    (void)sig;
+    __atomic_store_n(&task_stop_requested, 1, __ATOMIC_RELAXED);
+}
+
+int task_stop_pending() {
+    return __atomic_load_n(&task_stop_requested, __ATOMIC_RELAXED);
+}
+
+// the task side: hands the turn back to the shell in 'state' and waits for the next one
+void task_yield(int state) {
+    Task* t = task_self;
+    apps_unlock();
+    tree_unlock();
+    pthread_mutex_lock(&task_mutex);
+    t->state = state;
+    t->turn = 0;
+    pthread_cond_broadcast(&t->cond);
+    while (!t->turn) pthread_cond_wait(&t->cond, &task_mutex);
+    pthread_mutex_unlock(&task_mutex);
+    tree_rdlock();
+    apps_rdlock();
+    t->state = TASK_RUNNING;
+    t->slice_start = stat_now_ns();
+    // a killed task winds down without anyone seeing its output
+    if (t->killed && shell_out == t->out) shell_out = outbuf_new(-1);
+}
+
+// the VM calls this every VM_TICK instructions: a task whose slice is used up,
+// or that Ctrl-Z stopped, yields; returns 1 once the task has been killed
+int task_tick() {
+    Task* t = task_self;
+    if (!t) return 0;
+    if (!t->killed && (task_stop_pending() || stat_now_ns() - t->slice_start >= TASK_SLICE_NS)) task_yield(TASK_RUNNING);
+    return t->killed;
+}
+
+int task_killed() {
+    return task_self && task_self->killed;
+}
+
+// the task's input stream: what its shell handed over, waiting for more when
+// that runs out; a killed task reads end of file
+ssize_t task_input_read(void* cookie, char* buf, size_t size) {
+    Task* t = (Task*)cookie;
+    while (t->in_pos == t->in_len && !t->in_eof && !t->killed) task_yield(TASK_INPUT);
+    if (t->killed || t->in_pos == t->in_len) return 0;
+    size_t n = t->in_len - t->in_pos;
+    if (n > size) n = size;
+    memcpy(buf, t->in + t->in_pos, n);
+    t->in_pos += n;
+    return (ssize_t)n;
+}
+
+void* task_main(void* arg) {
+    Task* t = (Task*)arg;
+    task_self = t;
+    current_dir = t->start_dir;
+    shell_out = t->out;
+    cookie_io_functions_t io = { .read = task_input_read };
+    shell_in = fopencookie(t, "r", io);
+    pthread_mutex_lock(&task_mutex);
+    if (!shell_in) t->killed = 1;
+    t->cwd = &current_dir;
+    pthread_cond_broadcast(&t->cond);
+    while (!t->turn) pthread_cond_wait(&t->cond, &task_mutex);
+    pthread_mutex_unlock(&task_mutex);
+    tree_rdlock();
+    apps_rdlock();
+    t->slice_start = stat_now_ns();
+    if (!t->killed) run_app(t->app);
+    app_release(t->app);
+    apps_unlock();
+    tree_unlock();
+    t->status = shell_status;
+    if (shell_in) fclose(shell_in);
+    if (shell_out != t->out) free(shell_out);
+    pthread_mutex_lock(&task_mutex);
+    t->cwd = NULL;
+    t->state = TASK_DONE;
+    t->turn = 0;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&task_mutex);
+    return NULL;
+}
+
+// the shell side: lets the task run until it yields or ends
+void task_turn(Task* t) {
+    uint64_t t0 = stat_now_ns();
+    pthread_mutex_lock(&task_mutex);
+    t->turn = 1;
+    pthread_cond_broadcast(&t->cond);
+    while (t->turn) pthread_cond_wait(&t->cond, &task_mutex);
+    pthread_mutex_unlock(&task_mutex);
+    t->cpu_ns += stat_now_ns() - t0;
+}
+
+// appends to a task's input while it waits
+void task_feed(Task* t, const char* data, size_t len) {
+    size_t left = t->in_len - t->in_pos;
+    if (left) memmove(t->in, t->in + t->in_pos, left);
+    t->in = (char*)realloc(t->in, left + len + 1);
+    memcpy(t->in + left, data, len);
+    t->in_pos = 0;
+    t->in_len = left + len;
+}
+
+// starts an app as a task of this shell, in the foreground unless 'bg'; a
+// malloc'd 'input' is all the task will read, NULL gives it the shell's lines
+void task_spawn(const char* name, char* input, size_t len, int bg) {
+    App* a = app_acquire(name);
+    if (!a) { free(input); shell_error("App '%s' not found.\n", name); return; }
+    Task* t = (Task*)calloc(1, sizeof(Task));
+    t->name = strdup(a->name);
+    t->app = a;
+    t->bg = bg;
+    t->start_dir = current_dir;
+    t->owner_cwd = &current_dir;
+    t->out = out_current();
+    t->in = input;
+    t->in_len = len;
+    t->in_eof = (input != NULL);
+    pthread_cond_init(&t->cond, NULL);
+    // Ctrl-Z goes to the shell thread, whose read it interrupts
+    sigset_t tstp, old;
+    sigemptyset(&tstp);
+    sigaddset(&tstp, SIGTSTP);
+    pthread_sigmask(SIG_BLOCK, &tstp, &old);
+    int err = pthread_create(&t->thread, NULL, task_main, t);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        apps_rdlock();
+        app_release(a);
+        apps_unlock();
+        shell_error("App '%s' could not be started.\n", t->name);
+        pthread_cond_destroy(&t->cond);
+        free(t->name);
+        free(t->in);
+        free(t);
+        return;
+    }
+    pthread_mutex_lock(&task_mutex);
+    while (!t->cwd) pthread_cond_wait(&t->cond, &task_mutex);
+    t->all_next = all_tasks;
+    all_tasks = t;
+    pthread_mutex_unlock(&task_mutex);
+    Task** p = &task_list;
+    while (*p) { t->id = (*p)->id; p = &(*p)->next; }
+    t->id++;
+    *p = t;
+    if (bg) out_printf("[%d] %s\n", t->id, t->name);
+    else task_fg = t;
+}
+
+void task_free(Task* t) {
+    pthread_mutex_lock(&task_mutex);
+    for (Task** p = &all_tasks; *p; p = &(*p)->all_next) {
+        if (*p == t) { *p = t->all_next; break; }
+    }
+    pthread_mutex_unlock(&task_mutex);
+    pthread_join(t->thread, NULL);
+    pthread_cond_destroy(&t->cond);
+    free(t->name);
+    free(t->in);
+    free(t);
+}
+
+// a background task that wants a turn: running, or killed and not wound down yet
+int task_runnable(Task* t) {
+    return t != task_fg && t->state != TASK_DONE && (t->killed || t->state == TASK_RUNNING);
+}
+
+// one turn for each of this shell's background tasks that can run; killed
+// ones run until they have ended
+void tasks_background() {
+    if (!task_fg) __atomic_store_n(&task_stop_requested, 0, __ATOMIC_RELAXED); // nothing for Ctrl-Z to stop
+    for (Task* t = task_list; t; t = t->next) {
+        if (!task_runnable(t)) continue;
+        do task_turn(t); while (t->killed && t->state != TASK_DONE);
+    }
+}
+
+int tasks_runnable() {
+    for (Task* t = task_list; t; t = t->next) if (task_runnable(t)) return 1;
+    return 0;
+}
+
+// whether reading 'in' would return at once: stdio holds buffered bytes (glibc
+// keeps them between _IO_read_ptr and _IO_read_end) or the descriptor has some
+int input_ready(FILE* in) {
+#ifdef __GLIBC__
+    if (in->_IO_read_ptr < in->_IO_read_end) return 1;
+    struct pollfd p = { fileno(in), POLLIN, 0 };
+    return poll(&p, 1, 0) != 0;
+#else
+    (void)in;
+    return 1;
+#endif
+}
+
+// the shell's next input line; background tasks take turns until one has
+// arrived. -1 at the end of the input, -2 when Ctrl-Z interrupted the wait
+ssize_t shell_getline(char** line, size_t* cap) {
+    FILE* in = SHELL_IN;
+    while (!task_stop_pending() && tasks_runnable() && !input_ready(in)) {
+        tasks_background();
+        if (!batch_mode) out_flush();
+    }
+    if (task_stop_pending()) return -2;
+    ssize_t n = getline(line, cap, in);
+    if (n < 0 && ferror(in) && errno == EINTR) { clearerr(in); return -2; }
+    return n;
+}
+
+// after every command: runs the foreground task, handing it the shell's input
+// lines, until it ends or Ctrl-Z stops it, gives the background tasks a turn
+// and reports the ones that have ended
+void tasks_run() {
+    Task* t;
+    while ((t = task_fg)) {
+        if (t->state == TASK_DONE) { task_fg = NULL; break; }
+        if (t->state == TASK_INPUT && !t->in_eof && !task_stop_pending()) {
+            char* line = NULL;
+            size_t cap = 0;
+            ssize_t n = shell_getline(&line, &cap);
+            if (n >= 0) task_feed(t, line, (size_t)n);
+            else if (n == -1) t->in_eof = 1;
+            free(line);
+        }
+        if (task_stop_pending()) {
+            __atomic_store_n(&task_stop_requested, 0, __ATOMIC_RELAXED);
+            t->state = TASK_STOPPED;
+            t->bg = 1;
+            task_fg = NULL;
+            out_printf("\n[%d] Stopped %s\n", t->id, t->name);
+            break;
+        }
+        task_turn(t);
+        if (t->state != TASK_DONE) tasks_background();
+    }
+    tasks_background();
+    for (Task** p = &task_list; *p;) {
+        t = *p;
+        if (t->state != TASK_DONE) { p = &t->next; continue; }
+        *p = t->next;
+        if (t->bg) out_printf("[%d] %s %s\n", t->id, t->killed ? "Killed" : "Done", t->name);
+        else if (t->status) shell_status = 1;
+        task_free(t);
+    }
+}
+
+// the shell is leaving: its tasks are killed and wound down
+void tasks_end() {
+    task_fg = NULL;
+    for (Task* t = task_list; t; t = t->next) t->killed = 1;
+    tasks_background();
+    while (task_list) {
+        Task* t = task_list;
+        task_list = t->next;
+        task_free(t);
+    }
+}
+
+// 'run' from inside an app, and bench.c: the app runs right here; a task's
+// turn already holds the registry shared, anyone else holds it for the run
+void run_app_command(const char* name) {
+    App* a = app_acquire(name);
+    if (!a) { shell_error("App '%s' not found.\n", name); return; }
+    if (!task_self) apps_rdlock();
+    run_app(a);
+    app_release(a);
+    if (!task_self) apps_unlock();
+}
+
+// run <app> [< file] [&]
+void cmd_run(const char* line) {
+    char app[256], w1[8] = "", file[1024] = "", w3[8] = "";
+    int n = sscanf(line, "%*s %255s %7s %1023s %7s", app, w1, file, w3);
+    int bg = (n == 2 && strcmp(w1, "&") == 0) || (n == 4 && strcmp(w3, "&") == 0);
+    int redirect = (n >= 3 && strcmp(w1, "<") == 0);
+    if (n > 1 && !bg && !(redirect && n == 3)) { shell_error("usage: run <app> [< file] [&]\n"); return; }
+    if (task_self || vm_depth > 0) {
+        // an app's own 'run' finishes before the app goes on
+        if (n > 1) { shell_error("Apps can only run other apps in the foreground.\n"); return; }
+        run_app_command(app);
+        return;
+    }
+    char* input = NULL;
+    size_t len = 0;
+    if (redirect) {
+        char name[MAX_NAME];
+        Directory* d = resolve_file(file, name, sizeof(name));
+        if (!d) { path_fail(file, "File not found."); return; }
+        dir_rdlock(d);
+        File* f = find_file(d, name);
+        if (f) { input = file_flatten(f); len = file_size(f); }
+        dir_unlock(d);
+        if (!f) { shell_error("File not found.\n"); return; }
+    }
+    task_spawn(app, input, len, bg);
+}
+
+void cmd_ps() {
+    if (!task_list) { out_printf("No tasks.\n"); return; }
+    out_printf("  ID  STATE      CPU ms  APP              DIR\n");
+    for (Task* t = task_list; t; t = t->next) {
+        out_printf("%4d  %-8s %8.0f  %-16s %s\n", t->id, task_state_names[t->state], t->cpu_ns / 1e6,
+                   t->name, t->cwd ? (*t->cwd)->path : "-");
+    }
+}
+
+// the task 'arg' names by number ("2" or "%2"); without one, the newest task
+// in 'state', or the newest at all for -1
+Task* task_pick(const char* arg, int state) {
+    Task* hit = NULL;
+    if (arg) {
+        char* end;
+        long id = strtol(arg + (arg[0] == '%'), &end, 10);
+        for (Task* t = task_list; t && *end == '\0'; t = t->next) if (t->id == id) hit = t;
+        if (!hit) shell_error("Task %s not found.\n", arg);
+        return hit;
+    }
+    for (Task* t = task_list; t; t = t->next) if (state < 0 || t->state == state) hit = t;
+    if (!hit) shell_error(state < 0 ? "No tasks.\n" : "No stopped tasks.\n");
+    return hit;
+}
+
+// the task runs in the foreground once this command returns, see tasks_run
+void cmd_fg(const char* arg) {
+    Task* t = task_pick(arg, -1);
+    if (!t) return;
+    if (t->state == TASK_STOPPED) t->state = TASK_RUNNING;
+    t->bg = 0;
+    task_fg = t;
+    out_printf("%s\n", t->name);
+}
+
+void cmd_bg(const char* arg) {
+    Task* t = task_pick(arg, TASK_STOPPED);
+    if (!t) return;
+    if (t->state == TASK_STOPPED) t->state = TASK_RUNNING;
+    out_printf("[%d] %s &\n", t->id, t->name);
+}
+
+// the task winds down once this command returns, see tasks_run
+void cmd_kill(const char* arg) {
+    Task* t = task_pick(arg, -1);
+    if (t && t->state != TASK_DONE) t->killed = 1;
+}
+
+// ---------- Package repository ----------
+// 'install' takes packages from a local repository: the host directory
+// PACKAGE_DIR holds one archive per package, <package>.savapp (an app
+// manifest), and catalog.txt lists them, one line each:
+//   <package> TAB <description>
+// The catalog is held in a table and read again only when the directory
+// changes; if it is missing or older than the directory it is rebuilt from
+// the archives' APP_DESC lines and written back when the directory allows.
+// The packages built into the kernel are always available unless an archive
+// of the same name replaces them.
+// 'install a b c' and 'install --all' are one transaction: every name is
+// checked before anything is installed, the archives are read, parsed and
+// compiled on a worker pool, and only then are the manifests and bytecode
+// caches written, the apps registered and /apps/index.savidx rewritten, once.
+#define PACKAGE_DIR "packages"
+#define PACKAGE_CATALOG "catalog.txt"
+#define PACKAGES_PER_THREAD 4 // fewer packages than this per worker are not worth a thread
+
+typedef struct Package {
+    char* name;
+    char* desc;
+    const char* manifest; // a builtin package's manifest; NULL: read <name>.savapp from the repository
+} Package;
+
+const char* builtin_packages[][3] = {
+    { "hello", "Simple Hello App",
+      "APP_NAME=hello\nAPP_DESC=Simple Hello App\nCODE=PRINT:Hello from installed Hello App!\nENDAPP\n" },
+    { "simple-notepad", "Simple installed notepad (saves to given filename)",
+      "APP_NAME=snotepad\nAPP_DESC=Simple installed notepad (saves to given filename)\nCODE=SCRIPT:NOTEPAD default_note.txt\nENDAPP\n" },
+    { "counter", "Counts lines and words of a file",
+      "APP_NAME=counter\nAPP_DESC=Counts lines and words of a file\nCODE=\n"
+      "print \"File to count:\"\n"
+      "name = input()\n"
+      "if not exists(name)\n"
+      "    print \"No such file:\", name\n"
+      "else\n"
+      "    text = read(name)\n"
+      "    words = 0\n"
+      "    inword = 0\n"
+      "    for i = 0 to len(text) - 1\n"
+      "        ch = substr(text, i, 1)\n"
+      "        if ch == \" \" or ch == \"\\n\" or ch == \"\\t\"\n"
+      "            inword = 0\n"
+      "        elif not inword\n"
+      "            inword = 1\n"
+      "            words = words + 1\n"
+      "        end\n"
+      "    end\n"
+      "    print name + \":\", lines(text), \"lines,\", words, \"words,\", len(text), \"bytes\"\n"
+      "end\n"
+      "ENDAPP\n" },
+};
+#define BUILTIN_PACKAGES (int)(sizeof(builtin_packages)/sizeof(builtin_packages[0]))
+
+const char* package_dir = PACKAGE_DIR;
+// package name -> Package*, builtins first, then the repository's by name;
+// guarded by the app registry lock, held exclusively
+EntryTable catalog = { .arena = &app_arena };
+int catalog_loaded = 0;
+struct timespec catalog_mtime; // of package_dir when the catalog was read
+
+void catalog_add(const char* name, const char* desc, const char* manifest) {
+    Package* p = (Package*)et_remove(&catalog, name);
+    if (p) { free(p->name); free(p->desc); free(p); }
+    p = (Package*)malloc(sizeof(Package));
+    p->name = strdup(name);
+    p->desc = strdup(desc);
+    p->manifest = manifest;
+    et_add(&catalog, p->name, p);
+}
+
+void catalog_clear() {
+    for (int i=0;i<catalog.used;i++) {
+        Package* p = (Package*)catalog.slots[i].node;
+        if (p) { free(p->name); free(p->desc); free(p); }
+    }
+    et_free(&catalog);
+    catalog_loaded = 0;
+}
+
+int cmp_cstr(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// the APP_DESC of a package archive, from the lines before its CODE
+void archive_desc(const char* path, char* desc, size_t n) {
+    desc[0] = '\0';
+    FILE* f = fopen(path, "r");
+    if (!f) return;
+    char line[512];
+    while (fgets(line, sizeof(line), f) && strncmp(line, "CODE=", 5) != 0) {
+        if (strncmp(line, "APP_DESC=", 9) != 0) continue;
+        line[strcspn(line, "\r\n")] = '\0';
+        snprintf(desc, n, "%s", line+9);
+        break;
+    }
+    fclose(f);
+}
+
+// scans the archives in the repository and writes catalog.txt for next time
+void catalog_scan(const char* catpath) {
+    DIR* dir = opendir(package_dir);
+    if (!dir) return;
+    char** names = NULL;
+    int n = 0, cap = 0;
+    struct dirent* de;
+    while ((de = readdir(dir))) {
+        size_t len = strlen(de->d_name);
+        if (len <= 7 || strcmp(de->d_name + len - 7, ".savapp") != 0 || len - 7 >= MAX_NAME - 7) continue;
+        if (n == cap) {
+            cap = cap ? cap*2 : 64;
+            names = (char**)realloc(names, cap * sizeof(char*));
+        }
+        names[n++] = strndup(de->d_name, len - 7);
+    }
+    closedir(dir);
+    if (n) qsort(names, n, sizeof(char*), cmp_cstr);
+    FILE* out = fopen(catpath, "w");
+    for (int i=0;i<n;i++) {
+        char path[1024], desc[256];
+        snprintf(path, sizeof(path), "%s/%s.savapp", package_dir, names[i]);
+        archive_desc(path, desc, sizeof(desc));
+        catalog_add(names[i], desc, NULL);
+        if (out) fprintf(out, "%s\t%s\n", names[i], desc);
+        free(names[i]);
+    }
+    if (out) fclose(out);
+    free(names);
+}
+
+// brings the catalog up to date with the repository; one stat when nothing changed
+void catalog_refresh() {
+    struct stat st;
+    int has_dir = stat(package_dir, &st) == 0 && S_ISDIR(st.st_mode);
+    if (catalog_loaded && has_dir && st.st_mtim.tv_sec == catalog_mtime.tv_sec &&
+        st.st_mtim.tv_nsec == catalog_mtime.tv_nsec) return;
+    if (catalog_loaded && !has_dir && !catalog_mtime.tv_sec && !catalog_mtime.tv_nsec) return;
+    catalog_clear();
+    for (int i=0;i<BUILTIN_PACKAGES;i++) catalog_add(builtin_packages[i][0], builtin_packages[i][1], builtin_packages[i][2]);
+    memset(&catalog_mtime, 0, sizeof(catalog_mtime));
+    catalog_loaded = 1;
+    if (!has_dir) return;
+    catalog_mtime = st.st_mtim;
+    char catpath[1024];
+    snprintf(catpath, sizeof(catpath), "%s/%s", package_dir, PACKAGE_CATALOG);
+    struct stat cst;
+    FILE* f = NULL;
+    // a catalog written before the last change to the directory may miss archives
+    if (stat(catpath, &cst) == 0 && (cst.st_mtim.tv_sec > st.st_mtim.tv_sec ||
+        (cst.st_mtim.tv_sec == st.st_mtim.tv_sec && cst.st_mtim.tv_nsec >= st.st_mtim.tv_nsec)))
+        f = fopen(catpath, "r");
+    if (!f) {
+        catalog_scan(catpath);
+        // writing the catalog may have changed the directory itself
+        if (stat(package_dir, &st) == 0) catalog_mtime = st.st_mtim;
+        return;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char* tab = strchr(line, '\t');
+        if (!tab || tab == line || tab - line >= MAX_NAME - 7) continue;
+        *tab = '\0';
+        catalog_add(line, tab+1, NULL);
+    }
+    fclose(f);
+}
+
+// 'packages': what the repository offers, and what of it is installed
+void cmd_packages() {
+    apps_wrlock();
+    catalog_refresh();
+    Directory* appdir = find_or_create_dir_by_path("/apps");
+    out_printf("Packages (%s):\n", package_dir);
+    for (int i=0;i<catalog.used;i++) {
+        Package* p = (Package*)catalog.slots[i].node;
+        if (!p) continue;
+        char target[MAX_NAME+8];
+        snprintf(target, sizeof(target), "%s.savapp", p->name);
+        out_printf("  %s - %s%s%s\n", p->name, p->desc, p->manifest ? " [built-in]" : "",
+                   dir_has_file(appdir, target) ? " (installed)" : "");
+    }
+    apps_unlock();
+}
+
+// one package of an install: read, parsed and compiled by a worker
+typedef struct InstallJob {
+    Package* pkg;
+    char* text;    // the manifest, split in place by parse_manifest
+    char* body;    // the manifest as it is stored in /apps
+    size_t size;
+    const char *name, *desc, *code;
+    Program* prog;
+    uint64_t code_hash;
+    char err[160];
+} InstallJob;
+
+typedef struct InstallBatch {
+    InstallJob* jobs;
+    uint32_t count;
+    uint32_t next; // claimed atomically
+} InstallBatch;
+
+char* read_host_file(const char* path, size_t* size) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return NULL;
+    size_t cap = 4096, n = 0;
+    char* buf = (char*)malloc(cap);
+    size_t got;
+    while ((got = fread(buf + n, 1, cap - n - 1, f)) > 0) {
+        n += got;
+        if (cap - n - 1 == 0) {
+            cap *= 2;
+            buf = (char*)realloc(buf, cap);
+        }
+    }
+    fclose(f);
+    buf[n] = '\0';
+    *size = n;
+    return buf;
+}
+
+void* install_main(void* arg) {
+    InstallBatch* b = (InstallBatch*)arg;
+    for (;;) {
+        uint32_t i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+        if (i >= b->count) break;
+        InstallJob* j = &b->jobs[i];
+        if (j->pkg->manifest) {
+            j->body = strdup(j->pkg->manifest);
+            j->size = strlen(j->body);
+        } else {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s.savapp", package_dir, j->pkg->name);
+            j->body = read_host_file(path, &j->size);
+            if (!j->body) { snprintf(j->err, sizeof(j->err), "cannot read its archive"); continue; }
+        }
+        j->text = (char*)malloc(j->size + 1);
+        memcpy(j->text, j->body, j->size + 1);
+        parse_manifest(j->text, &j->name, &j->desc, &j->code);
+        if (!j->name[0]) { snprintf(j->err, sizeof(j->err), "the archive has no APP_NAME"); continue; }
+        j->code_hash = fnv1a64(j->code, strlen(j->code), FNV64_INIT);
+        // a failed compile is reported but does not stop the install, as before
+        j->prog = compile_program(j->code, j->err, sizeof(j->err));
+    }
+    return NULL;
+}
+
+// "install <pkg> [<pkg> ...]" or "install --all"
+void install_app_command(const char* args) {
+    char* list = strdup(args);
+    int all = 0;
+    apps_wrlock();
+    catalog_refresh();
+    Directory* appdir = find_or_create_dir_by_path("/apps");
+    InstallBatch b = { NULL, 0, 0 };
+    int cap = 0, failed = 0;
+    char* save = NULL;
+    // every name is checked before anything is written
+    for (char* tok = strtok_r(list, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+        if (strcmp(tok, "--all") == 0) { all = 1; continue; }
+        Package* p = (Package*)et_find(&catalog, tok);
+        if (!p) { shell_error("Unknown package '%s'; 'packages' lists what there is.\n", tok); failed = 1; continue; }
+        if ((uint32_t)cap == b.count) {
+            cap = cap ? cap*2 : 16;
+            b.jobs = (InstallJob*)realloc(b.jobs, cap * sizeof(InstallJob));
+        }
+        memset(&b.jobs[b.count], 0, sizeof(InstallJob));
+        b.jobs[b.count++].pkg = p;
+    }
+    if (all) {
+        b.count = 0;
+        for (int i=0;i<catalog.used;i++) {
+            Package* p = (Package*)catalog.slots[i].node;
+            if (!p) continue;
+            if ((uint32_t)cap == b.count) {
+                cap = cap ? cap*2 : 16;
+                b.jobs = (InstallJob*)realloc(b.jobs, cap * sizeof(InstallJob));
+            }
+            memset(&b.jobs[b.count], 0, sizeof(InstallJob));
+            b.jobs[b.count++].pkg = p;
+        }
+    }
+    // drop names given twice, and what is installed already
+    for (uint32_t i=0;i<b.count;i++)
+        for (uint32_t k=0;k<i && b.jobs[i].pkg;k++)
+            if (b.jobs[k].pkg == b.jobs[i].pkg) b.jobs[i].pkg = NULL;
+    uint32_t n = 0;
+    for (uint32_t i=0;i<b.count && !failed;i++) {
+        if (!b.jobs[i].pkg) continue;
+        char target[MAX_NAME+8];
+        snprintf(target, sizeof(target), "%s.savapp", b.jobs[i].pkg->name);
+        if (dir_has_file(appdir, target)) {
+            if (!all) shell_error("Package '%s' already installed.\n", b.jobs[i].pkg->name);
+            continue;
+        }
+        b.jobs[n++] = b.jobs[i];
+    }
+    b.count = failed ? 0 : n;
+    if (b.count) run_workers(install_main, &b, worker_count(b.count, PACKAGES_PER_THREAD));
+    int installed = 0;
+    for (uint32_t i=0;i<b.count;i++) {
+        InstallJob* j = &b.jobs[i];
+        char target[MAX_NAME+8];
+        snprintf(target, sizeof(target), "%s.savapp", j->pkg->name);
+        // an app name already taken (by a built-in or another package) writes nothing
+        int ok = j->text && j->name[0];
+        int clash = ok && find_app_by_name(j->name);
+        Directory* q = NULL;
+        Content content = {0};
+        if (ok && !clash) {
+            content_append(&content, j->body, j->size);
+            q = vfs_write_file_quota(appdir, target, &content);
+        }
+        if (!ok) {
+            shell_error("Package '%s' not installed: %s.\n", j->pkg->name, j->err);
+        } else if (clash) {
+            shell_error("Package '%s' not installed: an app named '%s' is already registered.\n", j->pkg->name, j->name);
+            program_free(j->prog);
+        } else if (q) {
+            shell_error("Package '%s' not installed: it would exceed the quota of %s.\n", j->pkg->name, q->path);
+            program_free(j->prog);
+        } else {
+            App* a = register_app(j->name, j->desc, j->code, 0, target);
+            a->file_size = j->size;
+            a->compiled = 1;
+            a->prog = j->prog;
+            if (a->prog) app_cache_bytecode(appdir, a, j->code_hash);
+            else out_printf("App '%s' failed to compile: %s\n", a->name, j->err);
+            out_printf("Package '%s' installed.\n", j->pkg->name);
+            installed++;
+        }
+        free(j->text);
+        free(j->body);
+    }
+    if (installed) write_app_index(appdir);
+    apps_unlock();
+    if (installed > 1) out_printf("%d packages installed.\n", installed);
+    else if (all && !installed && !failed) out_printf("Every package is installed already.\n");
+    free(b.jobs);
+    free(list);
+}
+
+// ---------- Shell and main ----------
+void print_help() {
+    out_printf("Available commands:\n");
+    out_printf(" help                - show this help\n");
+    out_printf(" ls [dir]            - list contents of a directory (default: current)\n");
+    out_printf(" cd <dir>            - change directory\n");
+    out_printf(" back                - go up one directory\n");
+    out_printf(" mkdir <dir>         - create directory\n");
+    out_printf(" rmdir <dir>         - delete directory and its contents\n");
+    out_printf(" write <file>        - create/write a file (use END to finish)\n");
+    out_printf(" write <file> <<TAG  - same, but the content ends at a line that is just TAG\n");
+    out_printf(" cat <file>          - show file contents\n");
+    out_printf(" rm <file>           - delete file\n");
+    out_printf(" find <pattern>      - list files and directories by name (* and ? match anything)\n");
+    out_printf(" grep <word>         - show lines containing a word, in every file (case-insensitive)\n");
+    out_printf(" (dirs and files are paths: /a/b/c from the root, or a/b, ../x from here)\n");
+    out_printf(" clear               - clear virtual screen\n");
+    out_printf(" wipe [yes]          - delete ALL user data (keeps kernel)\n");
+    out_printf(" snapshot <name>     - remember the whole tree as it is now (instant)\n");
+    out_printf(" snapshot -d <name>  - delete a snapshot\n");
+    out_printf(" snapshots           - list snapshots\n");
+    out_printf(" restore <name>      - put the tree back the way it was at a snapshot\n");
+    out_printf(" du [dir]            - bytes, files and dirs under a directory and each subdirectory\n");
+    out_printf(" df                  - usage of the whole disk, its quota and the host files\n");
+    out_printf(" quota <dir> [bytes|none] - show, set or remove a byte limit on a directory\n");
+    out_printf(" calc <expr>         - evaluate expressions: + - * / %% ^ ( ), sqrt sin log min ..., pi, e\n");
+    out_printf(" calc name = <expr>  - set a variable; ';' separates statements\n");
+    out_printf(" calc -f <file> [expr] - each line of the file as statements, or expr for each number in it (x)\n");
+    out_printf(" apps                - list apps (built-in + installed)\n");
+    out_printf(" run <app>           - run an app (Ctrl-Z stops it on a terminal)\n");
+    out_printf(" run <app> [< file] [&] - run it on the file's text as input, or in the background\n");
+    out_printf(" ps                  - list this shell's tasks (the apps it started)\n");
+    out_printf(" fg [task]           - bring a task to the foreground (default: the newest)\n");
+    out_printf(" bg [task]           - let a stopped task go on in the background\n");
+    out_printf(" kill <task>         - end a task\n");
+    out_printf(" install <pkg>...    - install packages from the repository, all at once\n");
+    out_printf(" install --all       - install every package in the repository\n");
+    out_printf(" packages            - list the packages in the repository (host dir packages/)\n");
+    out_printf(" uninstall <app>     - uninstall installed app\n");
+    out_printf(" appinfo <app>       - show info about an app\n");
+    out_printf(" exportdisk <file>   - export the whole disk to a host file (text format)\n");
+    out_printf(" importdisk <file>   - merge a text-format disk from a host file\n");
+    out_printf(" import <hostdir> <dir> - copy a host directory tree into a new directory\n");
+    out_printf(" export <dir> <hostdir> - copy a directory tree out to a host directory\n");
+    out_printf(" sync                - wait until every change is durable on disk\n");
+    out_printf(" stats [reset]       - show command latencies, save/load and allocation counters\n");
+    out_printf(" exit                - exit GR4V1TYOS (auto-saved)\n");
+}
+
+// per-command latency histograms; the extra last slot collects unknown commands
+const char* shell_commands[] = {
+    "help", "ls", "cd", "back", "mkdir", "rmdir", "write", "cat", "rm", "find", "grep", "clear", "wipe",
+    "snapshot", "snapshots", "restore", "du", "df", "quota", "calc",
+    "sync", "apps", "run", "ps", "fg", "bg", "kill", "install", "packages", "uninstall", "appinfo", "exportdisk", "importdisk", "import", "export", "stats", "exit"
+};
+#define SHELL_NCOMMANDS (int)(sizeof(shell_commands)/sizeof(shell_commands[0]))
+StatHist command_stats[SHELL_NCOMMANDS+1];
+
+void print_hist_row(const char* name, const StatHist* h) {
+    out_printf("  %-12s %8llu %11.3f %10.1f %10.0f %10.0f %10.1f\n", name, (unsigned long long)h->count,
+           h->total_ns / 1e6, h->count ? h->total_ns / 1e3 / h->count : 0.0,
+           stat_percentile_us(h, 0.50), stat_percentile_us(h, 0.99), h->max_ns / 1e3);
+}
+
+void print_stats() {
+    StatHist cmds[SHELL_NCOMMANDS+1];
+    pthread_mutex_lock(&stats_mutex);
+    memcpy(cmds, command_stats, sizeof(cmds));
+    pthread_mutex_unlock(&stats_mutex);
+    out_printf("Commands:           count    total ms     avg us    ~p50 us    ~p99 us     max us\n");
+    for (int i=0;i<=SHELL_NCOMMANDS;i++) {
+        if (cmds[i].count) print_hist_row(i < SHELL_NCOMMANDS ? shell_commands[i] : "(unknown)", &cmds[i]);
+    }
+    out_printf("Saves:\n");
+    print_hist_row("save", &stats.save_time);
+    out_printf("  last image %llu bytes (%s, %llu bytes of distinct bodies), %llu records; %llu bytes written in total\n",
+           (unsigned long long)stats.last_save_bytes, image_codec == IMAGE_CODEC_LZ ? "lz" : "uncompressed",
+           (unsigned long long)stats.last_save_body_bytes, (unsigned long long)stats.last_save_records,
+           (unsigned long long)stats.save_bytes);
+    pthread_mutex_lock(&journal_lock); // the write-back thread counts its flushes
+    uint64_t flushes = stats.writeback_flushes;
+    pthread_mutex_unlock(&journal_lock);
+    out_printf("Journal: %llu records, %llu bytes appended, %llu write-back flushes\n",
+           (unsigned long long)stats.journal_records, (unsigned long long)stats.journal_bytes,
+           (unsigned long long)flushes);
+    out_printf("Load: %.3f ms (%llu dirs and %llu files from the image, %llu journal records replayed",
+           stats.load_ns / 1e6, (unsigned long long)stats.load_dirs, (unsigned long long)stats.load_files,
+           (unsigned long long)stats.replayed_records);
+    if (stats.load_threads > 1) out_printf(", decoded by %d threads", stats.load_threads);
+    out_printf(")\n");
+    out_printf("Nodes: %llu dirs created, %llu freed; %llu files created, %llu freed\n",
+           (unsigned long long)stats.dirs_created, (unsigned long long)stats.dirs_freed,
+           (unsigned long long)stats.files_created, (unsigned long long)stats.files_freed);
+    out_printf("Paths: %llu dentry cache hits, %llu misses\n",
+           (unsigned long long)stats.dcache_hits, (unsigned long long)stats.dcache_misses);
+    blob_lock();
+    size_t blobs = blob_count;
+    uint64_t bytes = blob_bytes;
+    blob_unlock();
+    out_printf("Blobs: %zu distinct bodies in memory (%llu bytes); %llu writes shared a stored body\n",
+           blobs, (unsigned long long)bytes, (unsigned long long)stats.blob_shared);
+    index_lock();
+    int words = word_table.count, names = name_table.count;
+    uint64_t postings = index_postings;
+    index_unlock();
+    out_printf("Index: %d distinct names, %d words in %llu postings\n", names, words, (unsigned long long)postings);
+}
+
+void cmd_stats(const char* arg) {
+    if (arg && strcmp(arg, "reset")==0) {
+        pthread_mutex_lock(&stats_mutex);
+        memset(command_stats, 0, sizeof(command_stats));
+        pthread_mutex_unlock(&stats_mutex);
+        pthread_mutex_lock(&journal_lock);
+        memset(&stats, 0, sizeof(stats));
+        pthread_mutex_unlock(&journal_lock);
+        out_printf("Stats reset.\n");
+        return;
+    }
+    print_stats();
+}
+
+int shell_dispatch(const char* line);
+
+// commands that free, replace or walk the whole tree; server mode runs them alone
+int command_is_exclusive(const char* cmd) {
+    return strcmp(cmd, "rmdir")==0 || strcmp(cmd, "wipe")==0 ||
+           strcmp(cmd, "snapshot")==0 || strcmp(cmd, "restore")==0 ||
+           strcmp(cmd, "importdisk")==0 || strcmp(cmd, "exportdisk")==0 ||
+           strcmp(cmd, "import")==0 || strcmp(cmd, "export")==0;
+}
+
+// runs one shell command line under the tree lock it needs, timing it by
+// command name; returns 0 when the shell should exit
+int shell_execute_line(const char* line) {
+    char cmd[128];
+    if (sscanf(line, "%127s", cmd) != 1 || cmd[0] == '#') return 1; // blank line or comment
+    // apps may drive the shell, but not tear down the app they are running from;
+    // in server mode they also cannot take locks their own run already holds shared
+    if (vm_depth > 0 && (strcmp(cmd, "exit")==0 || strcmp(cmd, "wipe")==0 ||
+                         strcmp(cmd, "uninstall")==0 || strcmp(cmd, "importdisk")==0 ||
+                         strcmp(cmd, "restore")==0 ||
+                         (server_mode && (command_is_exclusive(cmd) || strcmp(cmd, "install")==0 ||
+                                          strcmp(cmd, "packages")==0)))) {
+        shell_error("'%s' is not available inside apps.\n", cmd);
+        return 1;
+    }
+    int i = 0;
+    while (i < SHELL_NCOMMANDS && strcmp(shell_commands[i], cmd) != 0) i++;
+    uint64_t t0 = stat_now_ns();
+    // nested commands from an app run under the locks its task's turn holds
+    int top = (vm_depth == 0);
+    if (top && command_is_exclusive(cmd)) tree_wrlock();
+    else if (top) tree_rdlock();
+    int r = shell_dispatch(line);
+    if (top) tree_unlock();
+    uint64_t ns = stat_now_ns() - t0;
+    if (server_mode) pthread_mutex_lock(&stats_mutex);
+    stat_record(&command_stats[i], ns);
+    if (server_mode) pthread_mutex_unlock(&stats_mutex);
+    return r;
+}
+
+int shell_dispatch(const char* line) {
+    char cmd[128], arg[1024], extra[64]; // arg holds a path as long as resolve_dir takes
+    int end = 0;
+    int n = sscanf(line, "%127s %1023s%n %63s", cmd, arg, &end, extra);
+    if (n < 1) return 1;
+    int has_arg = (n >= 2);
+    // calc, run and install read the whole line themselves
+    int whole_line = strcmp(cmd, "calc")==0 || strcmp(cmd, "run")==0 || strcmp(cmd, "install")==0;
+    if (has_arg && !whole_line && line[end] && !strchr(" \t\r\n\v\f", line[end])) {
+        shell_error("Argument too long.\n");
+        return 1;
+    }
+
+    if (strcmp(cmd, "help")==0) print_help();
+    else if (strcmp(cmd, "ls")==0) list_dir(has_arg ? arg : NULL);
+    else if (strcmp(cmd, "cd")==0) {
+        if (!has_arg) { shell_error("cd needs an argument.\n"); return 1; }
+        cmd_cd(arg);
+    }
+    else if (strcmp(cmd, "back")==0) cmd_back();
+    else if (strcmp(cmd, "mkdir")==0) {
+        if (!has_arg) { shell_error("mkdir needs a name.\n"); return 1; }
+        cmd_mkdir(arg);
+    }
+    else if (strcmp(cmd, "rmdir")==0) {
+        if (!has_arg) { shell_error("rmdir needs a name.\n"); return 1; }
+        cmd_rmdir(arg);
+    }
+    else if (strcmp(cmd, "write")==0) {
+        if (!has_arg) { shell_error("write needs filename.\n"); return 1; }
+        // "write <file> <<TAG" takes the content inline, up to a line that is just TAG
+        const char* end = "END";
+        if (n == 3 && strncmp(extra, "<<", 2) == 0 && extra[2]) end = extra+2;
+        cmd_write(arg, end);
+    }
+    else if (strcmp(cmd, "cat")==0) {
+        if (!has_arg) { shell_error("cat needs filename.\n"); return 1; }
+        cmd_cat(arg);
+    }
+    else if (strcmp(cmd, "rm")==0) {
+        if (!has_arg) { shell_error("rm needs filename.\n"); return 1; }
+        cmd_rm(arg);
+    }
+    else if (strcmp(cmd, "find")==0) {
+        if (!has_arg) { shell_error("find needs a name or pattern.\n"); return 1; }
+        cmd_find(arg);
+    }
+    else if (strcmp(cmd, "grep")==0) {
+        if (!has_arg) { shell_error("grep needs a word to search for.\n"); return 1; }
+        cmd_grep(arg);
+    }
+    else if (strcmp(cmd, "clear")==0) cmd_clear();
+    else if (strcmp(cmd, "wipe")==0) cmd_wipe(has_arg ? arg : NULL);
+    else if (strcmp(cmd, "snapshot")==0) {
+        if (!has_arg) { shell_error("snapshot needs a name.\n"); return 1; }
+        cmd_snapshot(arg, n == 3 ? extra : NULL);
+    }
+    else if (strcmp(cmd, "snapshots")==0) cmd_snapshots();
+    else if (strcmp(cmd, "restore")==0) {
+        if (!has_arg) { shell_error("restore needs a snapshot name.\n"); return 1; }
+        cmd_restore(arg);
+    }
+    else if (strcmp(cmd, "du")==0) cmd_du(has_arg ? arg : NULL);
+    else if (strcmp(cmd, "df")==0) cmd_df();
+    else if (strcmp(cmd, "quota")==0) {
+        if (!has_arg) { shell_error("quota needs a directory.\n"); return 1; }
+        cmd_quota(arg, n == 3 ? extra : NULL);
+    }
+    else if (strcmp(cmd, "calc")==0) {
+        if (!has_arg) { shell_error("calc needs an expression.\n"); return 1; }
+        cmd_calc(line);
+    }
+    else if (strcmp(cmd, "sync")==0) cmd_sync();
+    else if (strcmp(cmd, "stats")==0) cmd_stats(has_arg ? arg : NULL);
+    else if (strcmp(cmd, "apps")==0) show_apps_command();
+    else if (strcmp(cmd, "run")==0) {
+        if (!has_arg) { shell_error("run needs appname.\n"); return 1; }
+        cmd_run(line);
+    }
+    else if (strcmp(cmd, "ps")==0) cmd_ps();
+    else if (strcmp(cmd, "fg")==0) cmd_fg(has_arg ? arg : NULL);
+    else if (strcmp(cmd, "bg")==0) cmd_bg(has_arg ? arg : NULL);
+    else if (strcmp(cmd, "kill")==0) {
+        if (!has_arg) { shell_error("kill needs a task number.\n"); return 1; }
+        cmd_kill(arg);
+    }
+    else if (strcmp(cmd, "install")==0) {
+        if (!has_arg) { shell_error("install needs packagename.\n"); return 1; }
+        // every word after the command is a package
+        const char* rest = line + strspn(line, " \t");
+        install_app_command(rest + strlen(cmd));
+    }
+    else if (strcmp(cmd, "packages")==0) cmd_packages();
+    else if (strcmp(cmd, "uninstall")==0) {
+        if (!has_arg) { shell_error("uninstall needs appname.\n"); return 1; }
+        uninstall_app_command(arg);
+    }
+    else if (strcmp(cmd, "appinfo")==0) {
+        if (!has_arg) { shell_error("appinfo needs appname.\n"); return 1; }
+        appinfo_command(arg);
+    }
+    else if (strcmp(cmd, "exportdisk")==0) {
+        if (!has_arg) { shell_error("exportdisk needs a host filename.\n"); return 1; }
+        cmd_exportdisk(arg);
+    }
+    else if (strcmp(cmd, "importdisk")==0) {
+        if (!has_arg) { shell_error("importdisk needs a host filename.\n"); return 1; }
+        cmd_importdisk(arg);
+    }
+    else if (strcmp(cmd, "import")==0 || strcmp(cmd, "export")==0) {
+        // host paths may be longer than 'extra' holds
+        char from[1024], to[1024];
+        if (sscanf(line, "%*s %1023s %1023s", from, to) != 2) { shell_error("%s needs a source and a target.\n", cmd); return 1; }
+        if (cmd[0] == 'i') cmd_import(from, to);
+        else cmd_export(from, to);
+    }
+    else if (strcmp(cmd, "exit")==0) {
+        if (server_mode) out_printf("Session closed.\n");
+        else out_printf("Exiting GR4V1TYOS... (filesystem saved)\n");
+        return 0;
+    }
+    else {
+        shell_error("Unknown command: %s (type 'help')\n", cmd);
+    }
+    return 1;
+}
+
+// ---------- Server ----------
+// kernel -S <socket> serves the shell to any number of local clients at once,
+// e.g. `socat - UNIX-CONNECT:<socket>`. Each connection is a session thread
+// with its own current directory and I/O streams; the tree, journal and app
+// registry are shared and guarded as described under Locking. SIGINT or
+// SIGTERM closes every session and shuts the server down cleanly.
+typedef struct Session {
+    int fd;
+    Directory** cwd; // the session thread's current_dir
+    struct Session* next;
+} Session;
+
+Session* sessions = NULL;
+int session_count = 0;
+pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sessions_done = PTHREAD_COND_INITIALIZER;
+int server_fd = -1;
+int server_stopping = 0; // under sessions_mutex
+
+void leave_dir(Directory** cwd, Directory* gone, Directory* to) {
+    int inside = (gone == NULL);
+    for (Directory* d = *cwd; d && !inside; d = d->parent) inside = (d == gone);
+    if (inside) *cwd = to;
+}
+
+// rmdir and wipe (with tree_lock held exclusively): sessions and tasks whose
+// current directory is 'gone' or below it (any, for NULL) move to 'to'; a
+// task's shell does too, as the task may be the one removing it
+void sessions_leave_dir(Directory* gone, Directory* to) {
+    pthread_mutex_lock(&sessions_mutex);
+    for (Session* s = sessions; s; s = s->next) leave_dir(s->cwd, gone, to);
+    pthread_mutex_unlock(&sessions_mutex);
+    pthread_mutex_lock(&task_mutex);
+    for (Task* t = all_tasks; t; t = t->all_next) {
+        if (t->cwd) leave_dir(t->cwd, gone, to);
+        leave_dir(t->owner_cwd, gone, to);
+    }
+    pthread_mutex_unlock(&task_mutex);
+}
+
+// compaction forks a snapshot of the tree, so it waits until nothing is mid-change
+void server_maybe_compact() {
+    pthread_mutex_lock(&journal_lock);
+    int due = journal_bytes >= JOURNAL_COMPACT_BYTES;
+    pthread_mutex_unlock(&journal_lock);
+    if (!due) {
+        // compact_pid only changes under the tree write lock
+        tree_rdlock();
+        int running = compact_pid > 0;
+        tree_unlock();
+        if (!running) return;
+    }
+    tree_wrlock();
+    journal_maybe_compact();
+    tree_unlock();
+}
+
+void* session_main(void* arg) {
+    Session* s = (Session*)arg;
+    shell_in = fdopen(s->fd, "r");
+    if (!shell_in) close(s->fd);
+    else {
+        shell_out = outbuf_new(s->fd);
+        tree_rdlock();
+        current_dir = root;
+        tree_unlock();
+        pthread_mutex_lock(&sessions_mutex);
+        s->cwd = &current_dir;
+        s->next = sessions;
+        sessions = s;
+        int stopping = server_stopping; // set before shutdown starts waking the listed sessions
+        pthread_mutex_unlock(&sessions_mutex);
+
+        out_printf("Welcome to GR4V1TYOS v4.0\nType 'help' for commands.\n");
+        char* line = NULL;
+        size_t cap = 0;
+        while (!stopping) {
+            tree_rdlock();
+            out_printf("GR4V1TYOS:%s> ", current_dir->path);
+            tree_unlock();
+            if (shell_getline(&line, &cap) < 0) break;
+            int r = shell_execute_line(line);
+            if (r) tasks_run();
+            server_maybe_compact();
+            if (!r) break;
+        }
+        free(line);
+        tasks_end();
+
+        pthread_mutex_lock(&sessions_mutex);
+        for (Session** p = &sessions; *p; p = &(*p)->next) {
+            if (*p == s) { *p = s->next; break; }
+        }
+        pthread_mutex_unlock(&sessions_mutex);
+        out_flush();
+        free(shell_out);
+        fclose(shell_in);
+        shell_in = NULL;
+        shell_out = NULL;
+    }
+    free(s);
+    pthread_mutex_lock(&sessions_mutex);
+    session_count--;
+    pthread_cond_broadcast(&sessions_done);
+    pthread_mutex_unlock(&sessions_mutex);
+    return NULL;
+}
+
+// waits for SIGINT/SIGTERM (blocked in every thread) and unblocks accept()
+void* server_signal_main(void* arg) {
+    sigset_t* set = (sigset_t*)arg;
+    int sig;
+    sigwait(set, &sig);
+    pthread_mutex_lock(&sessions_mutex);
+    server_stopping = 1;
+    pthread_mutex_unlock(&sessions_mutex);
+    shutdown(server_fd, SHUT_RDWR);
+    return NULL;
+}
+
+// accepts sessions until a signal arrives; returns 0 on a clean shutdown
+int run_server(const char* path, sigset_t* stop_signals) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) { out_printf("Error: socket path too long.\n"); return 1; }
+    strcpy(addr.sun_path, path);
+    server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd < 0) { out_printf("Error: could not create socket.\n"); return 1; }
+    unlink(path);
+    if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(server_fd, 64) != 0) {
+        out_printf("Error: could not listen on '%s'.\n", path);
+        close(server_fd);
+        return 1;
+    }
+    pthread_t sig_thread;
+    pthread_create(&sig_thread, NULL, server_signal_main, stop_signals);
+    out_printf("GR4V1TYOS server listening on %s\n", path);
+    out_flush();
+
+    while (1) {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        Session* s = (Session*)malloc(sizeof(Session));
+        memset(s, 0, sizeof(*s));
+        s->fd = fd;
+        pthread_mutex_lock(&sessions_mutex);
+        session_count++;
+        pthread_mutex_unlock(&sessions_mutex);
+        pthread_t t;
+        if (pthread_create(&t, NULL, session_main, s) != 0) {
+            close(fd);
+            free(s);
+            pthread_mutex_lock(&sessions_mutex);
+            session_count--;
+            pthread_mutex_unlock(&sessions_mutex);
+            continue;
+        }
+        pthread_detach(t);
+    }
+
+    // wake every session out of its read and wait for it to wind down
+    pthread_mutex_lock(&sessions_mutex);
+    int stopping = server_stopping;
+    pthread_mutex_unlock(&sessions_mutex);
+    if (!stopping) pthread_kill(sig_thread, SIGTERM);
+    pthread_join(sig_thread, NULL);
+    pthread_mutex_lock(&sessions_mutex);
+    for (Session* s = sessions; s; s = s->next) shutdown(s->fd, SHUT_RDWR);
+    while (session_count > 0) pthread_cond_wait(&sessions_done, &sessions_mutex);
+    pthread_mutex_unlock(&sessions_mutex);
+    close(server_fd);
+    unlink(path);
+    out_printf("GR4V1TYOS server stopped.\n");
+    return 0;
+}
+
+#ifndef GR4V1TYOS_NO_MAIN
+void usage() {
+    out_printf("usage: kernel [-b [script|-]] [-e] [-s] [-z lz|none] [-j n] | kernel -S socket [-s] [-z lz|none] [-j n]\n");
+    out_printf("  -b   batch mode: run commands from script (or stdin) without prompts\n");
+    out_printf("  -S   serve the shell to many clients at once on a Unix domain socket\n");
+    out_printf("  -e   with -b, stop at the first command that fails\n");
+    out_printf("  -s   print the 'stats' report on exit\n");
+    out_printf("  -z   store file bodies LZ-compressed in savdisk.img, or not; the disk is\n");
+    out_printf("       rewritten at startup if it differs (default: keep what the disk uses)\n");
+    out_printf("  -j   worker threads for decoding a compressed savdisk.img and installing\n");
+    out_printf("       packages (default: one per CPU)\n");
+}
+
+int main(int argc, char** argv) {
+    const char* script = NULL;
+    const char* socket_path = NULL;
+    int stop_on_error = 0;
+    int stats_at_exit = 0;
+    int codec = -1;
+    atexit(out_flush); // whatever the main thread's buffer still holds
+    for (int i=1;i<argc;i++) {
+        if (strcmp(argv[i], "-b")==0) batch_mode = 1;
+        else if (strcmp(argv[i], "-e")==0) stop_on_error = 1;
+        else if (strcmp(argv[i], "-s")==0) stats_at_exit = 1;
+        else if (strcmp(argv[i], "-S")==0 && i+1 < argc) socket_path = argv[++i];
+        else if (strcmp(argv[i], "-z")==0 && i+1 < argc && strcmp(argv[i+1], "lz")==0) { codec = IMAGE_CODEC_LZ; i++; }
+        else if (strcmp(argv[i], "-z")==0 && i+1 < argc && strcmp(argv[i+1], "none")==0) { codec = IMAGE_CODEC_NONE; i++; }
+        else if (strcmp(argv[i], "-j")==0 && i+1 < argc && atoi(argv[i+1]) > 0) worker_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-")==0 && batch_mode && !script) continue; // stdin
+        else if (argv[i][0] != '-' && batch_mode && !script) script = argv[i];
+        else { usage(); return 2; }
+    }
+    if (socket_path && batch_mode) { usage(); return 2; }
+    // the script stands in for stdin, so write/notepad/input() read from it too
+    if (script && !freopen(script, "r", stdin)) { out_printf("Error: could not open script '%s'.\n", script); return 2; }
+    journal_deferred = batch_mode;
+    // server: SIGINT/SIGTERM are collected by one thread (see run_server), so
+    // they are blocked before any thread starts and every thread inherits that
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    if (socket_path) {
+        server_mode = 1;
+        signal(SIGPIPE, SIG_IGN); // a client hanging up must not kill the server
+        pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    }
+
+    // init root
+    root = create_dir("/", NULL);
+    current_dir = root;
+
+    // load FS
+    load_filesystem();
+    if (codec >= 0 && codec != image_codec) {
+        image_codec = codec;
+        save_filesystem();
+    }
+    if (!batch_mode) {
+        journal_open();
+        writeback_start();
+    }
+
+    // init builtin apps
+    init_builtin_apps();
+
+    // load installed apps from /apps in vfs
+    load_installed_apps_from_vfs();
+
+    if (socket_path) {
+        int r = run_server(socket_path, &stop_signals);
+        if (stats_at_exit) print_stats();
+        journal_close();
+        vfs_release_all();
+        image_unmap();
+        return r;
+    }
+
+    if (!batch_mode) out_printf("Welcome to GR4V1TYOS v4.0\nType 'help' for commands.\n");
+    if (!batch_mode && isatty(STDIN_FILENO)) {
+        // Ctrl-Z stops the foreground task, not the shell; no SA_RESTART, so it
+        // also interrupts the read the shell waits in
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = task_stop_signal;
+        sigaction(SIGTSTP, &sa, NULL);
+    }
+
+    char* line = NULL;
+    size_t cap = 0;
+    while (1) {
+        if (!batch_mode) {
+            out_printf("GR4V1TYOS:%s> ", current_dir->path);
+        }
+        ssize_t n = shell_getline(&line, &cap);
+        if (n == -2) { __atomic_store_n(&task_stop_requested, 0, __ATOMIC_RELAXED); out_printf("\n"); continue; } // Ctrl-Z at the prompt
+        if (n < 0) break;
+        if (!shell_execute_line(line)) break;
+        tasks_run();
+        if (stop_on_error && shell_status) break;
+    }
+    free(line);
+    tasks_end();
+
+    // batch mode: the one deferred save
+    if (disk_dirty) save_filesystem();
+    if (stats_at_exit) print_stats();
+
+    // cleanup on exit
+    journal_close();
+    vfs_release_all();
+    image_unmap();
+    return batch_mode ? shell_status : 0;
+}
+#endif